@@ -1,13 +1,26 @@
 #include <stdio.h>     // Standard I/O functions
 #include <stdlib.h>    // Standard library definitions for convenience functions and memory allocation
 #include <string.h>    // String operations like strlen and strcpy
+#include <strings.h>   // strcasecmp for case-insensitive FAT names
 #include <time.h>      // Time manipulation functions like mktime
 #include <stdint.h>    //for uint8_t etc
+#include <stddef.h>    // offsetof for the FAT32 boot sector extension
 #include <fcntl.h>     // File control options for open
 #include <unistd.h>    // POSIX constants and system calls like close
 #include <sys/types.h> // Definitions for system types like off_t
 #include <sys/stat.h>  // Definitions for file status like fstat
+#include <sys/mman.h>  // mmap for the memory-mapped volume backend
+#include <sys/uio.h>   // preadv for batched reads
 #include <stdbool.h>   //for boolean
+#include <errno.h>     // errno for retrying interrupted reads
+#include <pthread.h>   // mutexes for the shared block cache
+#include <sys/sendfile.h>    // sendfile fallback for in-kernel extraction copies
+#include <sys/syscall.h>     // raw io_uring system calls
+#include <sys/eventfd.h>     // completion notification for event loops
+#include <linux/io_uring.h>  // io_uring ring layout and opcodes
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>       // SSE2/AVX2 intrinsics for the directory scan kernels
+#endif
 #include <wchar.h>     // for wprintf
 #include <locale.h>     //temporary to fix the wprintf issue
 
@@ -36,6 +49,24 @@ typedef struct __attribute__((__packed__))
     uint8_t BS_FilSysType[8]; // e.g. 'FAT16 ' (Not 0 term.)
 } BootSector;
 
+// struct definition to represent the FAT32 part of the BIOS Parameter Block, at byte 36 where FAT16 keeps BS_DrvNum
+typedef struct __attribute__((__packed__))
+{
+    uint32_t BPB_FATSz32;     // Sectors in one FAT, BPB_FATSz16 is 0
+    uint16_t BPB_ExtFlags;    // bit 7 set: only FAT (bits 0-3) is active
+    uint16_t BPB_FSVer;       // Should = 0
+    uint32_t BPB_RootClus;    // First cluster of the root directory
+    uint16_t BPB_FSInfo;      // Sector of the FSInfo structure
+    uint16_t BPB_BkBootSec;   // Sector of the backup boot sector
+    uint8_t BPB_Reserved[12]; //
+    uint8_t BS_DrvNum;        // 0 = floppy, 0x80 = hard disk
+    uint8_t BS_Reserved1;     //
+    uint8_t BS_BootSig;       // Should = 0x29
+    uint32_t BS_VolID;        // 'Unique' ID for volume
+    uint8_t BS_VolLab[11];    // Non zero terminated string
+    uint8_t BS_FilSysType[8]; // 'FAT32   ' (Not 0 term.)
+} BootSector32;
+
 // struct definition to represent a DIRECTORY ENTRY in a FAT16 file system
 typedef struct __attribute__((__packed__))
 {
@@ -53,23 +84,279 @@ typedef struct __attribute__((__packed__))
     uint32_t DIR_FileSize;    // File size in bytes
 } DirectoryEntry;
 
+#define CACHE_SHARDS 16          // independent locks in the block cache, clusters are spread across them
+#define CACHE_BYPASS_CLUSTERS 2  // readFile runs at least this many clusters long skip the cache
+#define READAHEAD_MIN_CLUSTERS 4  // first readahead window once a File reads sequentially
+#define READAHEAD_MAX_CLUSTERS 64 // the window doubles on each sequential read up to this
+#define CLUSTER_END 0x0FFFFFF8   // FAT16 end-of-chain values are widened to this and above
+#define CLUSTER_EOC 0x0FFFFFFF   // end-of-chain marker, also terminates getClusterChain's array
+#define FAT32_MIN_CLUSTERS 65525 // volumes with at least this many clusters are FAT32
+#define FAT_WINDOW_ENTRIES 16384 // FAT32 entries per cached FAT window (64 KiB)
+#define FAT_WINDOW_BUDGET (4u << 20) // default memory for cached FAT windows
+
+// struct definition to represent one cached cluster, linked into its shard's hash bucket and LRU list
+typedef struct CacheBlock
+{
+    uint32_t cluster;            // data cluster, or window number in the FAT window cache
+    struct CacheBlock *hashNext; // next block in the same hash bucket
+    struct CacheBlock *prev;     // towards the most recently used end
+    struct CacheBlock *next;     // towards the least recently used end
+    uint8_t data[];              // one cluster of data
+} CacheBlock;
+
+// struct definition to represent one lock-protected slice of the block cache
+typedef struct
+{
+    pthread_mutex_t lock;
+    CacheBlock **buckets; // hash table of cached clusters
+    uint32_t bucketMask;  // bucket count - 1, bucket count is a power of two
+    CacheBlock *head;     // most recently used
+    CacheBlock *tail;     // least recently used, evicted first
+    uint32_t count;       // blocks currently held
+    uint32_t capacity;    // blocks this shard may hold
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} CacheShard;
+
+// struct definition to represent the cluster cache shared by every File on a volume, also used for FAT32 FAT windows
+typedef struct
+{
+    uint32_t clusterSize; // bytes per cached block
+    CacheShard shards[CACHE_SHARDS];
+} BlockCache;
+
+// struct definition to represent a snapshot of the block cache counters
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t blocks;   // clusters currently cached
+    uint32_t capacity; // clusters the budget allows
+} CacheStats;
+
+// struct definition to represent one cached name -> directory entry mapping
+typedef struct DentryNode
+{
+    struct DentryNode *next; // next node in the same hash bucket
+    uint32_t hash;
+    uint32_t parentCluster;  // directory the entry lives in, 0 for the root directory
+    DirectoryEntry entry;
+    char name[];             // case-folded UTF-8 name, short (8.3) or long
+} DentryNode;
+
+// struct definition to represent the per-volume directory entry cache used by path lookups
+typedef struct
+{
+    pthread_mutex_t lock;
+    DentryNode **buckets;
+    uint32_t bucketMask;   // bucket count - 1, bucket count is a power of two
+    uint32_t count;        // names cached
+    uint8_t *loaded;       // bit per directory cluster: all of its entries are in the table
+    uint32_t clusterCount; // data clusters, loaded has bits for clusters 0 .. clusterCount + 1
+} DentryCache;
+
+// struct definition to represent a run of free clusters kept by the write allocator
+typedef struct
+{
+    uint16_t start;
+    uint16_t length;
+} FreeRun;
+
+#ifndef READFAT_STATS
+#define READFAT_STATS 1 // build with -DREADFAT_STATS=0 to compile the counters and histograms out
+#endif
+#define STAT_BUCKETS 32 // latency histogram bucket b counts times in [2^b, 2^(b+1)) nanoseconds
+
+// operations with a latency histogram in VolumeStats
+#define STAT_OP_READ 0        // readVolume: one pread, or one copy out of the mapping
+#define STAT_OP_CHAIN_WALK 1  // buildExtents: one whole chain followed through the FAT
+#define STAT_OP_DIRECTORY 2   // dirFill: one cluster of directory entries
+#define STAT_OP_READ_FILE 3   // one readFile call
+#define STAT_OPS 4
+
+// struct definition to represent the hot path counters of a volume, see volumeGetStats
+typedef struct
+{
+    uint64_t syscalls;      // reads, writes, copies, syncs and fadvise calls issued on the image
+    uint64_t bytesRead;     // bytes read from the image, pread, mapping or in-kernel copies
+    uint64_t sectorsRead;   // sectors those reads touched
+    uint64_t bytesWritten;
+    uint64_t fatLookups;    // FAT entries read by nextCluster
+    uint64_t clusterHops;   // of those, links to a cluster that is not the next one on disk
+    uint64_t cacheHits;     // block cache, filled in by volumeGetStats
+    uint64_t cacheMisses;
+    uint64_t bounceBytes;   // bytes readFile copied through its one-sector bounce buffer
+    uint64_t fatWindowHits; // FAT32 FAT window cache, filled in by volumeGetStats
+    uint64_t fatWindowMisses;
+    uint64_t latency[STAT_OPS][STAT_BUCKETS];
+} VolumeStats;
+
+#if READFAT_STATS
+#define STAT_ADD(volume, counter, n) __atomic_fetch_add(&(volume)->stats->counter, (n), __ATOMIC_RELAXED)
+#define STAT_TIMER_START(timer) uint64_t timer = nowNanoseconds()
+#define STAT_TIMER_STOP(volume, op, timer) statRecordLatency((volume)->stats, (op), nowNanoseconds() - (timer))
+#else
+#define STAT_ADD(volume, counter, n) ((void)0)
+#define STAT_TIMER_START(timer) ((void)0)
+#define STAT_TIMER_STOP(volume, op, timer) ((void)0)
+#endif
+
 // struct definition to represent a volume
+// Thread safety: after mountVolume (and mapVolume, if used) a Volume is only read, and every
+// access to the image goes through pread or the read-only mapping, so one Volume can be shared
+// by any number of threads. mapVolume/unmapVolume/unmountVolume must not race with readers.
+// Once enableWrites has been called the Volume belongs to one thread at a time.
 typedef struct
 {
     int fd;
     BootSector bootSector;
+    uint16_t *fat;            // in-memory copy of the FAT, loaded once at mount time, NULL on FAT32
+    uint32_t fatEntries;      // number of entries in one FAT
+    bool isFAT32;             // 32-bit FAT read through fatWindows, root directory is a cluster chain
+    uint32_t fatSectors;      // sectors per FAT, BPB_FATSz16 or BPB_FATSz32
+    uint32_t activeFAT;       // FAT copy reads come from, only non-zero when FAT32 mirroring is off
+    uint32_t rootCluster;     // first cluster of the FAT32 root directory, 0 on FAT16
+    BlockCache *fatWindows;   // FAT32: LRU cache of FAT_WINDOW_ENTRIES-entry windows, loaded on demand
+    uint32_t firstDataSector; // first sector of the data region (cluster 2)
+    uint32_t clusterCount;    // number of data clusters on the volume
+    const uint8_t *map;       // whole image mapped read-only by mapVolume, NULL when using read()
+    size_t mapSize;           // length of the mapping in bytes
+    BlockCache *cache;        // shared cluster cache set up by enableCache, NULL when disabled
+    DentryCache *dentries;    // names of directories already searched, filled by path lookups
+    bool writable;            // enableWrites succeeded, the image is open read-write
+    uint8_t *dirtyFAT;        // bit per FAT sector changed since the last flushVolume
+    FreeRun *freeRuns;        // free clusters as runs sorted by start, for the allocator
+    uint32_t freeRunCount;
+    uint32_t freeRunCapacity;
+#if READFAT_STATS
+    VolumeStats *stats;       // counters updated with relaxed atomics by every thread using the volume
+#endif
 } Volume;
 
+// struct definition to represent a zero-copy view of part of a file inside a mapped volume
+typedef struct
+{
+    const uint8_t *data; // points into the volume mapping, valid until unmapVolume
+    size_t length;       // number of bytes at data
+} Span;
+
+// struct definition to represent a run of physically contiguous clusters in a file
+typedef struct
+{
+    uint32_t logicalCluster; // index of the run's first cluster within the file
+    uint32_t startCluster;   // physical cluster the run starts at
+    uint32_t length;         // number of contiguous clusters in the run
+} Extent;
+
 // struct definition to represent an open file.
+// A File carries its own position, so each thread should use its own File; many Files may be
+// open on the same Volume concurrently.
 typedef struct
 {
     Volume *volume;          // Volume where the file resides
     DirectoryEntry dirEntry; // Directory entry of the file
     uint32_t fileSize;       // Size of the file
     uint32_t filePosition;   // Current position in the file
-    uint16_t currentCluster; // Current cluster in the file chain
+    uint32_t currentCluster; // Current cluster in the file chain
+    Extent *extents;         // Run-length map of the cluster chain, sorted by logicalCluster
+    uint32_t extentCount;    // Number of entries in extents
+    uint32_t lastReadEnd;    // Position the previous readFile stopped at, to spot sequential access
+    uint32_t readahead;      // Current readahead window in clusters, 0 while access looks random
+    uint32_t prefetchedTo;   // Logical cluster up to which readahead has already been requested
+    bool writable;           // Opened through createFile, so writeFile and truncateFile are allowed
+    bool entryDirty;         // dirEntry changed since it was last written back to the directory
+    uint32_t parentCluster;  // Directory holding the entry, 0 for the root directory
+    uint32_t entrySlot;      // Index of the short entry among the directory's 32-byte slots
 } File;
 
+#define BATCH_MAX_GAP (64 * 1024)       // readBatch reads through holes up to this size instead of issuing another read
+#define BATCH_MAX_READ (8 * 1024 * 1024) // largest span of the image one merged readBatch read may cover
+#define BATCH_MAX_IOVECS 1024            // iovecs in one vectored read, the kernel's IOV_MAX
+
+// struct definition to represent one read of a readBatch call
+typedef struct
+{
+    File *file;       // file to read from, not moved; NULL to open path instead
+    const char *path; // opened and closed by readBatch when file is NULL
+    uint64_t offset;  // byte offset in the file
+    size_t length;    // bytes wanted, cut short at the end of the file
+    void *buffer;     // destination, at least length bytes
+    ssize_t result;   // set by readBatch: bytes read, or -1
+} BatchRequest;
+
+// struct definition to represent the part of a batch request that lies in one run of contiguous clusters
+typedef struct
+{
+    off_t diskOffset; // where the piece starts in the image
+    size_t length;
+    uint8_t *buffer;  // where it goes
+    uint32_t request; // index of the BatchRequest it belongs to
+    size_t copyFrom;  // index of a piece read in the same group that holds this one, SIZE_MAX if read itself
+} BatchPiece;
+
+#define ASYNC_MAX_SEGMENT (1u << 30) // largest single read handed to io_uring or a worker
+
+// callback run by asyncPoll when an asynchronous read finishes: bytes read, or -errno
+typedef void (*AsyncCallback)(void *userData, ssize_t result);
+
+// struct definition to represent one asynchronous read as seen by the caller
+typedef struct
+{
+    AsyncCallback callback;
+    void *userData;
+    uint32_t pending; // segments still in flight
+    ssize_t result;   // bytes read so far, or the first -errno
+} AsyncRequest;
+
+// struct definition to represent one positional read of a contiguous byte range
+typedef struct AsyncSegment
+{
+    AsyncRequest *request;
+    int fd;
+    off_t offset;
+    uint8_t *buffer;
+    size_t length;             // bytes still to read
+    ssize_t result;            // completion result for this piece
+    struct AsyncSegment *next; // link in the waiting or completed queue
+} AsyncSegment;
+
+// struct definition to represent the shared memory rings of an io_uring instance
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+} IoRing;
+
+// struct definition to represent an async read engine, driven by one event-loop thread
+typedef struct
+{
+    bool useRing;                // io_uring when available, otherwise the worker pool
+    int eventFd;                 // becomes readable when completions are waiting for asyncPoll
+    IoRing ring;
+    unsigned inFlight;           // segments submitted to the ring
+    uint32_t outstanding;        // requests whose callback has not run yet
+    AsyncSegment *waitingHead;   // segments not yet submitted (ring full) or queued for workers
+    AsyncSegment *waitingTail;
+    AsyncSegment *doneHead;      // finished segments waiting for asyncPoll
+    AsyncSegment *doneTail;
+    pthread_mutex_t lock;        // protects the queues shared with workers
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    pthread_t *workers;
+    int workerCount;
+    bool stopping;
+} AsyncContext;
+
 // struct definition to represent LONG DIRECTORY ENTRY
 typedef struct __attribute__((__packed__))
 {
@@ -83,35 +370,694 @@ typedef struct __attribute__((__packed__))
     uint8_t LDIR_Name3[4];   // Last 2 UNICODE characters
 } LongDirectoryEntry;
 
+#define LFN_MAX_PARTS 20 // 20 entries * 13 characters covers the 255 character limit
+
+// struct definition to represent one live entry returned by the directory iterator
+typedef struct
+{
+    DirectoryEntry entry;                  // the short (8.3) entry itself
+    char shortName[13];                    // "NAME.EXT"
+    char name[LFN_MAX_PARTS * 13 * 3 + 1]; // UTF-8 long name when there is a valid one, otherwise shortName
+    bool hasLongName;
+    bool badLongName; // LFN entries came before this entry but were broken or did not match its checksum
+    uint32_t slot;         // index of the short entry among the directory's 32-byte slots
+    uint8_t longNameSlots; // LFN entries right before the short entry that belong to it
+} DirectoryItem;
+
+// struct definition to represent a long file name being collected from its entries, in directory order
+typedef struct
+{
+    uint16_t units[LFN_MAX_PARTS * 13]; // UTF-16 code units
+    uint8_t checksum;                   // short name checksum every part must carry
+    int nextOrd;                        // order number the next part must have, 0 when idle
+    int parts;                          // parts in the name
+    bool dropped;                       // parts were discarded since the last short entry
+} LongNameState;
+
+// struct definition to represent an open directory being read one cluster at a time
+typedef struct
+{
+    const Volume *volume;
+    uint32_t firstCluster;   // 0 for the fixed root directory region
+    uint32_t nextCluster;    // cluster to load after the buffered one, subdirectories only
+    uint32_t rootRemaining;  // root directory entries not yet loaded
+    off_t rootOffset;        // byte offset of the next root directory chunk
+    uint32_t clustersRead;   // guards against looping chains
+    DirectoryEntry *buffer;  // one cluster's worth of entries
+    uint8_t *classes;        // ENTRY_* class of each buffered entry, from classifyEntries
+    uint32_t bufferEntries;  // entries currently in buffer
+    uint32_t index;          // next entry to look at in buffer
+    uint32_t bufferFirstSlot; // slot number of buffer[0] within the directory
+    bool finished;           // end marker seen or chain exhausted
+    LongNameState longName;
+} DirIterator;
+
+// callback run by walkVolume for every entry below the root, from any worker thread
+typedef void (*WalkVisitor)(const char *path, const DirectoryItem *item, void *userData);
+
+// struct definition to represent one directory waiting to be scanned by the walker
+typedef struct
+{
+    uint32_t cluster; // first cluster of the directory, 0 for the root
+    char *path;       // its path, "" for the root
+} WalkTask;
+
+// struct definition to represent one worker's deque: the owner pushes and pops at the bottom, thieves take from the top
+typedef struct
+{
+    pthread_mutex_t lock;
+    WalkTask *tasks;
+    size_t top;      // oldest task, where thieves steal
+    size_t bottom;   // one past the newest task, where the owner works
+    size_t capacity;
+} WalkDeque;
+
+// struct definition to represent the state shared by the walker threads
+typedef struct
+{
+    Volume *volume;
+    WalkVisitor visitor;
+    void *userData;
+    WalkDeque *deques;
+    int workerCount;
+    uint32_t pending;      // directories queued or being scanned, the walk ends when it drops to 0
+    uint32_t queued;       // directories sitting in some deque, waiting to be taken
+    uint8_t *visited;      // bit per directory cluster, so a looping tree is scanned once
+    pthread_mutex_t idleLock;
+    pthread_cond_t workAvailable; // signalled when a task is queued or pending drops to 0
+    int idleCount;                // workers parked on workAvailable
+} WalkState;
+
+// struct definition to represent the arguments of one walker thread
+typedef struct
+{
+    WalkState *state;
+    int worker;
+} WalkWorkerArgs;
+
+#define SIDECAR_MAGIC "F16INDEX" // first eight bytes of a sidecar index file
+#define SIDECAR_VERSION 2
+
+// struct definition to represent the header at the start of a sidecar index file, all offsets from file start
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t volumeId;      // BS_VolID of the image the index describes
+    uint64_t fatChecksum;   // FNV-1a of the FAT, any change to the FAT invalidates the index
+    uint32_t entryCount;
+    uint32_t extentCount;
+    uint64_t entriesOffset; // SidecarEntry array, sorted case-insensitively by path
+    uint64_t extentsOffset; // Extent array, each entry owns a contiguous slice
+    uint64_t stringsOffset; // NUL-terminated paths
+    uint64_t stringsSize;
+    uint64_t fileSize;      // total size, a truncated index is rejected
+} SidecarHeader;
+
+// struct definition to represent one path in a sidecar index
+typedef struct
+{
+    uint32_t pathOffset;  // into the string pool
+    uint32_t size;
+    uint32_t firstExtent; // index of this entry's first Extent
+    uint32_t extentCount;
+    uint16_t firstCluster;
+    uint8_t attributes;
+    uint8_t reserved;
+    uint16_t crtDate, crtTime;
+    uint16_t wrtDate, wrtTime;
+    uint32_t reserved2;
+} SidecarEntry;
+
+// struct definition to represent a sidecar index mapped into memory
+typedef struct
+{
+    const uint8_t *map;
+    size_t size;
+    const SidecarHeader *header;
+    const SidecarEntry *entries;
+    const Extent *extents;
+    const char *strings;
+} SidecarIndex;
+
+// struct definition to represent one file or directory recorded by buildManifest
+typedef struct
+{
+    char *path;
+    uint32_t size;
+    uint8_t attributes;
+    uint32_t firstCluster;
+    uint16_t crtDate, crtTime; // raw FAT creation date and time
+    uint16_t wrtDate, wrtTime; // raw FAT last write date and time
+} ManifestEntry;
+
+// struct definition to represent the whole namespace of a volume, sorted by path
+typedef struct
+{
+    ManifestEntry *entries;
+    size_t count;
+    size_t capacity;
+    pthread_mutex_t lock; // held while walker threads append
+} Manifest;
+
+#define ARENA_BLOCK_SIZE (1024 * 1024) // bytes per arena block, bigger allocations get a block of their own
+#define TREE_NONE UINT32_MAX           // node index returned when a name or path is not in a DirectoryTree
+
+// struct definition to represent one block of an arena, allocations are carved off its data in order
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next; // blocks are freed together, order does not matter
+    size_t size;             // bytes in data
+    size_t used;
+    uint8_t data[];
+} ArenaBlock;
+
+// struct definition to represent a bump allocator: nothing is freed on its own, arenaRelease frees everything
+typedef struct
+{
+    ArenaBlock *blocks; // the block small allocations come from is first
+    size_t bytes;       // total handed out
+} Arena;
+
+// struct definition to represent the whole namespace of a volume held in memory, one array per field.
+// Nodes are numbered breadth first from the root (node 0), so a directory's children are the consecutive
+// nodes firstChild .. firstChild + childCount - 1, sorted case-insensitively by name
+typedef struct
+{
+    Arena arena;               // every array below, freeDirectoryTree releases it in one go
+    uint32_t count;            // nodes, the root included
+    uint32_t *nameOffset;      // UTF-8 long name, or the 8.3 name when there is none, in names
+    uint32_t *shortNameOffset; // "NAME.EXT" in names
+    uint32_t *parent;          // the root is its own parent
+    uint32_t *firstChild;
+    uint32_t *childCount;      // 0 for files and for directories reached a second time
+    uint32_t *shortOrder;      // over the same spans: the children's node indices sorted by 8.3 name
+    uint32_t *size;
+    uint32_t *firstCluster;
+    uint16_t *wrtDate, *wrtTime;
+    uint8_t *attributes;
+    char *names;               // NUL-terminated names, each distinct name stored once
+    size_t namesSize;
+    uint32_t nameCount;        // distinct names in the pool
+} DirectoryTree;
+
+// struct definition to represent one node while a DirectoryTree is being built
+typedef struct
+{
+    const char *sortName; // points into the builder's pool while one directory's children are sorted
+    uint32_t nameOffset, shortNameOffset;
+    uint32_t parent, firstChild, childCount;
+    uint32_t shortOrder;
+    uint32_t size, firstCluster;
+    uint16_t wrtDate, wrtTime;
+    uint8_t attributes;
+} TreeRecord;
+
+// struct definition to represent one child while a directory's short name order is sorted
+typedef struct
+{
+    const char *name;
+    uint32_t node;
+} TreeSortKey;
+
+// struct definition to represent the growable state of buildDirectoryTree, copied into the arena at the end
+typedef struct
+{
+    TreeRecord *records;
+    uint32_t count, capacity;
+    char *names;            // string pool
+    size_t namesSize, namesCapacity;
+    TreeSortKey *keys;      // scratch for sorting one directory by short name
+    uint32_t keyCapacity;
+    uint32_t *internSlots;  // open addressing table of pool offset + 1, 0 for an empty slot
+    uint32_t internMask;    // slot count - 1, slot count is a power of two
+    uint32_t internCount;
+} TreeBuilder;
+
+// struct definition to represent the work shared by extraction threads
+typedef struct
+{
+    Volume *volume;
+    const Manifest *manifest;
+    const char *outDir;
+    size_t next;     // next manifest entry to claim
+    size_t failures; // files that could not be extracted
+} ExtractState;
+
+#define TAR_CHUNK_SIZE 65536 // bytes per pipeline slot
+#define TAR_PIPE_SLOTS 8     // slots between the reader and the writer, bounds memory use
+
+// struct definition to represent the bounded queue between the tar reader thread and the writer
+typedef struct
+{
+    Volume *volume;
+    ManifestEntry **files; // regular files in physical order
+    size_t fileCount;
+    uint8_t *slots[TAR_PIPE_SLOTS];
+    size_t lengths[TAR_PIPE_SLOTS];
+    size_t head;  // next slot the writer takes
+    size_t tail;  // next slot the reader fills
+    size_t count; // filled slots
+    bool abort;   // set by the writer when the output breaks
+    size_t failures; // files zero-padded because they could not be read, owned by the reader
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} TarPipe;
+
+#define CHAIN_HISTOGRAM_BUCKETS 17 // bucket b counts chains of 2^b to 2^(b+1)-1 clusters
+
+// struct definition to represent the fragmentation of one cluster chain found by analyzeFAT
+typedef struct
+{
+    uint16_t head;    // first cluster, what DIR_FstClusLO of the owning entry holds
+    uint32_t length;  // clusters in the chain
+    uint32_t extents; // runs of contiguous clusters
+} ChainStats;
+
+// struct definition to represent the result of analyzeFAT
+typedef struct
+{
+    uint64_t *freeBitmap;    // bit c set when cluster c is free, clusterCount + 2 bits
+    uint32_t freeClusters;
+    uint32_t usedClusters;   // allocated, including clusters not reachable from a chain head
+    uint32_t badClusters;    // marked 0xFFF7
+    uint32_t freeRuns;       // runs of consecutive free clusters
+    uint32_t largestFreeRun;
+    uint16_t largestFreeStart;
+    ChainStats *chains;      // sorted by head
+    uint32_t chainCount;
+    uint32_t fragmentedChains; // chains with more than one extent
+    uint64_t totalExtents;
+    uint32_t unreachedClusters; // allocated but not reached from any head (loops, broken links)
+    uint32_t chainHistogram[CHAIN_HISTOGRAM_BUCKETS];
+} FatAnalysis;
+
+// struct definition to represent one file or directory the defragmenter may move
+typedef struct
+{
+    char *path;
+    uint16_t firstCluster; // where the chain starts now
+    uint16_t target;       // where the plan puts it, 0 when it stays where it is
+    uint32_t clusters;     // chain length
+    uint32_t slot;         // short entry's slot in the parent directory
+    int32_t parent;        // index of the parent directory's item, -1 for the root directory
+    bool isDirectory;
+} DefragItem;
+
+// struct definition to represent a copied chain waiting to be committed
+typedef struct
+{
+    uint32_t item;
+    uint16_t oldFirst;
+    uint16_t newFirst;
+} DefragMove;
+
+// struct definition to represent what defragVolume did
+typedef struct
+{
+    uint32_t filesMoved;       // files moved to their final place
+    uint32_t directoriesMoved; // directories moved to their final place
+    uint32_t evacuations;      // chains moved out of the way, not counted in the two above
+    uint64_t clustersCopied;
+    uint32_t commits;        // FAT and directory rewrites
+    uint32_t fragmented;     // movable chains still in more than one run at the end
+    bool complete;           // false when free space ran out or a chain is still fragmented
+} DefragStats;
+
+// struct definition to represent the defragmenter's working state
+typedef struct
+{
+    Volume *volume;
+    DefragItem *items; // sorted by path
+    uint32_t count, capacity;
+    bool failed;       // an entry could not be recorded, the plan is incomplete
+    uint32_t *owner;   // 1 + index of the item whose committed chain holds each cluster, 0 otherwise
+    DefragMove *moves; // copied but not yet committed
+    uint32_t moveCount;
+    DefragStats *stats;
+} DefragState;
+
+// kinds of problem reported by fsckVolume
+#define FSCK_FAT_MISMATCH 0  // a FAT copy differs from FAT 0
+#define FSCK_CROSS_LINK 1    // a cluster belongs to two chains
+#define FSCK_LOST_CHAIN 2    // allocated clusters no entry refers to
+#define FSCK_LOOP 3          // a chain comes back to one of its own clusters
+#define FSCK_BAD_CHAIN 4     // a chain starts or runs into a free, bad or out of range cluster
+#define FSCK_SIZE_MISMATCH 5 // a file's size needs a different number of clusters than its chain has
+#define FSCK_BAD_LONG_NAME 6 // LFN entries that are broken or carry the wrong checksum
+#define FSCK_ISSUE_TYPES 7
+
+// struct definition to represent one problem found by fsckVolume
+typedef struct
+{
+    int type;         // FSCK_* value
+    char *path;       // entry the problem belongs to, NULL for FAT level problems
+    char *otherPath;  // the other owner of a cross-linked cluster
+    uint32_t cluster; // cluster concerned: first differing entry, shared cluster, chain head...
+    uint64_t expected; // FAT copy number, or clusters the size needs
+    uint64_t actual;   // differing entries, or clusters found
+} FsckIssue;
+
+// struct definition to represent the result of fsckVolume
+typedef struct
+{
+    FsckIssue *issues; // sorted by type, cluster and path
+    size_t count;
+    size_t capacity;
+    size_t counts[FSCK_ISSUE_TYPES];
+    size_t checkedEntries;
+    uint32_t checkedClusters;
+    pthread_mutex_t lock; // held while checker threads add issues
+} FsckReport;
+
+// struct definition to represent the work shared by fsck threads
+typedef struct
+{
+    const Volume *volume;
+    Manifest *manifest;
+    FsckReport *report;
+    uint32_t *owner; // 1 + manifest index of the entry owning each cluster, 0 when unclaimed
+} FsckState;
+
+// file size distributions for generateImage
+#define GEN_SIZES_UNIFORM 0 // uniform between 0 and maxFileSize
+#define GEN_SIZES_LOG 1     // log-uniform: most files small, a few close to maxFileSize
+
+// struct definition to represent the shape of a synthetic image made by generateImage
+typedef struct
+{
+    uint64_t seed;         // the same seed and settings give the same image, byte for byte
+    uint32_t clusters;     // data clusters, 4085 to 65524 for FAT16, more makes a FAT32 volume
+    uint32_t clusterSize;  // bytes per cluster, a power of two from 512 to 65536
+    uint32_t files;
+    uint32_t directories;
+    uint32_t maxDepth;     // directory levels below the root
+    double longNameRatio;  // share of names that need LFN entries, 0 to 1
+    int sizeDistribution;  // GEN_SIZES_* value
+    uint32_t maxFileSize;  // bytes
+    double fragmentation;  // chance that a chain continues at a random free cluster, 0 packs every chain
+} GeneratorConfig;
+
+// struct definition to represent one file or directory planned by generateImage, item 0 is the root
+typedef struct
+{
+    char *name;             // UTF-8 name as it appears in paths
+    uint8_t shortName[11];
+    int32_t parent;         // index of the parent directory's item, -1 for the root itself
+    uint32_t depth;         // 0 for the root, 1 for entries in it
+    bool isDirectory;
+    uint32_t size;
+    uint32_t slot;          // first slot (LFN entries included) in the parent directory
+    uint32_t entrySlots;    // slots the entry takes in its parent
+    uint32_t usedSlots;     // directories: slots taken by their contents, "." and ".." included
+    uint32_t names;         // directories: names handed out so far, keeps generated names unique
+    uint32_t firstCluster;
+    uint32_t clusters;
+    uint16_t wrtDate;
+    uint16_t wrtTime;
+    char *path;             // full path, built once the plan is complete
+    uint64_t hash;          // files: 64-bit FNV-1a of the contents
+} GeneratorItem;
+
+#define GEN_WRITE_CHUNK (1024 * 1024) // largest single write of file data while generating an image
+
+// hot paths timed by benchImage, in report order
+#define BENCH_READ_IMAGE 0      // random 4 KiB readFromDiskImage calls
+#define BENCH_LOAD_FAT 1        // whole loadFAT calls
+#define BENCH_CLUSTER_CHAIN 2   // getClusterChain on every chain
+#define BENCH_NEXT_CLUSTER 3    // every chain walked with nextCluster
+#define BENCH_DIRECTORY_SCAN 4  // every directory read with dirOpen/dirNext
+#define BENCH_READ_SEQUENTIAL 5 // every file opened and read to the end
+#define BENCH_READ_RANDOM 6     // random 4 KiB readFile calls at random offsets
+#define BENCH_PATH_LOOKUP 7     // followPath on random paths
+#define BENCH_HEADERS_READFILE 8 // the first 4 KiB of every file, one openFile/readFile each, in path order
+#define BENCH_HEADERS_BATCH 9    // the same headers in one readBatch call
+#define BENCH_TREE_BUILD 10      // buildDirectoryTree over the whole volume
+#define BENCH_TREE_LOOKUP 11     // treeLookup on the paths followPath was timed on
+#define BENCH_KINDS 12
+
+// struct definition to represent the timed samples of one benchmark
+typedef struct
+{
+    const char *name;
+    bool bytes;         // work is counted in bytes (reported as MB/s), otherwise in entries (entries/s)
+    uint64_t *samples;  // nanoseconds per timed call
+    size_t count;
+    size_t capacity;
+    uint64_t recorded;  // samples timed, including any dropped from samples when it could not grow
+    uint64_t totalNs;
+    uint64_t work;      // bytes or entries covered by all samples
+} BenchResult;
+
 //function to determine if a directory entry is for a long file name
 bool isLongNameEntry(const DirectoryEntry *entry)
 {
     return (entry->DIR_Attr == 0x0F);
 }
 
+// classes assigned to 32-byte directory slots by classifyEntries
+#define ENTRY_END 0          // DIR_Name[0] == 0x00, this and every later slot is free
+#define ENTRY_DELETED 1      // DIR_Name[0] == 0xE5
+#define ENTRY_LONG_NAME 2    // DIR_Attr == 0x0F
+#define ENTRY_VOLUME_LABEL 3 // volume label bit set on a short entry
+#define ENTRY_LIVE 4         // file or directory
+
+//scalar directory scan kernel, also used for the tail the vector kernels leave over
+void classifyEntriesScalar(const DirectoryEntry *entries, size_t count, uint8_t *classes)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const DirectoryEntry *entry = &entries[i];
+        if (entry->DIR_Name[0] == 0x00)
+            classes[i] = ENTRY_END;
+        else if (entry->DIR_Name[0] == 0xE5)
+            classes[i] = ENTRY_DELETED;
+        else if (isLongNameEntry(entry))
+            classes[i] = ENTRY_LONG_NAME;
+        else if (entry->DIR_Attr & 0x08)
+            classes[i] = ENTRY_VOLUME_LABEL;
+        else
+            classes[i] = ENTRY_LIVE;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//helper that turns 32-bit lanes holding name byte 0 (low dword) and bytes 8..11 (attr in the top byte)
+//into class numbers, lowest priority class first so the later blends win
+__attribute__((target("sse2"))) static inline __m128i classifyLanesSSE2(__m128i dword0, __m128i dword2)
+{
+    __m128i name0 = _mm_and_si128(dword0, _mm_set1_epi32(0xFF));
+    __m128i attr = _mm_srli_epi32(dword2, 24);
+    __m128i cls = _mm_set1_epi32(ENTRY_LIVE);
+    __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(attr, _mm_set1_epi32(0x08)), _mm_set1_epi32(0x08));
+    cls = _mm_or_si128(_mm_andnot_si128(mask, cls), _mm_and_si128(mask, _mm_set1_epi32(ENTRY_VOLUME_LABEL)));
+    mask = _mm_cmpeq_epi32(attr, _mm_set1_epi32(0x0F));
+    cls = _mm_or_si128(_mm_andnot_si128(mask, cls), _mm_and_si128(mask, _mm_set1_epi32(ENTRY_LONG_NAME)));
+    mask = _mm_cmpeq_epi32(name0, _mm_set1_epi32(0xE5));
+    cls = _mm_or_si128(_mm_andnot_si128(mask, cls), _mm_and_si128(mask, _mm_set1_epi32(ENTRY_DELETED)));
+    mask = _mm_cmpeq_epi32(name0, _mm_setzero_si128());
+    return _mm_andnot_si128(mask, cls); //ENTRY_END is zero
+}
+
+//SSE2 kernel: four entries per transpose, sixteen classes stored per iteration
+__attribute__((target("sse2"))) void classifyEntriesSSE2(const DirectoryEntry *entries, size_t count, uint8_t *classes)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i lanes[4];
+        for (int g = 0; g < 4; g++)
+        {
+            const uint8_t *base = (const uint8_t *)&entries[i + g * 4];
+            __m128i a = _mm_loadu_si128((const __m128i *)(base + 0));
+            __m128i b = _mm_loadu_si128((const __m128i *)(base + 32));
+            __m128i c = _mm_loadu_si128((const __m128i *)(base + 64));
+            __m128i d = _mm_loadu_si128((const __m128i *)(base + 96));
+            //transposing so lane k holds dword 0 (or dword 2) of entry k
+            __m128i ab0 = _mm_unpacklo_epi32(a, b), cd0 = _mm_unpacklo_epi32(c, d);
+            __m128i ab2 = _mm_unpackhi_epi32(a, b), cd2 = _mm_unpackhi_epi32(c, d);
+            lanes[g] = classifyLanesSSE2(_mm_unpacklo_epi64(ab0, cd0), _mm_unpacklo_epi64(ab2, cd2));
+        }
+        __m128i lo = _mm_packs_epi32(lanes[0], lanes[1]);
+        __m128i hi = _mm_packs_epi32(lanes[2], lanes[3]);
+        _mm_storeu_si128((__m128i *)(classes + i), _mm_packus_epi16(lo, hi));
+    }
+    classifyEntriesScalar(entries + i, count - i, classes + i);
+}
+
+//helper, AVX2 version of classifyLanesSSE2 over eight entries
+__attribute__((target("avx2"))) static inline __m256i classifyLanesAVX2(__m256i dword0, __m256i dword2)
+{
+    __m256i name0 = _mm256_and_si256(dword0, _mm256_set1_epi32(0xFF));
+    __m256i attr = _mm256_srli_epi32(dword2, 24);
+    __m256i cls = _mm256_set1_epi32(ENTRY_LIVE);
+    __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(attr, _mm256_set1_epi32(0x08)), _mm256_set1_epi32(0x08));
+    cls = _mm256_blendv_epi8(cls, _mm256_set1_epi32(ENTRY_VOLUME_LABEL), mask);
+    mask = _mm256_cmpeq_epi32(attr, _mm256_set1_epi32(0x0F));
+    cls = _mm256_blendv_epi8(cls, _mm256_set1_epi32(ENTRY_LONG_NAME), mask);
+    mask = _mm256_cmpeq_epi32(name0, _mm256_set1_epi32(0xE5));
+    cls = _mm256_blendv_epi8(cls, _mm256_set1_epi32(ENTRY_DELETED), mask);
+    mask = _mm256_cmpeq_epi32(name0, _mm256_setzero_si256());
+    return _mm256_andnot_si256(mask, cls);
+}
+
+//AVX2 kernel: gathers byte 0 and the attribute dword of eight entries at a time, sixteen per iteration
+__attribute__((target("avx2"))) void classifyEntriesAVX2(const DirectoryEntry *entries, size_t count, uint8_t *classes)
+{
+    const __m256i stride = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56); //entry k starts at dword 8k
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const int *base = (const int *)&entries[i];
+        __m256i first = classifyLanesAVX2(_mm256_i32gather_epi32(base, stride, 4),
+                                          _mm256_i32gather_epi32(base + 2, stride, 4));
+        __m256i second = classifyLanesAVX2(_mm256_i32gather_epi32(base + 64, stride, 4),
+                                           _mm256_i32gather_epi32(base + 66, stride, 4));
+        //packs works within 128-bit halves, the permute puts the entries back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(first, second), 0xD8);
+        __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+        _mm_storeu_si128((__m128i *)(classes + i), bytes);
+    }
+    classifyEntriesScalar(entries + i, count - i, classes + i);
+}
+#endif
+
+//helper that returns the widest SIMD kernel this CPU runs (2 avx2, 1 sse2, 0 scalar), shared by every
+//vectorized scan so they all pick the kernel classifierName reports
+int simdLevel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static int resolved = -1; //resolved once, a racing first call just resolves it twice
+    int level = __atomic_load_n(&resolved, __ATOMIC_RELAXED);
+    if (level < 0)
+    {
+        level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse2") ? 1 : 0;
+        __atomic_store_n(&resolved, level, __ATOMIC_RELAXED);
+    }
+    return level;
+#else
+    return 0;
+#endif
+}
+
+//function that returns the name of the scan kernel classifyEntries uses on this CPU
+const char *classifierName(void)
+{
+    static const char *const names[] = {"scalar", "sse2", "avx2"};
+    return names[simdLevel()];
+}
+
+//function that classifies a whole buffer of 32-byte entries as ENTRY_* values, picking the widest kernel the CPU has
+void classifyEntries(const DirectoryEntry *entries, size_t count, uint8_t *classes)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    int kernel = simdLevel();
+    if (kernel == 2)
+    {
+        classifyEntriesAVX2(entries, count, classes);
+        return;
+    }
+    if (kernel == 1)
+    {
+        classifyEntriesSSE2(entries, count, classes);
+        return;
+    }
+#endif
+    classifyEntriesScalar(entries, count, classes);
+}
 
-//extracts uicode characters from a long directory entry and inputs it into a buffer
-void parseLongNameEntry(const LongDirectoryEntry *longEntry, wchar_t *longNameBuffer, int position)
+//helper that encodes one code point as UTF-8, returns its length
+int encodeUtf8(uint32_t cp, char *enc)
 {
-    int j = 0;//counter to keep track of character pos.
-    for (int i = 0; i < 5; i++) //looping through the first 5 UNICODE characters
+    if (cp < 0x80)
+    {
+        enc[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800)
     {
-        longNameBuffer[position + j++] = (wchar_t)longEntry->LDIR_Name1[i * 2];//extracting first byte and converting to wide character for storage
+        enc[0] = 0xC0 | (cp >> 6);
+        enc[1] = 0x80 | (cp & 0x3F);
+        return 2;
     }
-    for (int i = 0; i < 6; i++)//looping through the next 6
+    if (cp < 0x10000)
     {
-        longNameBuffer[position + j++] = (wchar_t)longEntry->LDIR_Name2[i * 2];//extracting first byte and converting to wide character for storage
+        enc[0] = 0xE0 | (cp >> 12);
+        enc[1] = 0x80 | ((cp >> 6) & 0x3F);
+        enc[2] = 0x80 | (cp & 0x3F);
+        return 3;
     }
-    for (int i = 0; i < 2; i++)//looping through the last 2
+    enc[0] = 0xF0 | (cp >> 18);
+    enc[1] = 0x80 | ((cp >> 12) & 0x3F);
+    enc[2] = 0x80 | ((cp >> 6) & 0x3F);
+    enc[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+//function that encodes UTF-16LE code units as UTF-8, stopping at 0x0000/0xFFFF, returns the length written
+//runs of ASCII are converted eight units at a time, everything else one code point at a time
+size_t utf16ToUtf8(const uint16_t *units, size_t count, char *out, size_t outSize)
+{
+    size_t i = 0, j = 0;
+    while (i < count)
     {
-        longNameBuffer[position + j++] = (wchar_t)longEntry->LDIR_Name3[i * 2];//extracting the last 2 characters 
-    }//longNameBuffer should contain the complete UNICODE name, why isnt it printing?
+#if defined(__SSE2__)
+        if (i + 8 <= count && j + 8 < outSize)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(units + i));
+            __m128i stop = _mm_or_si128(_mm_cmpeq_epi16(v, _mm_setzero_si128()), _mm_cmpeq_epi16(v, _mm_set1_epi16(-1)));
+            __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xFF80)), _mm_setzero_si128());
+            unsigned special = (_mm_movemask_epi8(stop) | ~_mm_movemask_epi8(ascii)) & 0xFFFF;
+            //storing all eight bytes is safe (there is room), only the ASCII prefix is kept
+            _mm_storel_epi64((__m128i *)(out + j), _mm_packus_epi16(v, v));
+            unsigned prefix = special ? __builtin_ctz(special) / 2 : 8;
+            i += prefix;
+            j += prefix;
+            if (prefix == 8)
+                continue;
+        }
+#endif
+        uint32_t cp = units[i];
+        if (cp == 0x0000 || cp == 0xFFFF)
+            break;
+        //joining surrogate pairs, a lone surrogate becomes U+FFFD
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < count && units[i + 1] >= 0xDC00 && units[i + 1] <= 0xDFFF)
+        {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (units[++i] - 0xDC00);
+        }
+        else if (cp >= 0xD800 && cp <= 0xDFFF)
+        {
+            cp = 0xFFFD;
+        }
+        i++;
+
+        char enc[4];
+        int n = encodeUtf8(cp, enc);
+        if (j + n >= outSize)
+            break;
+        memcpy(out + j, enc, n);
+        j += n;
+    }
+    if (outSize)
+        out[j] = '\0';
+    return j;
+}
+
+//extracts the 13 UTF-16 characters from a long directory entry into a buffer at position
+void parseLongNameEntry(const LongDirectoryEntry *longEntry, uint16_t *longNameBuffer, int position)
+{
+    //the three name fields are little-endian UTF-16, both bytes of every character matter
+    memcpy(longNameBuffer + position, longEntry->LDIR_Name1, 10);
+    memcpy(longNameBuffer + position + 5, longEntry->LDIR_Name2, 12);
+    memcpy(longNameBuffer + position + 11, longEntry->LDIR_Name3, 4);
 }
 
 //prints information about the long directory entry
 void printLongDirectoryEntry(const LongDirectoryEntry *longEntry)
 {
-    wchar_t longName[14]; // Buffer to hold the name part
+    uint16_t units[13];
+    char longName[13 * 3 + 1]; // Buffer to hold the name part as UTF-8
 
     // Printing order and attribute
     printf("Long Entry Order: %u\n", longEntry->LDIR_Ord);
@@ -131,23 +1077,10 @@ void printLongDirectoryEntry(const LongDirectoryEntry *longEntry)
         printf("Archive ");
     printf("\n");
 
-    //Assmebling the long file name from the three parts
-    int j = 0;//counter to keep track of character pos
-    for (int i = 0; i < 5; i++)
-    {
-        longName[j++] = (wchar_t)longEntry->LDIR_Name1[i * 2];//same as before
-    }
-    for (int i = 0; i < 6; i++)
-    {
-        longName[j++] = (wchar_t)longEntry->LDIR_Name2[i * 2];
-    }
-    for (int i = 0; i < 2; i++)
-    {
-        longName[j++] = (wchar_t)longEntry->LDIR_Name3[i * 2];
-    }
-    longName[j] = L'\0'; // Null-terminate the long file name
-
-    wprintf(L"Long Entry Name: %ls\n", longName);// this should be printing the long file name but it isn't, still debugging.
+    //Assmebling the long file name from the three parts, printf and wprintf can't share stdout so it is printed as UTF-8
+    parseLongNameEntry(longEntry, units, 0);
+    utf16ToUtf8(units, 13, longName, sizeof(longName));
+    printf("Long Entry Name: %s\n", longName);
 
     // Printing other fields
     printf("Long Entry Type: %u\n", longEntry->LDIR_Type);
@@ -168,31 +1101,118 @@ int openDiskImage(const char *filepath)
     return fileDesc;
 }
 
-//reads a specific number of bytes from a given offset in the disk image
-ssize_t readFromDiskImage(int fd, off_t offset, void *buffer, size_t numBytes)
+//helper that returns a monotonic timestamp in nanoseconds
+uint64_t nowNanoseconds(void)
 {
-    // Move the file pointer to the specific offset
-    if (lseek(fd, offset, SEEK_SET) < 0)
-    {
-        perror("Error seeking in file\n");
-        return -1;
-    }
-    return read(fd, buffer, numBytes);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
 }
 
-//just closes the disk image
-void closeDiskImage(int fd)
+//helper that counts one operation's latency in its log2 bucket
+void statRecordLatency(VolumeStats *stats, int op, uint64_t nanoseconds)
 {
-    close(fd);
+    int bucket = 63 - __builtin_clzll(nanoseconds | 1);
+    if (bucket >= STAT_BUCKETS)
+        bucket = STAT_BUCKETS - 1;
+    __atomic_fetch_add(&stats->latency[op][bucket], 1, __ATOMIC_RELAXED);
 }
 
-//function that reads and returns the boot sector of the disk image
-BootSector readBootSector(int fd)
+//reads a specific number of bytes from a given offset in the disk image
+ssize_t readFromDiskImage(int fd, off_t offset, void *buffer, size_t numBytes)
 {
-    BootSector bs;
-    if (readFromDiskImage(fd, 0, &bs, sizeof(BootSector)) != sizeof(BootSector))
+    //positional reads leave the shared file offset alone, so concurrent readers can't disturb each other
+    //large reads may come back short, keep reading until done or end of image
+    size_t total = 0;
+    while (total < numBytes)
     {
-        perror("Error reading BootSector");
+        ssize_t n = pread(fd, (uint8_t *)buffer + total, numBytes - total, offset + total);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+//reads into the buffers of an iovec array from a given offset in the disk image, retrying short reads;
+//iov is used up as it is filled. Returns the bytes read, less than asked only at the end of the image, or -1
+ssize_t readvFromDiskImage(int fd, off_t offset, struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    while (iovcnt > 0)
+    {
+        ssize_t n = preadv(fd, iov, iovcnt, offset + total);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        total += n;
+        //skipping the buffers that were filled and the filled part of the next one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+//function that opens a disk image for reading and writing, for use with enableWrites
+int openDiskImageForWriting(const char *filepath)
+{
+    int fileDesc = open(filepath, O_RDWR);
+    if (fileDesc < 0)
+    {
+        perror("Error opening file for writing");
+    }
+    return fileDesc;
+}
+
+//writes a specific number of bytes at a given offset in the disk image, returns false on any failure
+bool writeToDiskImage(int fd, off_t offset, const void *buffer, size_t numBytes)
+{
+    size_t total = 0;
+    while (total < numBytes)
+    {
+        ssize_t n = pwrite(fd, (const uint8_t *)buffer + total, numBytes - total, offset + total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        total += n;
+    }
+    return true;
+}
+
+//just closes the disk image
+void closeDiskImage(int fd)
+{
+    close(fd);
+}
+
+//function that reads and returns the boot sector of the disk image
+BootSector readBootSector(int fd)
+{
+    BootSector bs;
+    if (readFromDiskImage(fd, 0, &bs, sizeof(BootSector)) != sizeof(BootSector))
+    {
+        perror("Error reading BootSector");
         exit(EXIT_FAILURE);
     }
     return bs;
@@ -240,14 +1260,7 @@ uint16_t *loadFAT(int fd, const BootSector *bs)
     }
 
     off_t fatOffset = bs->BPB_RsvdSecCnt * bs->BPB_BytsPerSec;
-    if (lseek(fd, fatOffset, SEEK_SET) < 0)
-    {
-        perror("Error seeking to FAT");
-        free(fat);
-        return NULL;
-    }
-
-    if (read(fd, fat, fatSize) != fatSize)
+    if (readFromDiskImage(fd, fatOffset, fat, fatSize) != (ssize_t)fatSize)
     {
         perror("Error reading FAT");
         free(fat);
@@ -257,34 +1270,35 @@ uint16_t *loadFAT(int fd, const BootSector *bs)
     return fat;
 }
 
-//function that builds a chain of clusters given a specified cluster
-uint16_t *getClusterChain(int fd, const BootSector *bs, uint16_t startingCluster)
+//function that compares every extra FAT copy against the loaded one, returns false on mismatch
+bool verifyFATCopies(int fd, const BootSector *bs, const uint16_t *fat)
 {
-    uint16_t *fat = loadFAT(fd, bs);
-    if (!fat)
-        return NULL;
-
-    // Assuming a maximum sie
-    uint16_t *chain = malloc(65536 * sizeof(uint16_t));
-    if (!chain)
+    size_t fatSize = bs->BPB_FATSz16 * bs->BPB_BytsPerSec;
+    uint16_t *copy = malloc(fatSize);
+    if (!copy)
     {
-        free(fat);
-        perror("Error allocating memory for cluster chain");
-        return NULL;
+        perror("Error allocating memory for FAT copy");
+        return false;
     }
 
-    int i = 0;
-    uint16_t currentCluster = startingCluster;
-    while (currentCluster < 0xFFF8)
+    bool match = true;
+    for (int i = 1; i < bs->BPB_NumFATs && match; i++)
     {
-        chain[i++] = currentCluster;
-        currentCluster = fat[currentCluster];
+        off_t copyOffset = (bs->BPB_RsvdSecCnt + i * bs->BPB_FATSz16) * bs->BPB_BytsPerSec;
+        if (readFromDiskImage(fd, copyOffset, copy, fatSize) != (ssize_t)fatSize)
+        {
+            perror("Error reading FAT copy");
+            match = false;
+        }
+        else if (memcmp(copy, fat, fatSize) != 0)
+        {
+            fprintf(stderr, "FAT copy %d does not match FAT 0\n", i);
+            match = false;
+        }
     }
 
-    chain[i] = 0xFFFF;
-
-    free(fat);
-    return chain;
+    free(copy);
+    return match;
 }
 
 //function that prints the details of a directory entry
@@ -376,320 +1390,7252 @@ void printDirectoryEntry(const DirectoryEntry *entry)
     printf("\n");
 }
 
-//function that reads and prints entries from a root directory
-void readDirectory(int fd, const BootSector *bs)
+// below are the functions for task 5
+
+//functions that convert a cluster number to a corresponding sector number
+off_t clusterToSector(const Volume *volume, uint32_t cluster)
+{
+    //calculating the sector number for a given cluster
+    return volume->firstDataSector + (off_t)(cluster - 2) * volume->bootSector.BPB_SecPerClus;
+}
+
+//function that creates the empty dentry cache for a volume with the given number of data clusters
+DentryCache *createDentryCache(uint32_t clusterCount)
+{
+    DentryCache *cache = calloc(1, sizeof(DentryCache));
+    if (!cache)
+    {
+        perror("Error allocating memory for dentry cache");
+        return NULL;
+    }
+    cache->bucketMask = 255;
+    cache->buckets = calloc(cache->bucketMask + 1, sizeof(DentryNode *));
+    cache->loaded = calloc(((size_t)clusterCount + 2 + 7) / 8, 1);
+    cache->clusterCount = clusterCount;
+    if (!cache->buckets || !cache->loaded)
+    {
+        perror("Error allocating memory for dentry buckets");
+        free(cache->buckets);
+        free(cache->loaded);
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+//function that frees the dentry cache and every cached name
+void freeDentryCache(DentryCache *cache)
+{
+    if (!cache)
+        return;
+    for (uint32_t i = 0; i <= cache->bucketMask; i++)
+    {
+        DentryNode *node = cache->buckets[i];
+        while (node)
+        {
+            DentryNode *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    free(cache->buckets);
+    free(cache->loaded);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+//function that drops every cached name of one directory, after the directory was changed
+void dentryForget(DentryCache *cache, uint32_t dirCluster)
+{
+    //nothing is ever cached under a cluster outside the data region
+    if (dirCluster != 0 && (dirCluster < 2 || dirCluster >= cache->clusterCount + 2))
+        return;
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i <= cache->bucketMask; i++)
+    {
+        DentryNode **link = &cache->buckets[i];
+        while (*link)
+        {
+            DentryNode *node = *link;
+            if (node->parentCluster == dirCluster)
+            {
+                *link = node->next;
+                cache->count--;
+                free(node);
+            }
+            else
+            {
+                link = &node->next;
+            }
+        }
+    }
+    cache->loaded[dirCluster / 8] &= ~(1 << (dirCluster % 8));
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//function that creates a sharded LRU cache of blockSize-byte blocks with a memory budget in bytes
+BlockCache *createBlockCache(uint32_t blockSize, size_t budgetBytes)
+{
+    size_t blockCost = sizeof(CacheBlock) + blockSize;
+    size_t blocks = budgetBytes / blockCost;
+    if (blocks < CACHE_SHARDS)
+    {
+        blocks = CACHE_SHARDS; //at least one block per shard
+    }
+
+    BlockCache *cache = calloc(1, sizeof(BlockCache));
+    if (!cache)
+    {
+        perror("Error allocating memory for block cache");
+        return NULL;
+    }
+    cache->clusterSize = blockSize;
+
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        shard->capacity = (blocks + CACHE_SHARDS - 1) / CACHE_SHARDS;
+        uint32_t bucketCount = 1;
+        while (bucketCount < shard->capacity * 2)
+        {
+            bucketCount <<= 1;
+        }
+        shard->bucketMask = bucketCount - 1;
+        shard->buckets = calloc(bucketCount, sizeof(CacheBlock *));
+        if (!shard->buckets)
+        {
+            perror("Error allocating memory for block cache buckets");
+            while (i-- > 0)
+            {
+                pthread_mutex_destroy(&cache->shards[i].lock);
+                free(cache->shards[i].buckets);
+            }
+            free(cache);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    return cache;
+}
+
+//function that frees every cached block and the cache itself
+void freeBlockCache(BlockCache *cache)
+{
+    if (!cache)
+        return;
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        CacheBlock *block = shard->head;
+        while (block)
+        {
+            CacheBlock *next = block->next;
+            free(block);
+            block = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+//function that compares every FAT32 copy against the active one a window at a time, so memory stays bounded
+bool verifyFATCopies32(const Volume *volume)
+{
+    const BootSector *bs = &volume->bootSector;
+    size_t fatSize = (size_t)volume->fatSectors * bs->BPB_BytsPerSec;
+    size_t windowSize = FAT_WINDOW_ENTRIES * sizeof(uint32_t);
+    uint8_t *active = malloc(windowSize);
+    uint8_t *copy = malloc(windowSize);
+    if (!active || !copy)
+    {
+        perror("Error allocating memory for FAT copy");
+        free(active);
+        free(copy);
+        return false;
+    }
+
+    bool match = true;
+    off_t activeOffset = (off_t)(bs->BPB_RsvdSecCnt + (off_t)volume->activeFAT * volume->fatSectors) * bs->BPB_BytsPerSec;
+    for (size_t done = 0; done < fatSize && match; done += windowSize)
+    {
+        size_t length = fatSize - done < windowSize ? fatSize - done : windowSize;
+        if (readFromDiskImage(volume->fd, activeOffset + done, active, length) != (ssize_t)length)
+        {
+            perror("Error reading FAT");
+            match = false;
+        }
+        for (uint32_t i = 0; i < bs->BPB_NumFATs && match; i++)
+        {
+            if (i == volume->activeFAT)
+                continue;
+            off_t copyOffset = (off_t)(bs->BPB_RsvdSecCnt + (off_t)i * volume->fatSectors) * bs->BPB_BytsPerSec;
+            if (readFromDiskImage(volume->fd, copyOffset + done, copy, length) != (ssize_t)length)
+            {
+                perror("Error reading FAT copy");
+                match = false;
+            }
+            else if (memcmp(copy, active, length) != 0)
+            {
+                fprintf(stderr, "FAT copy %u does not match FAT %u\n", i, volume->activeFAT);
+                match = false;
+            }
+        }
+    }
+
+    free(active);
+    free(copy);
+    return match;
+}
+
+//function that mounts a volume: reads the boot sector and keeps the FAT in memory. A FAT32 FAT is not
+//loaded; readFATEntry pages it in FAT_WINDOW_ENTRIES at a time through an LRU cache of FAT_WINDOW_BUDGET bytes
+Volume *mountVolume(int fd, bool checkFATCopies)
+{
+    Volume *volume = malloc(sizeof(Volume));
+    if (!volume)
+    {
+        perror("Error allocating memory for volume");
+        return NULL;
+    }
+    volume->fd = fd;
+    volume->fat = NULL;
+    volume->fatWindows = NULL;
+    volume->activeFAT = 0;
+    volume->rootCluster = 0;
+    volume->map = NULL;
+    volume->mapSize = 0;
+    volume->cache = NULL;
+    volume->dentries = NULL;
+    volume->writable = false;
+    volume->dirtyFAT = NULL;
+    volume->freeRuns = NULL;
+    volume->freeRunCount = 0;
+    volume->freeRunCapacity = 0;
+    volume->bootSector = readBootSector(fd);
+
+    const BootSector *bs = &volume->bootSector;
+    BootSector32 bs32;
+    volume->fatSectors = bs->BPB_FATSz16;
+    if (volume->fatSectors == 0)
+    {
+        //FAT32 keeps the FAT size in the extended BPB
+        if (readFromDiskImage(fd, offsetof(BootSector, BS_DrvNum), &bs32, sizeof(BootSector32)) != sizeof(BootSector32))
+        {
+            perror("Error reading FAT32 BootSector");
+            free(volume);
+            return NULL;
+        }
+        volume->fatSectors = bs32.BPB_FATSz32;
+    }
+    if (bs->BPB_BytsPerSec == 0 || bs->BPB_SecPerClus == 0 || bs->BPB_NumFATs == 0 || volume->fatSectors == 0)
+    {
+        fprintf(stderr, "Boot sector does not describe a FAT16 or FAT32 volume\n");
+        free(volume);
+        return NULL;
+    }
+
+    //caching the region layout so cluster lookups don't recompute it
+    uint32_t totalSectors = bs->BPB_TotSec16 ? bs->BPB_TotSec16 : bs->BPB_TotSec32;
+    volume->firstDataSector = bs->BPB_RsvdSecCnt + (bs->BPB_NumFATs * volume->fatSectors) +
+                              ((bs->BPB_RootEntCnt * 32) + (bs->BPB_BytsPerSec - 1)) / bs->BPB_BytsPerSec;
+    volume->clusterCount = totalSectors > volume->firstDataSector
+                               ? (totalSectors - volume->firstDataSector) / bs->BPB_SecPerClus
+                               : 0;
+    //the cluster count alone decides the FAT type
+    volume->isFAT32 = volume->clusterCount >= FAT32_MIN_CLUSTERS;
+    if (volume->isFAT32 != (bs->BPB_FATSz16 == 0))
+    {
+        fprintf(stderr, "Boot sector does not describe a FAT16 or FAT32 volume\n");
+        free(volume);
+        return NULL;
+    }
+    volume->fatEntries = (uint64_t)volume->fatSectors * bs->BPB_BytsPerSec / (volume->isFAT32 ? sizeof(uint32_t) : sizeof(uint16_t));
+    //never trust more clusters than the FAT can describe
+    if (volume->clusterCount + 2 > volume->fatEntries)
+    {
+        volume->clusterCount = volume->fatEntries - 2;
+    }
+
+    if (volume->isFAT32)
+    {
+        //with mirroring off only the FAT named in BPB_ExtFlags is current
+        volume->activeFAT = bs32.BPB_ExtFlags & 0x80 ? bs32.BPB_ExtFlags & 0x0F : 0;
+        volume->rootCluster = bs32.BPB_RootClus;
+        if (volume->activeFAT >= bs->BPB_NumFATs || volume->rootCluster < 2 || volume->rootCluster >= volume->clusterCount + 2)
+        {
+            fprintf(stderr, "FAT32 boot sector has an invalid active FAT or root cluster\n");
+            free(volume);
+            return NULL;
+        }
+        if (checkFATCopies && bs->BPB_NumFATs > 1 && !(bs32.BPB_ExtFlags & 0x80) && !verifyFATCopies32(volume))
+        {
+            free(volume);
+            return NULL;
+        }
+        volume->fatWindows = createBlockCache(FAT_WINDOW_ENTRIES * sizeof(uint32_t), FAT_WINDOW_BUDGET);
+        if (!volume->fatWindows)
+        {
+            free(volume);
+            return NULL;
+        }
+    }
+    else
+    {
+        volume->fat = loadFAT(fd, bs);
+        if (!volume->fat)
+        {
+            free(volume);
+            return NULL;
+        }
+        if (checkFATCopies && bs->BPB_NumFATs > 1 && !verifyFATCopies(fd, bs, volume->fat))
+        {
+            free(volume->fat);
+            free(volume);
+            return NULL;
+        }
+    }
+
+    volume->dentries = createDentryCache(volume->clusterCount);
+    if (!volume->dentries)
+    {
+        freeBlockCache(volume->fatWindows);
+        free(volume->fat);
+        free(volume);
+        return NULL;
+    }
+#if READFAT_STATS
+    volume->stats = calloc(1, sizeof(VolumeStats));
+    if (!volume->stats)
+    {
+        perror("Error allocating memory for volume stats");
+        freeDentryCache(volume->dentries);
+        freeBlockCache(volume->fatWindows);
+        free(volume->fat);
+        free(volume);
+        return NULL;
+    }
+#endif
+    return volume;
+}
+
+//function that replaces the FAT32 window cache with an empty one of a new memory budget; like enableCache it
+//must not run while other threads are reading
+bool setFATWindowBudget(Volume *volume, size_t budgetBytes)
+{
+    if (!volume->isFAT32)
+    {
+        fprintf(stderr, "Only FAT32 volumes page their FAT\n");
+        return false;
+    }
+    BlockCache *windows = createBlockCache(FAT_WINDOW_ENTRIES * sizeof(uint32_t), budgetBytes);
+    if (!windows)
+        return false;
+    freeBlockCache(volume->fatWindows);
+    volume->fatWindows = windows;
+    return true;
+}
+
+//function that maps the whole disk image once so reads become memory copies or zero-copy spans
+bool mapVolume(Volume *volume)
+{
+    if (volume->map)
+        return true;
+
+    struct stat st;
+    if (fstat(volume->fd, &st) < 0)
+    {
+        perror("Error getting disk image size");
+        return false;
+    }
+    if (st.st_size == 0)
+    {
+        fprintf(stderr, "Cannot map an empty disk image\n");
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, volume->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("Error mapping disk image");
+        return false;
+    }
+    volume->map = map;
+    volume->mapSize = st.st_size;
+    return true;
+}
+
+//function that drops the mapping, reads fall back to the file descriptor
+void unmapVolume(Volume *volume)
+{
+    if (!volume->map)
+        return;
+    munmap((void *)volume->map, volume->mapSize);
+    volume->map = NULL;
+    volume->mapSize = 0;
+}
+
+//function that reads bytes from the volume, copying out of the mapping when there is one
+ssize_t readVolume(const Volume *volume, off_t offset, void *buffer, size_t numBytes)
+{
+    STAT_TIMER_START(timer);
+    ssize_t got;
+    if (!volume->map)
+    {
+        got = readFromDiskImage(volume->fd, offset, buffer, numBytes);
+        STAT_ADD(volume, syscalls, 1);
+    }
+    else if (offset < 0)
+    {
+        return -1;
+    }
+    else if ((size_t)offset >= volume->mapSize)
+    {
+        got = 0; //behaving like read() at the end of the image
+    }
+    else
+    {
+        got = numBytes < volume->mapSize - offset ? numBytes : volume->mapSize - offset;
+        memcpy(buffer, volume->map + offset, got);
+    }
+#if READFAT_STATS
+    if (got > 0)
+    {
+        uint32_t bytesPerSector = volume->bootSector.BPB_BytsPerSec;
+        STAT_ADD(volume, bytesRead, got);
+        STAT_ADD(volume, sectorsRead, (offset + got + bytesPerSector - 1) / bytesPerSector - offset / bytesPerSector);
+    }
+#endif
+    STAT_TIMER_STOP(volume, STAT_OP_READ, timer);
+    return got;
+}
+
+//function that reads one contiguous range of the volume into several buffers (one preadv, or copies out of the
+//mapping), counted like readVolume; iov is used up as it is filled
+ssize_t readVolumeVectored(const Volume *volume, off_t offset, struct iovec *iov, int iovcnt)
+{
+    STAT_TIMER_START(timer);
+    ssize_t got;
+    if (!volume->map)
+    {
+        got = readvFromDiskImage(volume->fd, offset, iov, iovcnt);
+        STAT_ADD(volume, syscalls, 1);
+    }
+    else if (offset < 0)
+    {
+        return -1;
+    }
+    else
+    {
+        got = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            ssize_t n = readVolume(volume, offset + got, iov[i].iov_base, iov[i].iov_len);
+            if (n <= 0)
+                break;
+            got += n;
+            if ((size_t)n < iov[i].iov_len)
+                break;
+        }
+        return got; //readVolume counted the copies
+    }
+#if READFAT_STATS
+    if (got > 0)
+    {
+        uint32_t bytesPerSector = volume->bootSector.BPB_BytsPerSec;
+        STAT_ADD(volume, bytesRead, got);
+        STAT_ADD(volume, sectorsRead, (offset + got + bytesPerSector - 1) / bytesPerSector - offset / bytesPerSector);
+    }
+#endif
+    STAT_TIMER_STOP(volume, STAT_OP_READ, timer);
+    return got;
+}
+
+//function that sets up the shared cluster cache with a memory budget in bytes
+bool enableCache(Volume *volume, size_t budgetBytes)
+{
+    if (volume->cache)
+    {
+        fprintf(stderr, "Block cache is already enabled\n");
+        return false;
+    }
+
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    volume->cache = createBlockCache(clusterSize, budgetBytes);
+    return volume->cache != NULL;
+}
+
+//function that frees every cached cluster and the cache itself
+void disableCache(Volume *volume)
+{
+    freeBlockCache(volume->cache);
+    volume->cache = NULL;
+}
+
+//helper that sums the counters of a block cache over all shards, all zero for no cache
+void blockCacheStats(BlockCache *cache, CacheStats *stats)
+{
+    memset(stats, 0, sizeof(CacheStats));
+    if (!cache)
+        return;
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->blocks += shard->count;
+        stats->capacity += shard->capacity;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+//function that copies the cluster cache counters, summed over all shards
+void getCacheStats(const Volume *volume, CacheStats *stats)
+{
+    blockCacheStats(volume->cache, stats);
+}
+
+//function that copies the volume's hot path counters and latency histograms, with the cache counters filled in
+//from the block cache; returns false (and zeroes stats) when they were compiled out with READFAT_STATS=0
+bool volumeGetStats(const Volume *volume, VolumeStats *stats)
+{
+    memset(stats, 0, sizeof(VolumeStats));
+#if READFAT_STATS
+    const uint64_t *from = (const uint64_t *)volume->stats;
+    uint64_t *to = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(VolumeStats) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    CacheStats cache;
+    getCacheStats(volume, &cache);
+    stats->cacheHits = cache.hits;
+    stats->cacheMisses = cache.misses;
+    blockCacheStats(volume->fatWindows, &cache);
+    stats->fatWindowHits = cache.hits;
+    stats->fatWindowMisses = cache.misses;
+    return true;
+#else
+    (void)volume;
+    return false;
+#endif
+}
+
+//function that zeroes the volume's counters and histograms (not the block cache's), e.g. between benchmark phases
+void volumeResetStats(Volume *volume)
+{
+#if READFAT_STATS
+    uint64_t *counters = (uint64_t *)volume->stats;
+    for (size_t i = 0; i < sizeof(VolumeStats) / sizeof(uint64_t); i++)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+#else
+    (void)volume;
+#endif
+}
+
+//function that prints stats as one JSON object; each histogram lists [lower bound in ns, count] for its non-empty buckets
+void printVolumeStats(const VolumeStats *stats, FILE *out)
+{
+    static const char *operations[STAT_OPS] = {"read", "chain_walk", "directory", "read_file"};
+    fprintf(out, "{\"syscalls\": %llu, \"bytes_read\": %llu, \"sectors_read\": %llu, \"bytes_written\": %llu, "
+                 "\"fat_lookups\": %llu, \"cluster_hops\": %llu, \"cache_hits\": %llu, \"cache_misses\": %llu, "
+                 "\"bounce_bytes\": %llu, \"fat_window_hits\": %llu, \"fat_window_misses\": %llu, \"latency\": {",
+            (unsigned long long)stats->syscalls, (unsigned long long)stats->bytesRead,
+            (unsigned long long)stats->sectorsRead, (unsigned long long)stats->bytesWritten,
+            (unsigned long long)stats->fatLookups, (unsigned long long)stats->clusterHops,
+            (unsigned long long)stats->cacheHits, (unsigned long long)stats->cacheMisses,
+            (unsigned long long)stats->bounceBytes, (unsigned long long)stats->fatWindowHits,
+            (unsigned long long)stats->fatWindowMisses);
+    for (int op = 0; op < STAT_OPS; op++)
+    {
+        fprintf(out, "%s\"%s\": [", op ? ", " : "", operations[op]);
+        bool first = true;
+        for (int b = 0; b < STAT_BUCKETS; b++)
+        {
+            if (stats->latency[op][b] == 0)
+                continue;
+            fprintf(out, "%s[%llu, %llu]", first ? "" : ", ", 1ull << b, (unsigned long long)stats->latency[op][b]);
+            first = false;
+        }
+        fprintf(out, "]");
+    }
+    fprintf(out, "}}");
+}
+
+//helper that finds a block in a shard, caller holds the shard lock
+CacheBlock *cacheLookup(CacheShard *shard, uint32_t cluster)
+{
+    CacheBlock *block = shard->buckets[cluster & shard->bucketMask];
+    while (block && block->cluster != cluster)
+    {
+        block = block->hashNext;
+    }
+    return block;
+}
+
+//helper that unlinks a block from the LRU list, caller holds the shard lock
+void cacheUnlinkLRU(CacheShard *shard, CacheBlock *block)
+{
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        shard->head = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    else
+        shard->tail = block->prev;
+}
+
+//helper that puts a block at the most recently used end, caller holds the shard lock
+void cachePushFront(CacheShard *shard, CacheBlock *block)
+{
+    block->prev = NULL;
+    block->next = shard->head;
+    if (shard->head)
+        shard->head->prev = block;
+    shard->head = block;
+    if (!shard->tail)
+        shard->tail = block;
+}
+
+//helper that drops the least recently used block, caller holds the shard lock
+void cacheEvict(CacheShard *shard)
+{
+    CacheBlock *victim = shard->tail;
+    cacheUnlinkLRU(shard, victim);
+    CacheBlock **link = &shard->buckets[victim->cluster & shard->bucketMask];
+    while (*link != victim)
+    {
+        link = &(*link)->hashNext;
+    }
+    *link = victim->hashNext;
+    shard->count--;
+    shard->evictions++;
+    free(victim);
+}
+
+//helper that copies part of one block through a block cache, reading the whole block from diskOffset on a miss
+ssize_t blockCacheRead(const Volume *volume, BlockCache *cache, uint32_t key, off_t diskOffset, uint32_t offset,
+                       void *buffer, size_t numBytes)
+{
+    if (offset >= cache->clusterSize)
+        return 0;
+    if (numBytes > cache->clusterSize - offset)
+        numBytes = cache->clusterSize - offset;
+
+    CacheShard *shard = &cache->shards[key % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    CacheBlock *block = cacheLookup(shard, key);
+    if (block)
+    {
+        shard->hits++;
+        cacheUnlinkLRU(shard, block);
+        cachePushFront(shard, block);
+        memcpy(buffer, block->data + offset, numBytes);
+        pthread_mutex_unlock(&shard->lock);
+        return numBytes;
+    }
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    //reading from disk without holding the lock so other blocks in this shard stay available
+    CacheBlock *fresh = malloc(sizeof(CacheBlock) + cache->clusterSize);
+    if (!fresh)
+    {
+        perror("Error allocating memory for cache block");
+        return -1;
+    }
+    if (readVolume(volume, diskOffset, fresh->data, cache->clusterSize) != cache->clusterSize)
+    {
+        perror("Error reading cached block");
+        free(fresh);
+        return -1;
+    }
+    fresh->cluster = key;
+    memcpy(buffer, fresh->data + offset, numBytes);
+
+    pthread_mutex_lock(&shard->lock);
+    if (cacheLookup(shard, key))
+    {
+        //another thread loaded it meanwhile, keep theirs
+        free(fresh);
+    }
+    else
+    {
+        if (shard->count >= shard->capacity)
+        {
+            cacheEvict(shard);
+        }
+        CacheBlock **bucket = &shard->buckets[key & shard->bucketMask];
+        fresh->hashNext = *bucket;
+        *bucket = fresh;
+        cachePushFront(shard, fresh);
+        shard->count++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return numBytes;
+}
+
+//function that copies part of a data cluster through the block cache, loading it on a miss
+ssize_t cacheReadCluster(const Volume *volume, uint32_t cluster, uint32_t offset, void *buffer, size_t numBytes)
+{
+    off_t clusterOffset = clusterToSector(volume, cluster) * volume->bootSector.BPB_BytsPerSec;
+    return blockCacheRead(volume, volume->cache, cluster, clusterOffset, offset, buffer, numBytes);
+}
+
+//function that reads one whole data cluster, through the cache when it is enabled
+ssize_t readCluster(const Volume *volume, uint32_t cluster, void *buffer)
+{
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    if (cluster < 2 || cluster >= volume->clusterCount + 2)
+    {
+        fprintf(stderr, "Cluster %u is outside the data region\n", cluster);
+        return -1;
+    }
+    if (volume->cache)
+    {
+        return cacheReadCluster(volume, cluster, 0, buffer, clusterSize);
+    }
+    return readVolume(volume, clusterToSector(volume, cluster) * volume->bootSector.BPB_BytsPerSec, buffer, clusterSize);
+}
+
+//helper that tells whether a FAT link names a cluster in the data region; free, reserved, bad, end-of-chain and
+//out of range links all fail, so chain walks stop at them the way fsckCheckChains does
+bool clusterInData(const Volume *volume, uint32_t cluster)
+{
+    return cluster >= 2 && cluster < volume->clusterCount + 2;
+}
+
+//helper that reads one FAT entry with a bounds check and no counting, for walkers that count a whole chain at once.
+//FAT16 bad and end-of-chain values come back widened (0xFFF7 as 0x0FFFFFF7, end-of-chain at CLUSTER_END and up).
+//The bad marker sits below CLUSTER_END, so walkers bound every link with clusterInData rather than CLUSTER_END
+uint32_t readFATEntry(const Volume *volume, uint32_t currentCluster)
+{
+    if (currentCluster >= volume->fatEntries)
+    {
+        fprintf(stderr, "Cluster %u is outside the FAT\n", currentCluster);
+        return CLUSTER_EOC;
+    }
+    if (volume->isFAT32)
+    {
+        const BootSector *bs = &volume->bootSector;
+        uint32_t window = currentCluster / FAT_WINDOW_ENTRIES;
+        off_t windowOffset = (off_t)(bs->BPB_RsvdSecCnt + (off_t)volume->activeFAT * volume->fatSectors) * bs->BPB_BytsPerSec +
+                             (off_t)window * FAT_WINDOW_ENTRIES * sizeof(uint32_t);
+        uint32_t value;
+        if (blockCacheRead(volume, volume->fatWindows, window, windowOffset,
+                           currentCluster % FAT_WINDOW_ENTRIES * sizeof(uint32_t), &value, sizeof(value)) != sizeof(value))
+            return CLUSTER_EOC;
+        return value & 0x0FFFFFFF; //the top four bits are reserved
+    }
+    uint16_t value = volume->fat[currentCluster];
+    return value >= 0xFFF7 ? value | 0x0FFF0000 : value;
+}
+
+//function that retrieves the next cluster in the chain from the FAT
+uint32_t nextCluster(const Volume *volume, uint32_t currentCluster)
+{
+    uint32_t next = readFATEntry(volume, currentCluster);
+    STAT_ADD(volume, fatLookups, 1);
+    if (next != currentCluster + 1 && clusterInData(volume, next))
+        STAT_ADD(volume, clusterHops, 1);
+    return next;
+}
+
+//function that builds a chain of clusters given a specified cluster, terminated by CLUSTER_EOC
+uint32_t *getClusterChain(const Volume *volume, uint32_t startingCluster)
+{
+    //the array grows with the chain so short files stay cheap on large volumes
+    size_t capacity = 16;
+    uint32_t *chain = malloc(capacity * sizeof(uint32_t));
+    if (!chain)
+    {
+        perror("Error allocating memory for cluster chain");
+        return NULL;
+    }
+
+    uint32_t i = 0, hops = 0;
+    uint32_t currentCluster = startingCluster;
+    //a valid chain can never be longer than the number of data clusters
+    while (clusterInData(volume, currentCluster) && i < volume->clusterCount)
+    {
+        if (i + 1 == capacity) //keep a slot for the terminator
+        {
+            capacity *= 2;
+            uint32_t *grown = realloc(chain, capacity * sizeof(uint32_t));
+            if (!grown)
+            {
+                perror("Error growing cluster chain");
+                free(chain);
+                return NULL;
+            }
+            chain = grown;
+        }
+        chain[i++] = currentCluster;
+        currentCluster = readFATEntry(volume, currentCluster);
+        hops += currentCluster != chain[i - 1] + 1 && clusterInData(volume, currentCluster);
+    }
+    STAT_ADD(volume, fatLookups, i);
+    STAT_ADD(volume, clusterHops, hops);
+    (void)hops;
+
+    chain[i] = CLUSTER_EOC;
+    return chain;
+}
+
+//helper that drops one cluster from the cache after it was written
+void cacheInvalidate(Volume *volume, uint32_t cluster)
+{
+    CacheShard *shard = &volume->cache->shards[cluster % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    CacheBlock *block = cacheLookup(shard, cluster);
+    if (block)
+    {
+        cacheUnlinkLRU(shard, block);
+        CacheBlock **link = &shard->buckets[cluster & shard->bucketMask];
+        while (*link != block)
+        {
+            link = &(*link)->hashNext;
+        }
+        *link = block->hashNext;
+        shard->count--;
+        free(block);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+//function that writes bytes to a writable volume, keeping the cluster cache coherent
+bool writeVolume(Volume *volume, off_t offset, const void *buffer, size_t numBytes)
+{
+    if (!volume->writable)
+    {
+        fprintf(stderr, "Volume is not writable\n");
+        return false;
+    }
+    if (!writeToDiskImage(volume->fd, offset, buffer, numBytes))
+    {
+        perror("Error writing to disk image");
+        return false;
+    }
+    STAT_ADD(volume, syscalls, 1);
+    STAT_ADD(volume, bytesWritten, numBytes);
+    off_t dataStart = (off_t)volume->firstDataSector * volume->bootSector.BPB_BytsPerSec;
+    if (volume->cache && offset + (off_t)numBytes > dataStart)
+    {
+        uint32_t clusterSize = volume->cache->clusterSize;
+        off_t from = offset > dataStart ? offset : dataStart;
+        for (off_t c = (from - dataStart) / clusterSize; c <= (offset + (off_t)numBytes - 1 - dataStart) / clusterSize; c++)
+        {
+            if (c + 2 < volume->clusterCount + 2)
+                cacheInvalidate(volume, c + 2);
+        }
+    }
+    return true;
+}
+
+//function that changes one FAT entry in memory; the sector is written to every copy by the next flushVolume
+void setFATEntry(Volume *volume, uint16_t cluster, uint16_t value)
+{
+    volume->fat[cluster] = value;
+    uint32_t sector = cluster * sizeof(uint16_t) / volume->bootSector.BPB_BytsPerSec;
+    volume->dirtyFAT[sector / 8] |= 1 << (sector % 8);
+}
+
+//function that writes every changed FAT sector to all BPB_NumFATs copies, consecutive dirty sectors in one
+//write per copy, then waits for the data to reach the disk
+bool flushVolume(Volume *volume)
+{
+    if (!volume->writable)
+        return true;
+    const BootSector *bs = &volume->bootSector;
+    bool ok = true;
+    uint32_t sector = 0;
+    while (sector < bs->BPB_FATSz16)
+    {
+        if (!(volume->dirtyFAT[sector / 8] & (1 << (sector % 8))))
+        {
+            sector++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (sector + run < bs->BPB_FATSz16 && volume->dirtyFAT[(sector + run) / 8] & (1 << ((sector + run) % 8)))
+            run++;
+        const uint8_t *data = (const uint8_t *)volume->fat + (size_t)sector * bs->BPB_BytsPerSec;
+        for (int copy = 0; copy < bs->BPB_NumFATs; copy++)
+        {
+            off_t offset = (off_t)(bs->BPB_RsvdSecCnt + copy * bs->BPB_FATSz16 + sector) * bs->BPB_BytsPerSec;
+            if (!writeToDiskImage(volume->fd, offset, data, (size_t)run * bs->BPB_BytsPerSec))
+            {
+                perror("Error writing FAT");
+                ok = false;
+            }
+            STAT_ADD(volume, syscalls, 1);
+            STAT_ADD(volume, bytesWritten, (size_t)run * bs->BPB_BytsPerSec);
+        }
+        if (ok)
+        {
+            for (uint32_t i = sector; i < sector + run; i++)
+                volume->dirtyFAT[i / 8] &= ~(1 << (i % 8));
+        }
+        sector += run;
+    }
+    if (fdatasync(volume->fd) < 0)
+    {
+        perror("Error syncing disk image");
+        ok = false;
+    }
+    STAT_ADD(volume, syscalls, 1);
+    return ok;
+}
+
+//function that flushes the FAT and frees the allocator state, the volume is read-only again
+void disableWrites(Volume *volume)
+{
+    if (!volume->writable)
+        return;
+    flushVolume(volume);
+    free(volume->dirtyFAT);
+    free(volume->freeRuns);
+    volume->dirtyFAT = NULL;
+    volume->freeRuns = NULL;
+    volume->freeRunCount = volume->freeRunCapacity = 0;
+    volume->writable = false;
+}
+
+//function that releases the in-memory FAT and the volume, the disk image stays open
+void unmountVolume(Volume *volume)
+{
+    if (!volume)
+        return;
+    disableWrites(volume);
+    disableCache(volume);
+    freeDentryCache(volume->dentries);
+    unmapVolume(volume);
+    free(volume->fat);
+    freeBlockCache(volume->fatWindows);
+#if READFAT_STATS
+    free(volume->stats);
+#endif
+    free(volume);
+}
+
+ssize_t readSector(const Volume *volume, off_t sector, void *buffer)
+{
+    //sectors in the data region are served from the cluster cache when it is enabled
+    if (volume->cache && sector >= volume->firstDataSector)
+    {
+        uint32_t relative = sector - volume->firstDataSector;
+        uint32_t cluster = relative / volume->bootSector.BPB_SecPerClus + 2;
+        uint32_t offsetInCluster = (relative % volume->bootSector.BPB_SecPerClus) * volume->bootSector.BPB_BytsPerSec;
+        if (cluster < volume->clusterCount + 2)
+        {
+            return cacheReadCluster(volume, cluster, offsetInCluster, buffer, volume->bootSector.BPB_BytsPerSec);
+        }
+    }
+    //Calculating the offset byte for the sector
+    off_t offset = sector * volume->bootSector.BPB_BytsPerSec;
+    //reading the sector data into buffer
+    return readVolume(volume, offset, buffer, volume->bootSector.BPB_BytsPerSec);
+}
+
+//function that walks a cluster chain once and compresses it into runs of contiguous clusters
+Extent *buildExtents(const Volume *volume, uint32_t startingCluster, uint32_t *extentCount)
+{
+    *extentCount = 0;
+    uint32_t capacity = 8;
+    Extent *extents = malloc(capacity * sizeof(Extent));
+    if (!extents)
+    {
+        perror("Error allocating memory for extents");
+        return NULL;
+    }
+
+    STAT_TIMER_START(timer);
+    uint32_t logical = 0;
+    uint32_t cluster = startingCluster;
+    while (clusterInData(volume, cluster) && logical < volume->clusterCount)
+    {
+        Extent *last = *extentCount ? &extents[*extentCount - 1] : NULL;
+        if (last && last->startCluster + last->length == cluster)
+        {
+            last->length++; //cluster continues the current run
+        }
+        else
+        {
+            if (*extentCount == capacity)
+            {
+                capacity *= 2;
+                Extent *grown = realloc(extents, capacity * sizeof(Extent));
+                if (!grown)
+                {
+                    perror("Error growing extent table");
+                    free(extents);
+                    return NULL;
+                }
+                extents = grown;
+            }
+            extents[(*extentCount)++] = (Extent){.logicalCluster = logical, .startCluster = cluster, .length = 1};
+        }
+        logical++;
+        cluster = readFATEntry(volume, cluster);
+    }
+    //every link that starts a new extent was a hop
+    STAT_ADD(volume, fatLookups, logical);
+    STAT_ADD(volume, clusterHops, *extentCount ? *extentCount - 1 : 0);
+    STAT_TIMER_STOP(volume, STAT_OP_CHAIN_WALK, timer);
+    return extents;
+}
+
+//function that binary searches the extent table for the run holding a logical cluster, NULL if past the chain
+const Extent *findExtent(const File *file, uint32_t logicalCluster)
+{
+    uint32_t lo = 0, hi = file->extentCount;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const Extent *ext = &file->extents[mid];
+        if (logicalCluster < ext->logicalCluster)
+            hi = mid;
+        else if (logicalCluster >= ext->logicalCluster + ext->length)
+            lo = mid + 1;
+        else
+            return ext;
+    }
+    return NULL;
+}
+
+//function that returns the physical cluster for a logical cluster of the file, or 0 if past the chain
+uint32_t fileClusterAt(const File *file, uint32_t logicalCluster)
+{
+    const Extent *ext = findExtent(file, logicalCluster);
+    return ext ? ext->startCluster + (logicalCluster - ext->logicalCluster) : 0;
+}
+
+//function that builds an open file around an extent table it takes ownership of
+File *openFileWithExtents(Volume *vol, const DirectoryEntry *entry, Extent *extents, uint32_t extentCount)
+{
+    File *file = malloc(sizeof(File));
+    if (!file)
+    {
+        perror("Error allocating memory for this file");
+        free(extents);
+        return NULL;
+    }
+    //fill struct
+    file->dirEntry = *entry;
+    file->currentCluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    file->fileSize = entry->DIR_FileSize;
+    file->filePosition = 0;
+    file->volume = vol;
+    file->lastReadEnd = 0;
+    file->readahead = 0;
+    file->prefetchedTo = 0;
+    file->extents = extents;
+    file->extentCount = extentCount;
+    file->writable = false;
+    file->entryDirty = false;
+    file->parentCluster = 0;
+    file->entrySlot = 0;
+    return file;
+}
+
+// function opens file given directory entry and volume
+extern File *openFile(Volume *vol, DirectoryEntry *entry)
+{
+    //indexing the chain up front so seeks and reads never walk it again
+    uint32_t extentCount;
+    Extent *extents = buildExtents(vol, ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO, &extentCount);
+    if (!extents)
+    {
+        return NULL;
+    }
+    return openFileWithExtents(vol, entry, extents, extentCount);
+}
+
+//function that sets the file position int he open file
+extern off_t seekFile(File *file, off_t offset, int whence)
+{
+    off_t position;
+    switch (whence)
+    {
+    case SEEK_SET: //setting position relative to the start of the file
+        position = offset;
+        break;
+    case SEEK_CUR: //setting position relative to the current position
+        position = file->filePosition + offset;
+        break;
+    case SEEK_END: //setting position relative to the end of the file
+        position = file->fileSize + offset;
+        break;
+    default:
+        fprintf(stderr, "Seek is invalid\n");
+        return -1;
+    }
+    if (position < 0 || position > UINT32_MAX)
+    {
+        fprintf(stderr, "Seek position out of range\n");
+        return -1;
+    }
+
+    file->filePosition = position;
+    //keeping currentCluster in step with the position
+    uint32_t clusterSize = file->volume->bootSector.BPB_BytsPerSec * file->volume->bootSector.BPB_SecPerClus;
+    file->currentCluster = fileClusterAt(file, file->filePosition / clusterSize);
+    return file->filePosition;
+}
+
+//function that asks the kernel to start loading logical clusters [fromCluster, toCluster) of the file
+void prefetchFile(const File *file, uint32_t fromCluster, uint32_t toCluster)
+{
+    const Volume *volume = file->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    //the extent table says where the clusters really are, so fragmented files prefetch the right places
+    while (fromCluster < toCluster)
+    {
+        const Extent *ext = findExtent(file, fromCluster);
+        if (!ext)
+            break;
+        uint32_t runEnd = ext->logicalCluster + ext->length;
+        if (runEnd > toCluster)
+        {
+            runEnd = toCluster;
+        }
+        uint32_t cluster = ext->startCluster + (fromCluster - ext->logicalCluster);
+        off_t offset = clusterToSector(volume, cluster) * volume->bootSector.BPB_BytsPerSec;
+        off_t length = (off_t)(runEnd - fromCluster) * clusterSize;
+
+        if (volume->map)
+        {
+            //madvise needs a page-aligned start
+            off_t aligned = offset - offset % pageSize;
+            if ((size_t)offset >= volume->mapSize)
+                break;
+            if ((size_t)(offset + length) > volume->mapSize)
+            {
+                length = volume->mapSize - offset;
+            }
+            madvise((void *)(volume->map + aligned), length + (offset - aligned), MADV_WILLNEED);
+        }
+        else
+        {
+            posix_fadvise(volume->fd, offset, length, POSIX_FADV_WILLNEED);
+        }
+        STAT_ADD(volume, syscalls, 1);
+        fromCluster = runEnd;
+    }
+}
+
+// Read data from the file into a buffer
+extern size_t readFile(File *file, void *buffer, size_t length)
+{
+    if (file->filePosition >= file->fileSize)
+    {
+        return 0; // end of file reached
+    }
+
+    STAT_TIMER_START(timer);
+    size_t bytesRead = 0;
+    uint8_t *buf = (uint8_t *)buffer;
+    uint32_t bytesPerSector = file->volume->bootSector.BPB_BytsPerSec;
+    uint32_t sectorsPerCluster = file->volume->bootSector.BPB_SecPerClus;
+    uint32_t clusterSize = bytesPerSector * sectorsPerCluster;
+
+    // Temporary buffer, only used for the unaligned head and tail of a request
+    uint8_t tempBuf[bytesPerSector];
+
+    //sequential reads grow the readahead window like the kernel does, a jump resets it
+    if (file->filePosition == file->lastReadEnd && file->filePosition != 0)
+    {
+        file->readahead = file->readahead ? file->readahead * 2 : READAHEAD_MIN_CLUSTERS;
+        if (file->readahead > READAHEAD_MAX_CLUSTERS)
+        {
+            file->readahead = READAHEAD_MAX_CLUSTERS;
+        }
+    }
+    else
+    {
+        file->readahead = 0;
+        file->prefetchedTo = 0;
+    }
+
+    while (length > 0 && file->filePosition < file->fileSize)
+    {
+        //looking up the run of contiguous clusters for the current position
+        uint32_t logicalCluster = file->filePosition / clusterSize;
+        const Extent *ext = findExtent(file, logicalCluster);
+        if (!ext)
+        {
+            fprintf(stderr, "Cluster chain is shorter than the file size\n");
+            break;
+        }
+        file->currentCluster = ext->startCluster + (logicalCluster - ext->logicalCluster);
+
+        off_t sector = clusterToSector(file->volume, file->currentCluster) +
+                       (file->filePosition % clusterSize) / bytesPerSector;
+        off_t sectorOffset = file->filePosition % bytesPerSector;
+
+        // Ensure not to read beyond the file size
+        size_t wanted = file->fileSize - file->filePosition;
+        if (wanted > length)
+        {
+            wanted = length;
+        }
+
+        //whole sectors: how far the read can go while the extent stays contiguous
+        uint64_t sectors = 0;
+        if (sectorOffset == 0 && wanted >= bytesPerSector)
+        {
+            uint64_t runSectors = (uint64_t)(ext->logicalCluster + ext->length - logicalCluster) * sectorsPerCluster -
+                                  (file->filePosition % clusterSize) / bytesPerSector;
+            sectors = wanted / bytesPerSector;
+            if (sectors > runSectors)
+            {
+                sectors = runSectors;
+            }
+        }
+
+        size_t bytesToRead;
+        //with the cache on, only long streaming runs bypass it so they don't flush the hot blocks
+        if (sectors > 0 && (!file->volume->cache || sectors >= CACHE_BYPASS_CLUSTERS * sectorsPerCluster))
+        {
+            //straight into the caller's buffer
+            bytesToRead = sectors * bytesPerSector;
+            ssize_t got = readVolume(file->volume, sector * bytesPerSector, buf + bytesRead, bytesToRead);
+            if (got < 0 || (size_t)got != bytesToRead)
+            {
+                perror("Error reading sectors");
+                break;
+            }
+        }
+        else if (file->volume->cache)
+        {
+            //small reads are served cluster by cluster from the shared cache
+            uint32_t clusterOffset = file->filePosition % clusterSize;
+            bytesToRead = clusterSize - clusterOffset;
+            if (bytesToRead > wanted)
+            {
+                bytesToRead = wanted;
+            }
+            if (cacheReadCluster(file->volume, file->currentCluster, clusterOffset, buf + bytesRead, bytesToRead) != (ssize_t)bytesToRead)
+            {
+                fprintf(stderr, "Error reading cluster %u through the cache\n", file->currentCluster);
+                break;
+            }
+        }
+        else
+        {
+            //partial sector: bounce through the temporary buffer
+            bytesToRead = bytesPerSector - sectorOffset;
+            if (bytesToRead > wanted)
+            {
+                bytesToRead = wanted;
+            }
+            if (file->volume->map)
+            {
+                //a mapped volume can copy the fragment directly
+                if (readVolume(file->volume, sector * bytesPerSector + sectorOffset, buf + bytesRead, bytesToRead) != (ssize_t)bytesToRead)
+                {
+                    fprintf(stderr, "Sector lies outside the mapped image\n");
+                    break;
+                }
+            }
+            else if (readSector(file->volume, sector, tempBuf) != bytesPerSector)
+            {
+                perror("Error reading sector");
+                break;
+            }
+            else
+            {
+                // Copying the required part of the sector into the buffer
+                memcpy(buf + bytesRead, tempBuf + sectorOffset, bytesToRead);
+                STAT_ADD(file->volume, bounceBytes, bytesToRead);
+            }
+        }
+
+        bytesRead += bytesToRead;
+        file->filePosition += bytesToRead;
+        length -= bytesToRead;
+    }
+
+    //requesting the next window ahead of where this read stopped, each cluster only once
+    file->lastReadEnd = file->filePosition;
+    if (file->readahead)
+    {
+        uint32_t from = (file->filePosition + clusterSize - 1) / clusterSize;
+        uint32_t to = from + file->readahead;
+        uint32_t fileClusters = (file->fileSize + clusterSize - 1) / clusterSize;
+        if (to > fileClusters)
+        {
+            to = fileClusters;
+        }
+        if (from < file->prefetchedTo)
+        {
+            from = file->prefetchedTo;
+        }
+        if (from < to)
+        {
+            prefetchFile(file, from, to);
+            file->prefetchedTo = to;
+        }
+    }
+
+    STAT_TIMER_STOP(file->volume, STAT_OP_READ_FILE, timer);
+    return bytesRead;
+}
+
+//function that returns the next contiguous piece of the file as a pointer into the mapping and advances past it
+bool nextFileSpan(File *file, Span *span)
+{
+    const Volume *volume = file->volume;
+    if (!volume->map)
+    {
+        fprintf(stderr, "Zero-copy spans need a mapped volume\n");
+        return false;
+    }
+    if (file->filePosition >= file->fileSize)
+    {
+        return false; // end of file reached
+    }
+
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    uint32_t logicalCluster = file->filePosition / clusterSize;
+    const Extent *ext = findExtent(file, logicalCluster);
+    if (!ext)
+    {
+        fprintf(stderr, "Cluster chain is shorter than the file size\n");
+        return false;
+    }
+
+    //the span runs to the end of the extent or the end of the file, whichever comes first
+    uint64_t runEnd = (uint64_t)(ext->logicalCluster + ext->length) * clusterSize;
+    uint64_t end = runEnd < file->fileSize ? runEnd : file->fileSize;
+    uint32_t cluster = ext->startCluster + (logicalCluster - ext->logicalCluster);
+    uint64_t offset = (uint64_t)clusterToSector(volume, cluster) * volume->bootSector.BPB_BytsPerSec +
+                      file->filePosition % clusterSize;
+    size_t length = end - file->filePosition;
+    if (offset + length > volume->mapSize)
+    {
+        fprintf(stderr, "File data lies outside the mapped image\n");
+        return false;
+    }
+
+    span->data = volume->map + offset;
+    span->length = length;
+    file->currentCluster = cluster;
+    file->filePosition += length;
+    return true;
+}
+
+//function that returns the byte offset of a 32-byte slot in a directory (cluster 0 for the root), -1 past its end
+off_t directorySlotOffset(const Volume *volume, uint16_t dirCluster, uint32_t slot)
+{
+    const BootSector *bs = &volume->bootSector;
+    if (dirCluster == 0)
+    {
+        if (slot >= bs->BPB_RootEntCnt)
+            return -1;
+        return (off_t)(bs->BPB_RsvdSecCnt + bs->BPB_NumFATs * bs->BPB_FATSz16) * bs->BPB_BytsPerSec + (off_t)slot * 32;
+    }
+    uint32_t perCluster = bs->BPB_BytsPerSec * bs->BPB_SecPerClus / 32;
+    uint16_t cluster = dirCluster;
+    for (uint32_t hops = slot / perCluster; hops > 0; hops--)
+    {
+        cluster = nextCluster(volume, cluster);
+        if (cluster < 2 || cluster >= volume->clusterCount + 2)
+            return -1;
+    }
+    return clusterToSector(volume, cluster) * bs->BPB_BytsPerSec + (off_t)(slot % perCluster) * 32;
+}
+
+//function that makes a written file durable: the FAT first, so the entry never points at unallocated clusters,
+//then the directory entry with its new size and first cluster
+bool syncFile(File *file)
+{
+    if (!file->writable)
+        return true;
+    Volume *volume = file->volume;
+    if (!flushVolume(volume))
+        return false;
+    if (!file->entryDirty)
+        return true;
+    off_t offset = directorySlotOffset(volume, file->parentCluster, file->entrySlot);
+    if (offset < 0 || !writeVolume(volume, offset, &file->dirEntry, sizeof(DirectoryEntry)))
+    {
+        fprintf(stderr, "Error writing directory entry\n");
+        return false;
+    }
+    file->entryDirty = false;
+    dentryForget(volume->dentries, file->parentCluster);
+    return true;
+}
+
+// closing file
+extern void closeFile(File *file)
+{
+    if (!file)
+        return;
+    if (file->entryDirty)
+        syncFile(file);
+    free(file->extents);
+    free(file);
+}
+
+//asynchronous reads
+//An AsyncContext belongs to one event-loop thread: submit with readFileAsync/readSectorAsync, then call
+//asyncPoll when asyncEventFd becomes readable (or block in asyncPoll). Callbacks only ever run inside asyncPoll.
+
+//helper that appends a segment to a singly linked queue
+void segmentQueuePush(AsyncSegment **head, AsyncSegment **tail, AsyncSegment *segment)
+{
+    segment->next = NULL;
+    if (*tail)
+        (*tail)->next = segment;
+    else
+        *head = segment;
+    *tail = segment;
+}
+
+//helper that hands a finished segment to asyncPoll and wakes the event loop
+void asyncComplete(AsyncContext *ctx, AsyncSegment *segment)
+{
+    pthread_mutex_lock(&ctx->lock);
+    segmentQueuePush(&ctx->doneHead, &ctx->doneTail, segment);
+    pthread_cond_signal(&ctx->workDone);
+    pthread_mutex_unlock(&ctx->lock);
+    uint64_t one = 1;
+    if (write(ctx->eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("Error signalling async completion");
+}
+
+//fallback worker: takes segments off the queue and reads them with pread
+void *asyncWorker(void *arg)
+{
+    AsyncContext *ctx = arg;
+    pthread_mutex_lock(&ctx->lock);
+    while (true)
+    {
+        while (!ctx->waitingHead && !ctx->stopping)
+        {
+            pthread_cond_wait(&ctx->workReady, &ctx->lock);
+        }
+        if (!ctx->waitingHead)
+            break;
+        AsyncSegment *segment = ctx->waitingHead;
+        ctx->waitingHead = segment->next;
+        if (!ctx->waitingHead)
+            ctx->waitingTail = NULL;
+        pthread_mutex_unlock(&ctx->lock);
+
+        ssize_t got = readFromDiskImage(segment->fd, segment->offset, segment->buffer, segment->length);
+        segment->result = got < 0 ? -errno : got;
+        asyncComplete(ctx, segment);
+
+        pthread_mutex_lock(&ctx->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+//helper that maps the io_uring rings, returns false if the kernel refuses io_uring
+bool ioRingSetup(IoRing *ring, unsigned entries, int eventFd)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return false;
+
+    //a kernel can have io_uring without IORING_OP_READ (before 5.6, which also lacks the probe), and then
+    //every read would fail with -EINVAL
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeSize);
+    bool canRead = probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) >= 0 &&
+                   probe->last_op >= IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!canRead)
+    {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap && ring->cqRingSize > ring->sqRingSize)
+        ring->sqRingSize = ring->cqRingSize;
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+    {
+        close(ring->fd);
+        return false;
+    }
+    ring->cqRing = singleMap ? ring->sqRing
+                             : mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return false;
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (!singleMap)
+            munmap(ring->cqRing, ring->cqRingSize);
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return false;
+    }
+
+    uint8_t *sq = ring->sqRing, *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    //completions also tick the eventfd so an event loop can wait on it
+    syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &eventFd, 1);
+    return true;
+}
+
+//helper that unmaps the rings and closes the io_uring instance
+void ioRingTeardown(IoRing *ring)
+{
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+//helper that stops the workers and frees the engine without waiting for outstanding reads
+void asyncRelease(AsyncContext *ctx)
+{
+    if (ctx->useRing)
+    {
+        ioRingTeardown(&ctx->ring);
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    pthread_cond_broadcast(&ctx->workReady);
+    pthread_mutex_unlock(&ctx->lock);
+    for (int i = 0; i < ctx->workerCount; i++)
+    {
+        pthread_join(ctx->workers[i], NULL);
+    }
+    free(ctx->workers);
+    pthread_cond_destroy(&ctx->workReady);
+    pthread_cond_destroy(&ctx->workDone);
+    pthread_mutex_destroy(&ctx->lock);
+    close(ctx->eventFd);
+    free(ctx);
+}
+
+//function that creates an async engine backed by a pool of threads doing pread
+AsyncContext *asyncCreatePool(int threads)
+{
+    AsyncContext *ctx = calloc(1, sizeof(AsyncContext));
+    if (!ctx)
+    {
+        perror("Error allocating memory for async context");
+        return NULL;
+    }
+    ctx->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->eventFd < 0)
+    {
+        perror("Error creating async eventfd");
+        free(ctx);
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->workReady, NULL);
+    pthread_cond_init(&ctx->workDone, NULL);
+
+    if (threads < 1)
+        threads = 1;
+    ctx->workers = malloc(threads * sizeof(pthread_t));
+    if (!ctx->workers)
+    {
+        perror("Error allocating memory for async workers");
+        asyncRelease(ctx);
+        return NULL;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&ctx->workers[i], NULL, asyncWorker, ctx) != 0)
+        {
+            perror("Error starting async worker");
+            break;
+        }
+        ctx->workerCount++;
+    }
+    if (ctx->workerCount == 0)
+    {
+        asyncRelease(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+//function that creates an async engine on io_uring, falling back to a thread pool when it is unavailable
+AsyncContext *asyncCreate(unsigned queueDepth, int fallbackThreads)
+{
+    AsyncContext *ctx = calloc(1, sizeof(AsyncContext));
+    if (!ctx)
+    {
+        perror("Error allocating memory for async context");
+        return NULL;
+    }
+    ctx->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->eventFd < 0)
+    {
+        perror("Error creating async eventfd");
+        free(ctx);
+        return NULL;
+    }
+    if (!ioRingSetup(&ctx->ring, queueDepth ? queueDepth : 64, ctx->eventFd))
+    {
+        close(ctx->eventFd);
+        free(ctx);
+        return asyncCreatePool(fallbackThreads);
+    }
+    ctx->useRing = true;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->workReady, NULL);
+    pthread_cond_init(&ctx->workDone, NULL);
+    return ctx;
+}
+
+//function that returns a descriptor which turns readable whenever asyncPoll has completions to deliver
+int asyncEventFd(const AsyncContext *ctx)
+{
+    return ctx->eventFd;
+}
+
+//helper that drains the completion ring, resubmitting the rest of any short read
+void ioRingReap(AsyncContext *ctx, AsyncSegment **doneHead, AsyncSegment **doneTail)
+{
+    IoRing *ring = &ctx->ring;
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+        AsyncSegment *segment = (AsyncSegment *)(uintptr_t)cqe->user_data;
+        ctx->inFlight--;
+        segment->result = cqe->res;
+        if (cqe->res > 0 && (size_t)cqe->res < segment->length)
+        {
+            //short read in the middle of the image: queue the remainder as a new piece of the same request
+            AsyncSegment *rest = malloc(sizeof(AsyncSegment));
+            if (rest)
+            {
+                *rest = *segment;
+                rest->offset += cqe->res;
+                rest->buffer += cqe->res;
+                rest->length -= cqe->res;
+                rest->request->pending++;
+                segmentQueuePush(&ctx->waitingHead, &ctx->waitingTail, rest);
+            }
+            else
+            {
+                //the rest cannot be read, so the request must not look complete
+                perror("Error allocating memory for async segment");
+                segment->result = -ENOMEM;
+            }
+        }
+        segmentQueuePush(doneHead, doneTail, segment);
+        head++;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+//helper that pulls the entries the kernel has not taken back out of the submission ring and finishes them
+//with -err, so nothing waits for completions that will never come
+void ioRingFailUnsubmitted(AsyncContext *ctx, int err)
+{
+    IoRing *ring = &ctx->ring;
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sqTail;
+    //without SQPOLL the kernel only reads the ring inside io_uring_enter, so the tail can be wound back
+    __atomic_store_n(ring->sqTail, head, __ATOMIC_RELEASE);
+    for (; head != tail; head++)
+    {
+        unsigned index = ring->sqArray[head & *ring->sqMask];
+        AsyncSegment *segment = (AsyncSegment *)(uintptr_t)ring->sqes[index].user_data;
+        segment->result = -err;
+        ctx->inFlight--;
+        asyncComplete(ctx, segment);
+    }
+}
+
+//helper that makes room when the kernel pushes back (EAGAIN, EBUSY): moves finished reads to the done queue,
+//waiting for one if none are there yet; false when nothing submitted is left to finish
+bool ioRingBackOff(AsyncContext *ctx)
+{
+    IoRing *ring = &ctx->ring;
+    unsigned queued = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    AsyncSegment *doneHead = NULL, *doneTail = NULL;
+    ioRingReap(ctx, &doneHead, &doneTail);
+    if (!doneHead)
+    {
+        if (ctx->inFlight <= queued)
+            return false;
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return false;
+        ioRingReap(ctx, &doneHead, &doneTail);
+    }
+    while (doneHead)
+    {
+        AsyncSegment *next = doneHead->next;
+        asyncComplete(ctx, doneHead);
+        doneHead = next;
+    }
+    return true;
+}
+
+//helper that moves waiting segments into free submission slots and tells the kernel about them. The kernel
+//may take fewer than offered; the rest are offered again, and failed if it refuses them for good
+void ioRingSubmitWaiting(AsyncContext *ctx)
+{
+    IoRing *ring = &ctx->ring;
+    unsigned tail = *ring->sqTail;
+    unsigned added = 0;
+    while (ctx->waitingHead && ctx->inFlight < ring->entries)
+    {
+        AsyncSegment *segment = ctx->waitingHead;
+        ctx->waitingHead = segment->next;
+        if (!ctx->waitingHead)
+            ctx->waitingTail = NULL;
+
+        unsigned index = tail & *ring->sqMask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = segment->fd;
+        sqe->off = segment->offset;
+        sqe->addr = (uintptr_t)segment->buffer;
+        sqe->len = segment->length;
+        sqe->user_data = (uintptr_t)segment;
+        ring->sqArray[index] = index;
+        tail++;
+        added++;
+        ctx->inFlight++;
+    }
+    if (!added)
+        return;
+    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+    unsigned queued;
+    while ((queued = tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)) > 0)
+    {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, queued, 0, 0, NULL, 0);
+        if (submitted > 0 || (submitted < 0 && errno == EINTR))
+            continue;
+        int err = submitted < 0 ? errno : EAGAIN;
+        if ((err == EAGAIN || err == EBUSY) && ioRingBackOff(ctx))
+            continue;
+        fprintf(stderr, "Error submitting to io_uring: %s\n", strerror(err));
+        ioRingFailUnsubmitted(ctx, err);
+        break;
+    }
+}
+
+//helper that queues one byte range of a request for reading
+void asyncQueueSegment(AsyncContext *ctx, AsyncRequest *request, int fd, off_t offset, uint8_t *buffer, size_t length)
+{
+    AsyncSegment *segment = malloc(sizeof(AsyncSegment));
+    if (!segment)
+    {
+        perror("Error allocating memory for async segment");
+        if (request->result >= 0)
+            request->result = -ENOMEM;
+        return;
+    }
+    segment->request = request;
+    segment->fd = fd;
+    segment->offset = offset;
+    segment->buffer = buffer;
+    segment->length = length;
+    segment->result = 0;
+    request->pending++;
+
+    pthread_mutex_lock(&ctx->lock);
+    segmentQueuePush(&ctx->waitingHead, &ctx->waitingTail, segment);
+    pthread_cond_signal(&ctx->workReady);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+//helper that finishes queueing a request: submits it, or completes it at once if nothing needs reading
+int asyncStart(AsyncContext *ctx, AsyncRequest *request)
+{
+    ctx->outstanding++;
+    if (request->pending == 0)
+    {
+        //still delivered through asyncPoll so callbacks never run inside the submit call
+        AsyncSegment *segment = calloc(1, sizeof(AsyncSegment));
+        if (!segment)
+        {
+            perror("Error allocating memory for async segment");
+            ctx->outstanding--;
+            free(request);
+            return -1;
+        }
+        segment->request = request;
+        request->pending = 1;
+        asyncComplete(ctx, segment);
+        return 0;
+    }
+    if (ctx->useRing)
+        ioRingSubmitWaiting(ctx);
+    return 0;
+}
+
+//function that starts reading length bytes at the file's position; the position advances immediately
+int readFileAsync(AsyncContext *ctx, File *file, void *buffer, size_t length, AsyncCallback callback, void *userData)
+{
+    AsyncRequest *request = malloc(sizeof(AsyncRequest));
+    if (!request)
+    {
+        perror("Error allocating memory for async request");
+        return -1;
+    }
+    request->callback = callback;
+    request->userData = userData;
+    request->pending = 0;
+    request->result = 0;
+
+    const Volume *volume = file->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    uint8_t *buf = buffer;
+    if (file->filePosition < file->fileSize && length > file->fileSize - file->filePosition)
+    {
+        length = file->fileSize - file->filePosition;
+    }
+
+    //one segment per run of contiguous clusters, cut at byte granularity so no bounce buffer is needed
+    while (length > 0 && file->filePosition < file->fileSize)
+    {
+        uint32_t logicalCluster = file->filePosition / clusterSize;
+        const Extent *ext = findExtent(file, logicalCluster);
+        if (!ext)
+        {
+            fprintf(stderr, "Cluster chain is shorter than the file size\n");
+            break;
+        }
+        file->currentCluster = ext->startCluster + (logicalCluster - ext->logicalCluster);
+        uint64_t runBytes = (uint64_t)(ext->logicalCluster + ext->length) * clusterSize - file->filePosition;
+        size_t chunk = runBytes < length ? runBytes : length;
+        if (chunk > ASYNC_MAX_SEGMENT)
+            chunk = ASYNC_MAX_SEGMENT;
+        off_t offset = clusterToSector(volume, file->currentCluster) * volume->bootSector.BPB_BytsPerSec +
+                       file->filePosition % clusterSize;
+
+        if (volume->map)
+        {
+            //a mapped volume has nothing to wait for
+            ssize_t got = readVolume(volume, offset, buf, chunk);
+            if (got > 0)
+                request->result += got;
+            if (got != (ssize_t)chunk)
+                break;
+        }
+        else
+        {
+            asyncQueueSegment(ctx, request, volume->fd, offset, buf, chunk);
+        }
+        buf += chunk;
+        file->filePosition += chunk;
+        length -= chunk;
+    }
+    file->lastReadEnd = file->filePosition;
+    return asyncStart(ctx, request);
+}
+
+//function that starts reading one sector of the volume
+int readSectorAsync(AsyncContext *ctx, const Volume *volume, off_t sector, void *buffer, AsyncCallback callback, void *userData)
+{
+    AsyncRequest *request = malloc(sizeof(AsyncRequest));
+    if (!request)
+    {
+        perror("Error allocating memory for async request");
+        return -1;
+    }
+    request->callback = callback;
+    request->userData = userData;
+    request->pending = 0;
+    request->result = 0;
+
+    off_t offset = sector * volume->bootSector.BPB_BytsPerSec;
+    if (volume->map)
+    {
+        request->result = readVolume(volume, offset, buffer, volume->bootSector.BPB_BytsPerSec);
+    }
+    else
+    {
+        asyncQueueSegment(ctx, request, volume->fd, offset, buffer, volume->bootSector.BPB_BytsPerSec);
+    }
+    return asyncStart(ctx, request);
+}
+
+//helper that accounts a finished segment and runs the request's callback once all its segments are in
+int asyncFinishSegment(AsyncContext *ctx, AsyncSegment *segment)
+{
+    AsyncRequest *request = segment->request;
+    if (segment->result < 0)
+    {
+        if (request->result >= 0)
+            request->result = segment->result;
+    }
+    else if (request->result >= 0)
+    {
+        request->result += segment->result;
+    }
+    free(segment);
+
+    if (--request->pending > 0)
+        return 0;
+    ctx->outstanding--;
+    if (request->callback)
+        request->callback(request->userData, request->result);
+    free(request);
+    return 1;
+}
+
+//function that delivers finished reads by running their callbacks, optionally blocking for at least one
+//returns the number of requests completed, or -1 on error
+int asyncPoll(AsyncContext *ctx, bool wait)
+{
+    uint64_t ticks;
+    if (read(ctx->eventFd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+        perror("Error clearing async eventfd");
+
+    AsyncSegment *doneHead = NULL, *doneTail = NULL;
+    int completed = 0;
+    do
+    {
+        pthread_mutex_lock(&ctx->lock);
+        if (wait && !ctx->useRing)
+        {
+            while (!ctx->doneHead && ctx->outstanding > 0)
+            {
+                pthread_cond_wait(&ctx->workDone, &ctx->lock);
+            }
+        }
+        doneHead = ctx->doneHead;
+        doneTail = ctx->doneTail;
+        ctx->doneHead = ctx->doneTail = NULL;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (ctx->useRing)
+        {
+            ioRingReap(ctx, &doneHead, &doneTail);
+            if (!doneHead && wait && ctx->inFlight > 0)
+            {
+                if (syscall(__NR_io_uring_enter, ctx->ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                {
+                    perror("Error waiting on io_uring");
+                    return -1;
+                }
+                ioRingReap(ctx, &doneHead, &doneTail);
+            }
+            ioRingSubmitWaiting(ctx);
+        }
+
+        while (doneHead)
+        {
+            AsyncSegment *next = doneHead->next;
+            completed += asyncFinishSegment(ctx, doneHead);
+            doneHead = next;
+        }
+    } while (wait && completed == 0 && ctx->outstanding > 0);
+    return completed;
+}
+
+//function that waits for every outstanding read, then frees the engine
+void asyncDestroy(AsyncContext *ctx)
+{
+    if (!ctx)
+        return;
+    while (ctx->outstanding > 0 && asyncPoll(ctx, true) >= 0)
+    {
+    }
+    asyncRelease(ctx);
+}
+
+// path lookup (task 7)
+
+//function that computes the checksum of an 8.3 name that LFN entries carry in LDIR_Chksum
+uint8_t shortNameChecksum(const uint8_t *shortName)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+    {
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + shortName[i];
+    }
+    return sum;
+}
+
+//function that forgets any partly collected long name; also initializes a fresh state
+void longNameReset(LongNameState *state)
+{
+    state->checksum = 0;
+    state->nextOrd = 0;
+    state->parts = 0;
+    state->dropped = false;
+}
+
+//function that adds one LFN entry; parts arrive last-first, any gap or checksum change drops the name
+void longNameAdd(LongNameState *state, const LongDirectoryEntry *longEntry)
+{
+    int ord = longEntry->LDIR_Ord & 0x3F;
+    if (longEntry->LDIR_Ord & 0x40)
+    {
+        //first entry on disk holds the last part of the name and starts a new sequence
+        if (ord == 0 || ord > LFN_MAX_PARTS)
+        {
+            longNameReset(state);
+            state->dropped = true;
+            return;
+        }
+        state->parts = ord;
+        state->checksum = longEntry->LDIR_Chksum;
+        for (int i = 0; i < 13; i++)
+        {
+            state->units[(ord - 1) * 13 + i] = 0xFFFF;
+        }
+    }
+    else if (ord == 0 || ord > LFN_MAX_PARTS || ord != state->nextOrd || longEntry->LDIR_Chksum != state->checksum)
+    {
+        //ord 0 matches an idle state and would index before the first part
+        longNameReset(state);
+        state->dropped = true;
+        return;
+    }
+
+    parseLongNameEntry(longEntry, state->units, (ord - 1) * 13);
+    state->nextOrd = ord - 1;
+}
+
+//function that completes a long name at its short entry, returns false if there is no valid long name
+bool longNameFinish(LongNameState *state, const DirectoryEntry *entry, char *out, size_t outSize)
+{
+    bool valid = state->parts > 0 && state->nextOrd == 0 && shortNameChecksum(entry->DIR_Name) == state->checksum;
+    if (valid)
+    {
+        utf16ToUtf8(state->units, state->parts * 13, out, outSize);
+    }
+    longNameReset(state);
+    return valid;
+}
+
+//function that turns a padded 8.3 name into "NAME.EXT"
+void fatNameToString(const uint8_t *fatName, char *str)
+{
+    int i, j;
+    for (i = 0, j = 0; i < 8 && fatName[i] != ' '; i++, j++)
+    {
+        //0x05 stands for a leading 0xE5 byte, which would otherwise mean deleted
+        str[j] = (i == 0 && fatName[i] == 0x05) ? (char)0xE5 : fatName[i];
+    }
+    if (fatName[8] != ' ')
+    {
+        str[j++] = '.';
+        for (i = 8; i < 11 && fatName[i] != ' '; i++, j++)
+        {
+            str[j] = fatName[i];
+        }
+    }
+    str[j] = '\0';
+}
+
+//function to compare fat16 filename with c string, ignoring case like FAT does
+bool compareFatName(const uint8_t *fatName, const char *str)
+{
+    char temp[13];
+    fatNameToString(fatName, temp);
+    return strcasecmp(temp, str) == 0;
+}
+
+//function that returns the first cluster of a directory entry, 0 meaning the root directory
+uint32_t entryFirstCluster(const DirectoryEntry *entry)
+{
+    return (uint32_t)entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+}
+
+//function that opens a directory for streaming: cluster 0 is the root directory (the fixed root region on
+//FAT16, the BPB_RootClus chain on FAT32), anything else the directory's own cluster chain. Only one cluster
+//of entries is held in memory at a time
+DirIterator *dirOpen(const Volume *volume, uint32_t firstCluster)
+{
+    DirIterator *it = calloc(1, sizeof(DirIterator));
+    if (!it)
+    {
+        perror("Error allocating memory for directory iterator");
+        return NULL;
+    }
+    const BootSector *bs = &volume->bootSector;
+    if (firstCluster == 0 && volume->isFAT32)
+    {
+        firstCluster = volume->rootCluster;
+    }
+    it->volume = volume;
+    it->firstCluster = firstCluster;
+    it->nextCluster = firstCluster;
+    it->rootRemaining = firstCluster == 0 ? bs->BPB_RootEntCnt : 0;
+    it->rootOffset = (off_t)(bs->BPB_RsvdSecCnt + (bs->BPB_NumFATs * volume->fatSectors)) * bs->BPB_BytsPerSec;
+    longNameReset(&it->longName);
+
+    it->buffer = malloc(bs->BPB_BytsPerSec * bs->BPB_SecPerClus);
+    it->classes = malloc(bs->BPB_BytsPerSec * bs->BPB_SecPerClus / sizeof(DirectoryEntry));
+    if (!it->buffer || !it->classes)
+    {
+        perror("Error allocating memory for directory buffer");
+        free(it->buffer);
+        free(it->classes);
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+//helper that loads the next cluster (or root chunk) of entries, returns false at the end of the directory
+bool dirFill(DirIterator *it)
+{
+    const Volume *volume = it->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    uint32_t perCluster = clusterSize / sizeof(DirectoryEntry);
+    it->bufferFirstSlot += it->bufferEntries;
+    it->bufferEntries = 0;
+    STAT_TIMER_START(timer);
+
+    if (it->firstCluster == 0)
+    {
+        if (it->rootRemaining == 0)
+            return false;
+        uint32_t count = it->rootRemaining < perCluster ? it->rootRemaining : perCluster;
+        if (readVolume(volume, it->rootOffset, it->buffer, count * sizeof(DirectoryEntry)) != (ssize_t)(count * sizeof(DirectoryEntry)))
+        {
+            perror("Error reading root directory");
+            return false;
+        }
+        it->rootOffset += count * sizeof(DirectoryEntry);
+        it->rootRemaining -= count;
+        it->bufferEntries = count;
+    }
+    else
+    {
+        uint32_t cluster = it->nextCluster;
+        if (!clusterInData(volume, cluster) || it->clustersRead >= volume->clusterCount)
+            return false;
+        if (readCluster(volume, cluster, it->buffer) != clusterSize)
+        {
+            perror("Error reading dir");
+            return false;
+        }
+        it->clustersRead++;
+        it->nextCluster = nextCluster(volume, cluster);
+        it->bufferEntries = perCluster;
+    }
+    //classifying the whole cluster in one pass of the scan kernel
+    classifyEntries(it->buffer, it->bufferEntries, it->classes);
+    it->index = 0;
+    STAT_TIMER_STOP(volume, STAT_OP_DIRECTORY, timer);
+    return true;
+}
+
+//function that returns the next live entry with its long name assembled, false at the end of the directory
+//deleted entries, LFN pieces and volume labels are skipped; "." and ".." are returned like any other entry
+bool dirNext(DirIterator *it, DirectoryItem *item)
+{
+    while (!it->finished)
+    {
+        if (it->index >= it->bufferEntries && !dirFill(it))
+        {
+            it->finished = true;
+            break;
+        }
+        uint8_t cls = it->classes[it->index];
+        const DirectoryEntry *entry = &it->buffer[it->index++];
+
+        if (cls == ENTRY_END) //no more entries
+        {
+            it->finished = true;
+            break;
+        }
+        if (cls == ENTRY_DELETED)
+        {
+            longNameReset(&it->longName);
+            continue;
+        }
+        if (cls == ENTRY_LONG_NAME)
+        {
+            longNameAdd(&it->longName, (const LongDirectoryEntry *)entry);
+            continue;
+        }
+
+        bool pending = it->longName.parts > 0 || it->longName.dropped;
+        int parts = it->longName.parts;
+        item->hasLongName = longNameFinish(&it->longName, entry, item->name, sizeof(item->name));
+        item->badLongName = pending && !item->hasLongName;
+        item->slot = it->bufferFirstSlot + it->index - 1;
+        item->longNameSlots = item->hasLongName ? parts : 0;
+        if (cls == ENTRY_VOLUME_LABEL)
+            continue;
+
+        item->entry = *entry;
+        fatNameToString(entry->DIR_Name, item->shortName);
+        if (!item->hasLongName)
+        {
+            strcpy(item->name, item->shortName);
+        }
+        return true;
+    }
+    return false;
+}
+
+//function that closes a directory iterator
+void dirClose(DirIterator *it)
+{
+    if (!it)
+        return;
+    free(it->buffer);
+    free(it->classes);
+    free(it);
+}
+
+//function that times the directory scan (classification plus long name decoding) over a buffer of
+//entries and returns the rate in entries per second
+double measureScanRate(const DirectoryEntry *entries, size_t count, int passes)
+{
+    uint8_t *classes = malloc(count ? count : 1);
+    if (!classes)
+    {
+        perror("Error allocating memory for scan classes");
+        return 0;
+    }
+    char name[LFN_MAX_PARTS * 13 * 3 + 1];
+    size_t scanned = 0; //entries actually examined, the scan stops at the end marker
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int pass = 0; pass < passes; pass++)
+    {
+        LongNameState longName;
+        longNameReset(&longName);
+        classifyEntries(entries, count, classes);
+        size_t i = 0;
+        for (; i < count && classes[i] != ENTRY_END; i++)
+        {
+            if (classes[i] == ENTRY_LONG_NAME)
+                longNameAdd(&longName, (const LongDirectoryEntry *)&entries[i]);
+            else if (classes[i] == ENTRY_DELETED)
+                longNameReset(&longName);
+            else
+                longNameFinish(&longName, &entries[i], name, sizeof(name));
+        }
+        scanned += i;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(classes);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return seconds > 0 ? (double)scanned / seconds : 0;
+}
+
+//function that reads and prints the entries of a directory (cluster 0 for the root) in on-disk order
+void readDirectory(const Volume *volume, uint32_t firstCluster)
+{
+    DirIterator *it = dirOpen(volume, firstCluster);
+    if (!it)
+        return;
+
+    DirectoryItem item;
+    while (dirNext(it, &item))
+    {
+        if (item.hasLongName)
+        {
+            printf("Long Filename: %s\n", item.name);
+        }
+        printDirectoryEntry(&item.entry); //call printing function
+    }
+    dirClose(it);
+}
+
+//helper that hashes a name case-insensitively together with its directory
+uint32_t dentryHash(uint32_t parentCluster, const char *name)
+{
+    uint32_t hash = 2166136261u ^ parentCluster;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        unsigned char c = (*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p;
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+//helper that adds a name to the cache, doubling the table when it fills up; caller holds the lock
+void dentryInsert(DentryCache *cache, uint32_t parentCluster, const char *name, const DirectoryEntry *entry)
+{
+    if (cache->count >= cache->bucketMask + 1)
+    {
+        uint32_t newMask = cache->bucketMask * 2 + 1;
+        DentryNode **grown = calloc(newMask + 1, sizeof(DentryNode *));
+        if (grown)
+        {
+            for (uint32_t i = 0; i <= cache->bucketMask; i++)
+            {
+                DentryNode *node = cache->buckets[i];
+                while (node)
+                {
+                    DentryNode *next = node->next;
+                    node->next = grown[node->hash & newMask];
+                    grown[node->hash & newMask] = node;
+                    node = next;
+                }
+            }
+            free(cache->buckets);
+            cache->buckets = grown;
+            cache->bucketMask = newMask;
+        }
+    }
+
+    size_t nameLength = strlen(name);
+    DentryNode *node = malloc(sizeof(DentryNode) + nameLength + 1);
+    if (!node)
+    {
+        perror("Error allocating memory for dentry");
+        return;
+    }
+    node->hash = dentryHash(parentCluster, name);
+    node->parentCluster = parentCluster;
+    node->entry = *entry;
+    memcpy(node->name, name, nameLength + 1);
+    node->next = cache->buckets[node->hash & cache->bucketMask];
+    cache->buckets[node->hash & cache->bucketMask] = node;
+    cache->count++;
+}
+
+//helper that finds a cached name; caller holds the lock
+const DentryNode *dentryFind(const DentryCache *cache, uint32_t parentCluster, const char *name)
+{
+    uint32_t hash = dentryHash(parentCluster, name);
+    for (const DentryNode *node = cache->buckets[hash & cache->bucketMask]; node; node = node->next)
+    {
+        if (node->hash == hash && node->parentCluster == parentCluster && strcasecmp(node->name, name) == 0)
+        {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+//function that scans one directory and caches every live entry under its short and long names
+bool loadDirectoryNames(Volume *volume, uint32_t dirCluster)
+{
+    //a damaged entry can point anywhere, the loaded bitmap only covers the data region
+    if (dirCluster != 0 && (dirCluster < 2 || dirCluster >= volume->clusterCount + 2))
+        return false;
+    DentryCache *cache = volume->dentries;
+    pthread_mutex_lock(&cache->lock);
+    bool loaded = cache->loaded[dirCluster / 8] & (1 << (dirCluster % 8));
+    pthread_mutex_unlock(&cache->lock);
+    if (loaded)
+        return true;
+
+    //reading without the lock so lookups in other directories are not held up by disk I/O
+    DirIterator *it = dirOpen(volume, dirCluster);
+    if (!it)
+        return false;
+    size_t count = 0, capacity = 64;
+    DirectoryItem *items = malloc(capacity * sizeof(DirectoryItem));
+    if (!items)
+    {
+        perror("Error allocating memory for directory names");
+        dirClose(it);
+        return false;
+    }
+    while (dirNext(it, &items[count]))
+    {
+        if (++count == capacity)
+        {
+            capacity *= 2;
+            DirectoryItem *grown = realloc(items, capacity * sizeof(DirectoryItem));
+            if (!grown)
+            {
+                perror("Error growing directory names");
+                free(items);
+                dirClose(it);
+                return false;
+            }
+            items = grown;
+        }
+    }
+    dirClose(it);
+
+    pthread_mutex_lock(&cache->lock);
+    //another thread may have loaded it while this one was reading
+    if (!(cache->loaded[dirCluster / 8] & (1 << (dirCluster % 8))))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            dentryInsert(cache, dirCluster, items[i].shortName, &items[i].entry);
+            if (items[i].hasLongName && strcasecmp(items[i].name, items[i].shortName) != 0)
+            {
+                dentryInsert(cache, dirCluster, items[i].name, &items[i].entry);
+            }
+        }
+        cache->loaded[dirCluster / 8] |= 1 << (dirCluster % 8);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(items);
+    return true;
+}
+
+//function that finds a name (8.3 or long, any case) in a directory, using the dentry cache
+bool findDirectoryEntry(Volume *volume, uint32_t dirCluster, const char *name, DirectoryEntry *found)
+{
+    if (!loadDirectoryNames(volume, dirCluster))
+        return false;
+
+    pthread_mutex_lock(&volume->dentries->lock);
+    const DentryNode *node = dentryFind(volume->dentries, dirCluster, name);
+    if (node)
+    {
+        *found = node->entry;
+    }
+    pthread_mutex_unlock(&volume->dentries->lock);
+    return node != NULL;
+}
+
+//function that resolves a path like "/DIR1/SESSIONS.TXT" to a copy of its directory entry, caller frees
+//"/" resolves to a synthetic directory entry for the root directory
+DirectoryEntry *followPath(Volume *volume, const char *path)
+{
+    DirectoryEntry current;
+    memset(&current, 0, sizeof(current));
+    memset(current.DIR_Name, ' ', sizeof(current.DIR_Name));
+    current.DIR_Name[0] = '/';
+    current.DIR_Attr = 0x10; //the root directory, cluster 0
+
+    if (path == NULL)
+        path = "/";
+
+    const char *p = path;
+    while (*p)
+    {
+        while (*p == '/')
+            p++;
+        if (!*p)
+            break;
+        const char *end = strchr(p, '/');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        if (length > LFN_MAX_PARTS * 13 * 3)
+        {
+            fprintf(stderr, "Path component too long: %s\n", path);
+            return NULL;
+        }
+        if (!(current.DIR_Attr & 0x10))
+        {
+            fprintf(stderr, "Not a directory in path: %s\n", path);
+            return NULL;
+        }
+        uint32_t dirCluster = entryFirstCluster(&current);
+        if (dirCluster != 0 && (dirCluster < 2 || dirCluster >= volume->clusterCount + 2))
+        {
+            fprintf(stderr, "Damaged directory entry in path: %s\n", path);
+            return NULL;
+        }
+
+        char component[length + 1];
+        memcpy(component, p, length);
+        component[length] = '\0';
+        if (!findDirectoryEntry(volume, dirCluster, component, &current))
+        {
+            return NULL;
+        }
+        p += length;
+    }
+
+    DirectoryEntry *foundEntry = malloc(sizeof(DirectoryEntry));
+    if (!foundEntry)
+    {
+        perror("Error allocating memory for directory entry");
+        return NULL;
+    }
+    *foundEntry = current;
+    return foundEntry;
+}
+
+//function that opens the file at a path, NULL if it does not exist or is a directory
+File *openPath(Volume *volume, const char *path)
+{
+    DirectoryEntry *entry = followPath(volume, path);
+    if (!entry)
+    {
+        fprintf(stderr, "No such file: %s\n", path);
+        return NULL;
+    }
+    if (entry->DIR_Attr & 0x10)
+    {
+        fprintf(stderr, "Is a directory: %s\n", path);
+        free(entry);
+        return NULL;
+    }
+    File *file = openFile(volume, entry);
+    free(entry);
+    return file;
+}
+
+// batched reads
+
+//helper for sorting batch pieces by disk offset, the longest first at the same offset so it can serve the others
+int compareBatchPieces(const void *a, const void *b)
+{
+    const BatchPiece *x = a, *y = b;
+    if (x->diskOffset != y->diskOffset)
+        return x->diskOffset < y->diskOffset ? -1 : 1;
+    return (x->length < y->length) - (x->length > y->length);
+}
+
+//helper that appends one request's pieces, one per run of contiguous clusters it touches; request->result already
+//holds the length cut to the end of the file
+bool batchAddPieces(const File *file, const BatchRequest *request, uint32_t index, BatchPiece **pieces, size_t *count,
+                    size_t *capacity)
+{
+    const Volume *volume = file->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    uint64_t position = request->offset;
+    size_t remaining = request->result;
+    uint8_t *buffer = request->buffer;
+    while (remaining > 0)
+    {
+        uint32_t logicalCluster = position / clusterSize;
+        const Extent *ext = findExtent(file, logicalCluster);
+        if (!ext)
+        {
+            fprintf(stderr, "Cluster chain is shorter than the file size\n");
+            return false;
+        }
+        if (*count == *capacity)
+        {
+            size_t grownCapacity = *capacity ? *capacity * 2 : 64;
+            BatchPiece *grown = realloc(*pieces, grownCapacity * sizeof(BatchPiece));
+            if (!grown)
+            {
+                perror("Error growing batch piece list");
+                return false;
+            }
+            *pieces = grown;
+            *capacity = grownCapacity;
+        }
+        uint32_t cluster = ext->startCluster + (logicalCluster - ext->logicalCluster);
+        uint64_t runBytes = (uint64_t)(ext->logicalCluster + ext->length) * clusterSize - position;
+        size_t chunk = runBytes < remaining ? runBytes : remaining;
+        (*pieces)[(*count)++] = (BatchPiece){
+            .diskOffset = clusterToSector(volume, cluster) * volume->bootSector.BPB_BytsPerSec + position % clusterSize,
+            .length = chunk,
+            .buffer = buffer,
+            .request = index,
+            .copyFrom = SIZE_MAX,
+        };
+        position += chunk;
+        buffer += chunk;
+        remaining -= chunk;
+    }
+    return true;
+}
+
+//function that serves many reads at once, ordered like an elevator: every request is mapped to the physical runs it
+//covers, the runs of all requests are sorted by disk offset, and neighbours are merged into one vectored read each
+//(holes up to BATCH_MAX_GAP are read and dropped, a run inside another is copied from it). Reading the first 4 KiB of
+//every file becomes one forward sweep over the image with a few large reads. Files' positions are not moved and the
+//block cache is bypassed. Each request's result is its byte count or -1; returns true when no request failed
+bool readBatch(Volume *volume, BatchRequest *requests, size_t count)
+{
+    File **opened = calloc(count ? count : 1, sizeof(File *));
+    struct iovec *iov = malloc(BATCH_MAX_IOVECS * sizeof(struct iovec));
+    uint8_t *scratch = malloc(BATCH_MAX_GAP);
+    BatchPiece *pieces = NULL;
+    size_t pieceCount = 0, pieceCapacity = 0;
+    bool ok = opened && iov && scratch;
+    if (!ok)
+        perror("Error allocating memory for batch read");
+
+    //mapping every request to pieces of the image
+    for (size_t i = 0; i < count; i++)
+    {
+        BatchRequest *request = &requests[i];
+        request->result = -1;
+        if (!ok)
+            continue;
+        File *file = request->file;
+        if (!file && request->path)
+            file = opened[i] = openPath(volume, request->path);
+        if (!file)
+            continue;
+        uint64_t available = request->offset < file->fileSize ? file->fileSize - request->offset : 0;
+        request->result = request->length < available ? request->length : available;
+        if (!batchAddPieces(file, request, i, &pieces, &pieceCount, &pieceCapacity))
+            request->result = -1;
+    }
+    if (pieceCount > 0)
+        qsort(pieces, pieceCount, sizeof(BatchPiece), compareBatchPieces);
+
+    //one sweep from the lowest offset up, each group of neighbouring pieces in one read
+    uint32_t maxGap = volume->map ? 0 : BATCH_MAX_GAP; //a mapping has no seeks to save
+    size_t first = 0;
+    while (ok && first < pieceCount)
+    {
+        off_t start = pieces[first].diskOffset, end = start + pieces[first].length;
+        size_t cover = first, last = first + 1;
+        int iovcnt = 0;
+        iov[iovcnt++] = (struct iovec){.iov_base = pieces[first].buffer, .iov_len = pieces[first].length};
+        for (; last < pieceCount; last++)
+        {
+            BatchPiece *piece = &pieces[last];
+            off_t pieceEnd = piece->diskOffset + piece->length;
+            if (pieceEnd <= end)
+            {
+                //sorted by offset, so it lies inside the last piece read
+                piece->copyFrom = cover;
+                continue;
+            }
+            if (piece->diskOffset < end || piece->diskOffset - end > maxGap || iovcnt + 2 > BATCH_MAX_IOVECS ||
+                pieceEnd - start > BATCH_MAX_READ)
+                break;
+            if (piece->diskOffset > end)
+                iov[iovcnt++] = (struct iovec){.iov_base = scratch, .iov_len = piece->diskOffset - end};
+            iov[iovcnt++] = (struct iovec){.iov_base = piece->buffer, .iov_len = piece->length};
+            cover = last;
+            end = pieceEnd;
+        }
+
+        bool groupOk = readVolumeVectored(volume, start, iov, iovcnt) == end - start;
+        for (size_t p = first; p < last; p++)
+        {
+            BatchPiece *piece = &pieces[p];
+            if (!groupOk)
+                requests[piece->request].result = -1;
+            else if (piece->copyFrom != SIZE_MAX)
+                memmove(piece->buffer, pieces[piece->copyFrom].buffer + (piece->diskOffset - pieces[piece->copyFrom].diskOffset),
+                        piece->length);
+        }
+        if (!groupOk)
+            fprintf(stderr, "Error reading batch at offset %lld\n", (long long)start);
+        first = last;
+    }
+
+    bool allRead = ok;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (opened && opened[i])
+            closeFile(opened[i]);
+        allRead = allRead && requests[i].result >= 0;
+    }
+    free(opened);
+    free(iov);
+    free(scratch);
+    free(pieces);
+    return allRead;
+}
+
+// whole-volume walker
+
+//helper that pushes a task at the bottom of a deque
+bool walkPush(WalkDeque *deque, WalkTask task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity)
+    {
+        //sliding the live tasks down before growing
+        if (deque->top > 0)
+        {
+            memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(WalkTask));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        if (deque->bottom == deque->capacity)
+        {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            WalkTask *grown = realloc(deque->tasks, capacity * sizeof(WalkTask));
+            if (!grown)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                perror("Error growing walk deque");
+                return false;
+            }
+            deque->tasks = grown;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->bottom++] = task;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+//helper that takes the newest task of the worker's own deque (depth first, good locality)
+bool walkPop(WalkDeque *deque, WalkTask *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found)
+        *task = deque->tasks[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+//helper that steals the oldest task of another worker's deque (usually the biggest subtree)
+bool walkSteal(WalkDeque *deque, WalkTask *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found)
+        *task = deque->tasks[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+//helper that scans one directory, visiting its entries and queueing its subdirectories on the worker's deque
+void walkDirectory(WalkState *state, int worker, WalkTask *task)
+{
+    DirIterator *it = dirOpen(state->volume, task->cluster);
+    if (!it)
+        return;
+
+    size_t baseLength = strlen(task->path);
+    DirectoryItem item;
+    while (dirNext(it, &item))
+    {
+        if (strcmp(item.shortName, ".") == 0 || strcmp(item.shortName, "..") == 0)
+            continue;
+
+        size_t nameLength = strlen(item.name);
+        char path[baseLength + nameLength + 2];
+        memcpy(path, task->path, baseLength);
+        path[baseLength] = '/';
+        memcpy(path + baseLength + 1, item.name, nameLength + 1);
+
+        if (state->visitor)
+            state->visitor(path, &item, state->userData);
+
+        uint32_t cluster = entryFirstCluster(&item.entry);
+        if (!(item.entry.DIR_Attr & 0x10) || cluster < 2 || cluster >= state->volume->clusterCount + 2)
+            continue;
+        //claiming the directory, a cross-linked or looping tree must not be walked twice
+        uint8_t bit = 1 << (cluster % 8);
+        if (__atomic_fetch_or(&state->visited[cluster / 8], bit, __ATOMIC_RELAXED) & bit)
+            continue;
+
+        WalkTask child = {.cluster = cluster, .path = strdup(path)};
+        if (!child.path)
+        {
+            perror("Error allocating memory for walk path");
+            continue;
+        }
+        __atomic_add_fetch(&state->pending, 1, __ATOMIC_ACQ_REL);
+        if (!walkPush(&state->deques[worker], child))
+        {
+            free(child.path);
+            __atomic_sub_fetch(&state->pending, 1, __ATOMIC_ACQ_REL);
+            continue;
+        }
+        //waking a parked worker to steal it; sequentially consistent so the count and idleCount cannot
+        //both miss each other
+        __atomic_add_fetch(&state->queued, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&state->idleCount, __ATOMIC_SEQ_CST) > 0)
+        {
+            pthread_mutex_lock(&state->idleLock);
+            pthread_cond_signal(&state->workAvailable);
+            pthread_mutex_unlock(&state->idleLock);
+        }
+    }
+    dirClose(it);
+}
+
+//helper that parks a worker with nothing to do until a task is queued or the walk is over
+void walkWaitForWork(WalkState *state)
+{
+    pthread_mutex_lock(&state->idleLock);
+    __atomic_add_fetch(&state->idleCount, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&state->queued, __ATOMIC_SEQ_CST) == 0 &&
+           __atomic_load_n(&state->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        pthread_cond_wait(&state->workAvailable, &state->idleLock);
+    }
+    __atomic_sub_fetch(&state->idleCount, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&state->idleLock);
+}
+
+//helper run by every walker thread: work from its own deque, steal when empty, stop when nothing is pending
+void walkWorkerLoop(WalkState *state, int worker)
+{
+    while (__atomic_load_n(&state->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        WalkTask task;
+        bool found = walkPop(&state->deques[worker], &task);
+        for (int i = 1; !found && i < state->workerCount; i++)
+        {
+            found = walkSteal(&state->deques[(worker + i) % state->workerCount], &task);
+        }
+        if (!found)
+        {
+            walkWaitForWork(state);
+            continue;
+        }
+        __atomic_sub_fetch(&state->queued, 1, __ATOMIC_SEQ_CST);
+        walkDirectory(state, worker, &task);
+        free(task.path);
+        if (__atomic_sub_fetch(&state->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            //the last directory is done, every parked worker has to see that and leave
+            pthread_mutex_lock(&state->idleLock);
+            pthread_cond_broadcast(&state->workAvailable);
+            pthread_mutex_unlock(&state->idleLock);
+        }
+    }
+}
+
+//helper that is the entry point of the extra walker threads
+void *walkWorker(void *arg)
+{
+    WalkWorkerArgs *args = arg;
+    walkWorkerLoop(args->state, args->worker);
+    return NULL;
+}
+
+//function that walks the root directory and every subdirectory with nthreads threads, each directory being
+//a task on a work-stealing deque. The visitor sees every entry except "." and ".." and must be thread-safe
+bool walkVolume(Volume *volume, WalkVisitor visitor, void *userData, int nthreads)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+    WalkState *state = calloc(1, sizeof(WalkState));
+    uint8_t *visited = calloc(((size_t)volume->clusterCount + 2 + 7) / 8, 1);
+    WalkDeque *deques = calloc(nthreads, sizeof(WalkDeque));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    WalkWorkerArgs *args = calloc(nthreads, sizeof(WalkWorkerArgs));
+    char *rootPath = strdup("");
+    if (!state || !visited || !deques || !threads || !args || !rootPath)
+    {
+        perror("Error allocating memory for volume walk");
+        free(state);
+        free(visited);
+        free(deques);
+        free(threads);
+        free(args);
+        free(rootPath);
+        return false;
+    }
+    state->volume = volume;
+    state->visitor = visitor;
+    state->userData = userData;
+    state->visited = visited;
+    state->deques = deques;
+    state->workerCount = nthreads;
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_mutex_init(&deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&state->idleLock, NULL);
+    pthread_cond_init(&state->workAvailable, NULL);
+
+    state->pending = 1;
+    state->queued = 1;
+    walkPush(&deques[0], (WalkTask){.cluster = 0, .path = rootPath});
+
+    //the calling thread is worker 0
+    int started = 1;
+    for (int i = 1; i < nthreads; i++)
+    {
+        args[i] = (WalkWorkerArgs){.state = state, .worker = i};
+        if (pthread_create(&threads[i], NULL, walkWorker, &args[i]) != 0)
+        {
+            perror("Error starting walker thread");
+            break;
+        }
+        started++;
+    }
+    walkWorkerLoop(state, 0);
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].tasks);
+    }
+    pthread_mutex_destroy(&state->idleLock);
+    pthread_cond_destroy(&state->workAvailable);
+    free(deques);
+    free(threads);
+    free(args);
+    free(visited);
+    free(state);
+    return true;
+}
+
+//helper visitor that appends an entry to a manifest
+void manifestVisitor(const char *path, const DirectoryItem *item, void *userData)
+{
+    Manifest *manifest = userData;
+    char *copy = strdup(path);
+    if (!copy)
+    {
+        perror("Error allocating memory for manifest path");
+        return;
+    }
+
+    pthread_mutex_lock(&manifest->lock);
+    if (manifest->count == manifest->capacity)
+    {
+        size_t capacity = manifest->capacity ? manifest->capacity * 2 : 256;
+        ManifestEntry *grown = realloc(manifest->entries, capacity * sizeof(ManifestEntry));
+        if (!grown)
+        {
+            pthread_mutex_unlock(&manifest->lock);
+            perror("Error growing manifest");
+            free(copy);
+            return;
+        }
+        manifest->entries = grown;
+        manifest->capacity = capacity;
+    }
+    const DirectoryEntry *entry = &item->entry;
+    manifest->entries[manifest->count++] = (ManifestEntry){
+        .path = copy,
+        .size = entry->DIR_FileSize,
+        .attributes = entry->DIR_Attr,
+        .firstCluster = entryFirstCluster(entry),
+        .crtDate = entry->DIR_CrtDate,
+        .crtTime = entry->DIR_CrtTime,
+        .wrtDate = entry->DIR_WrtDate,
+        .wrtTime = entry->DIR_WrtTime,
+    };
+    pthread_mutex_unlock(&manifest->lock);
+}
+
+//helper for sorting manifest entries by path
+int compareManifestPaths(const void *a, const void *b)
+{
+    return strcmp(((const ManifestEntry *)a)->path, ((const ManifestEntry *)b)->path);
+}
+
+//function that frees a manifest and its paths
+void freeManifest(Manifest *manifest)
+{
+    if (!manifest)
+        return;
+    for (size_t i = 0; i < manifest->count; i++)
+    {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+    pthread_mutex_destroy(&manifest->lock);
+    free(manifest);
+}
+
+//function that walks the whole volume in parallel and returns every entry sorted by path, caller frees
+Manifest *buildManifest(Volume *volume, int nthreads)
+{
+    Manifest *manifest = calloc(1, sizeof(Manifest));
+    if (!manifest)
+    {
+        perror("Error allocating memory for manifest");
+        return NULL;
+    }
+    pthread_mutex_init(&manifest->lock, NULL);
+    if (!walkVolume(volume, manifestVisitor, manifest, nthreads))
+    {
+        freeManifest(manifest);
+        return NULL;
+    }
+    //walk order depends on thread timing, sorting makes the result reproducible
+    qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), compareManifestPaths);
+    return manifest;
+}
+
+//function that prints a manifest, one tab-separated line per entry
+void printManifest(const Manifest *manifest, FILE *out)
+{
+    for (size_t i = 0; i < manifest->count; i++)
+    {
+        const ManifestEntry *e = &manifest->entries[i];
+        fprintf(out, "%s\t%u\t0x%02x\t%u\t%d-%02d-%02d %02d:%02d:%02d\n", e->path, e->size, e->attributes, e->firstCluster,
+                ((e->wrtDate >> 9) & 0x7F) + 1980, (e->wrtDate >> 5) & 0x0F, e->wrtDate & 0x1F,
+                e->wrtTime >> 11, (e->wrtTime >> 5) & 0x3F, (e->wrtTime & 0x1F) * 2);
+    }
+}
+
+// sidecar index
+
+//function that checksums the in-memory FAT (64-bit FNV-1a), used to tell whether an index is stale
+uint64_t fatChecksum(const Volume *volume)
+{
+    uint64_t hash = 14695981039346656037ull;
+    const uint8_t *bytes = (const uint8_t *)volume->fat;
+    size_t length = volume->fatEntries * sizeof(uint16_t);
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+//helper for sorting manifest entries the way sidecarFind searches them
+int compareManifestPathsNoCase(const void *a, const void *b)
+{
+    return strcasecmp(((const ManifestEntry *)a)->path, ((const ManifestEntry *)b)->path);
+}
+
+//function that walks the volume and writes a sidecar index to indexPath (via a temporary file and rename)
+bool writeSidecarIndex(Volume *volume, const char *indexPath, int nthreads)
+{
+    if (volume->isFAT32)
+    {
+        fprintf(stderr, "Sidecar indexes are only supported on FAT16 volumes\n");
+        return false;
+    }
+    Manifest *manifest = buildManifest(volume, nthreads);
+    if (!manifest)
+        return false;
+    qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), compareManifestPathsNoCase);
+
+    SidecarHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.version = SIDECAR_VERSION;
+    header.volumeId = volume->bootSector.BS_VolID;
+    header.fatChecksum = fatChecksum(volume);
+    header.entryCount = manifest->count;
+
+    SidecarEntry *entries = calloc(manifest->count ? manifest->count : 1, sizeof(SidecarEntry));
+    Extent **fileExtents = calloc(manifest->count ? manifest->count : 1, sizeof(Extent *));
+    bool ok = entries && fileExtents;
+    if (!ok)
+        perror("Error allocating memory for sidecar index");
+
+    //laying out entries, their extent slices and the string pool
+    uint64_t stringsSize = 0;
+    uint32_t extentTotal = 0;
+    for (size_t i = 0; ok && i < manifest->count; i++)
+    {
+        const ManifestEntry *m = &manifest->entries[i];
+        SidecarEntry *e = &entries[i];
+        e->pathOffset = stringsSize;
+        e->size = m->size;
+        e->firstCluster = m->firstCluster;
+        e->attributes = m->attributes;
+        e->crtDate = m->crtDate;
+        e->crtTime = m->crtTime;
+        e->wrtDate = m->wrtDate;
+        e->wrtTime = m->wrtTime;
+        e->firstExtent = extentTotal;
+        fileExtents[i] = buildExtents(volume, m->firstCluster, &e->extentCount);
+        if (!fileExtents[i])
+        {
+            ok = false;
+            break;
+        }
+        extentTotal += e->extentCount;
+        stringsSize += strlen(m->path) + 1;
+    }
+    header.extentCount = extentTotal;
+    header.entriesOffset = sizeof(SidecarHeader);
+    header.extentsOffset = header.entriesOffset + (uint64_t)manifest->count * sizeof(SidecarEntry);
+    header.stringsOffset = header.extentsOffset + (uint64_t)extentTotal * sizeof(Extent);
+    header.stringsSize = stringsSize;
+    header.fileSize = header.stringsOffset + stringsSize;
+
+    size_t tempLength = strlen(indexPath) + 5;
+    char tempPath[tempLength];
+    snprintf(tempPath, tempLength, "%s.tmp", indexPath);
+    FILE *out = ok ? fopen(tempPath, "wb") : NULL;
+    if (ok && !out)
+    {
+        perror("Error creating sidecar index");
+        ok = false;
+    }
+    if (ok)
+    {
+        ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(entries, sizeof(SidecarEntry), manifest->count, out) == manifest->count;
+        for (size_t i = 0; ok && i < manifest->count; i++)
+        {
+            ok = fwrite(fileExtents[i], sizeof(Extent), entries[i].extentCount, out) == entries[i].extentCount;
+        }
+        for (size_t i = 0; ok && i < manifest->count; i++)
+        {
+            ok = fputs(manifest->entries[i].path, out) >= 0 && fputc('\0', out) != EOF;
+        }
+        if (fclose(out) != 0)
+            ok = false;
+        if (!ok)
+            perror("Error writing sidecar index");
+        //only a complete index replaces the old one
+        if (ok && rename(tempPath, indexPath) != 0)
+        {
+            perror("Error installing sidecar index");
+            ok = false;
+        }
+        if (!ok)
+            unlink(tempPath);
+    }
+
+    for (size_t i = 0; fileExtents && i < manifest->count; i++)
+    {
+        free(fileExtents[i]);
+    }
+    free(fileExtents);
+    free(entries);
+    freeManifest(manifest);
+    return ok;
+}
+
+//helper that maps an index file and checks it belongs to this volume's current FAT, NULL if not
+SidecarIndex *mapSidecarIndex(const Volume *volume, const char *indexPath)
+{
+    int fd = open(indexPath, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SidecarHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const SidecarHeader *header = map;
+    uint64_t entriesEnd = header->entriesOffset + (uint64_t)header->entryCount * sizeof(SidecarEntry);
+    uint64_t extentsEnd = header->extentsOffset + (uint64_t)header->extentCount * sizeof(Extent);
+    bool valid = memcmp(header->magic, SIDECAR_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == SIDECAR_VERSION &&
+                 header->fileSize == (uint64_t)st.st_size &&
+                 header->volumeId == volume->bootSector.BS_VolID &&
+                 header->fatChecksum == fatChecksum(volume) &&
+                 header->entriesOffset % 8 == 0 && entriesEnd <= header->extentsOffset &&
+                 header->extentsOffset % 4 == 0 && extentsEnd <= header->stringsOffset &&
+                 header->stringsOffset + header->stringsSize == header->fileSize &&
+                 (header->stringsSize == 0 || ((const char *)map)[header->fileSize - 1] == '\0');
+    if (!valid)
+    {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    SidecarIndex *index = malloc(sizeof(SidecarIndex));
+    if (!index)
+    {
+        perror("Error allocating memory for sidecar index");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    index->map = map;
+    index->size = st.st_size;
+    index->header = header;
+    index->entries = (const SidecarEntry *)(index->map + header->entriesOffset);
+    index->extents = (const Extent *)(index->map + header->extentsOffset);
+    index->strings = (const char *)(index->map + header->stringsOffset);
+    return index;
+}
+
+//function that maps the sidecar index for a volume if it is still valid, otherwise rebuilds it first
+SidecarIndex *openSidecarIndex(Volume *volume, const char *indexPath, int nthreads)
+{
+    if (volume->isFAT32)
+    {
+        fprintf(stderr, "Sidecar indexes are only supported on FAT16 volumes\n");
+        return NULL;
+    }
+    SidecarIndex *index = mapSidecarIndex(volume, indexPath);
+    if (index)
+        return index;
+    //missing, stale (volume ID or FAT changed) or damaged: a full walk rebuilds it
+    if (!writeSidecarIndex(volume, indexPath, nthreads))
+        return NULL;
+    index = mapSidecarIndex(volume, indexPath);
+    if (!index)
+        fprintf(stderr, "Rebuilt sidecar index %s does not validate\n", indexPath);
+    return index;
+}
+
+//function that unmaps a sidecar index
+void closeSidecarIndex(SidecarIndex *index)
+{
+    if (!index)
+        return;
+    munmap((void *)index->map, index->size);
+    free(index);
+}
+
+//function that binary searches the index for a path (ASCII case-insensitive), NULL if absent
+const SidecarEntry *sidecarFind(const SidecarIndex *index, const char *path)
+{
+    uint32_t lo = 0, hi = index->header->entryCount;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const SidecarEntry *entry = &index->entries[mid];
+        if (entry->pathOffset >= index->header->stringsSize)
+            return NULL;
+        int cmp = strcasecmp(path, index->strings + entry->pathOffset);
+        if (cmp == 0)
+            return entry;
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+//function that opens a file straight from the index: no directory reads and no FAT walk
+File *sidecarOpenFile(Volume *volume, const SidecarIndex *index, const char *path)
+{
+    const SidecarEntry *found = sidecarFind(index, path);
+    if (!found || (found->attributes & 0x10))
+    {
+        fprintf(stderr, "No such file in index: %s\n", path);
+        return NULL;
+    }
+    if ((uint64_t)found->firstExtent + found->extentCount > index->header->extentCount)
+    {
+        fprintf(stderr, "Damaged extent list in index: %s\n", path);
+        return NULL;
+    }
+
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.DIR_Attr = found->attributes;
+    entry.DIR_FstClusLO = found->firstCluster;
+    entry.DIR_FileSize = found->size;
+    entry.DIR_CrtDate = found->crtDate;
+    entry.DIR_CrtTime = found->crtTime;
+    entry.DIR_WrtDate = found->wrtDate;
+    entry.DIR_WrtTime = found->wrtTime;
+
+    Extent *extents = malloc((found->extentCount ? found->extentCount : 1) * sizeof(Extent));
+    if (!extents)
+    {
+        perror("Error allocating memory for extents");
+        return NULL;
+    }
+    memcpy(extents, index->extents + found->firstExtent, found->extentCount * sizeof(Extent));
+    return openFileWithExtents(volume, &entry, extents, found->extentCount);
+}
+
+// directory tree
+
+//function that hands out numBytes from the arena, 16-byte aligned, NULL if memory runs out
+void *arenaAlloc(Arena *arena, size_t numBytes)
+{
+    ArenaBlock *block = arena->blocks;
+    size_t start = 0;
+    if (block)
+    {
+        start = block->used + (16 - (uintptr_t)(block->data + block->used) % 16) % 16;
+    }
+    if (!block || start > block->size || numBytes > block->size - start)
+    {
+        //a big allocation gets its own block behind the current one, which keeps serving small ones
+        bool dedicated = numBytes > ARENA_BLOCK_SIZE / 4;
+        size_t blockSize = dedicated ? numBytes + 16 : ARENA_BLOCK_SIZE;
+        ArenaBlock *fresh = malloc(sizeof(ArenaBlock) + blockSize);
+        if (!fresh)
+        {
+            perror("Error allocating memory for arena block");
+            return NULL;
+        }
+        fresh->size = blockSize;
+        fresh->used = 0;
+        if (dedicated && block)
+        {
+            fresh->next = block->next;
+            block->next = fresh;
+        }
+        else
+        {
+            fresh->next = block;
+            arena->blocks = fresh;
+        }
+        block = fresh;
+        start = (16 - (uintptr_t)block->data % 16) % 16;
+    }
+    block->used = start + numBytes;
+    arena->bytes += numBytes;
+    return block->data + start;
+}
+
+//function that frees every allocation made from the arena at once
+void arenaRelease(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while (block)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->bytes = 0;
+}
+
+//function that frees a DirectoryTree, arrays and names included
+void freeDirectoryTree(DirectoryTree *tree)
+{
+    if (!tree)
+        return;
+    arenaRelease(&tree->arena);
+    free(tree);
+}
+
+//helper that returns the pool offset of a name, adding it to the pool the first time it is seen
+bool treeIntern(TreeBuilder *builder, const char *name, uint32_t *offset)
+{
+    if (builder->internCount * 2 >= builder->internMask)
+    {
+        //doubling the table and putting every name back
+        uint32_t slots = builder->internSlots ? (builder->internMask + 1) * 2 : 1024;
+        uint32_t *grown = calloc(slots, sizeof(uint32_t));
+        if (!grown)
+        {
+            perror("Error allocating memory for name table");
+            return false;
+        }
+        for (uint32_t i = 0; builder->internSlots && i <= builder->internMask; i++)
+        {
+            if (!builder->internSlots[i])
+                continue;
+            uint32_t slot = dentryHash(0, builder->names + builder->internSlots[i] - 1) & (slots - 1);
+            while (grown[slot])
+                slot = (slot + 1) & (slots - 1);
+            grown[slot] = builder->internSlots[i];
+        }
+        free(builder->internSlots);
+        builder->internSlots = grown;
+        builder->internMask = slots - 1;
+    }
+
+    uint32_t slot = dentryHash(0, name) & builder->internMask;
+    while (builder->internSlots[slot])
+    {
+        if (strcmp(builder->names + builder->internSlots[slot] - 1, name) == 0)
+        {
+            *offset = builder->internSlots[slot] - 1;
+            return true;
+        }
+        slot = (slot + 1) & builder->internMask;
+    }
+
+    size_t length = strlen(name) + 1;
+    if (builder->namesSize + length >= UINT32_MAX)
+    {
+        fprintf(stderr, "Too many names for a directory tree\n");
+        return false;
+    }
+    if (builder->namesSize + length > builder->namesCapacity)
+    {
+        size_t capacity = builder->namesCapacity ? builder->namesCapacity * 2 : 65536;
+        while (capacity < builder->namesSize + length)
+            capacity *= 2;
+        char *grown = realloc(builder->names, capacity);
+        if (!grown)
+        {
+            perror("Error growing name pool");
+            return false;
+        }
+        builder->names = grown;
+        builder->namesCapacity = capacity;
+    }
+    *offset = builder->namesSize;
+    memcpy(builder->names + builder->namesSize, name, length);
+    builder->namesSize += length;
+    builder->internSlots[slot] = *offset + 1;
+    builder->internCount++;
+    return true;
+}
+
+//helper that appends a node for a directory entry, NULL if memory runs out
+TreeRecord *treeAddRecord(TreeBuilder *builder, const char *name, const char *shortName, uint32_t parent)
+{
+    if (builder->count == builder->capacity)
+    {
+        if (builder->capacity >= UINT32_MAX / 2)
+        {
+            fprintf(stderr, "Too many entries for a directory tree\n");
+            return NULL;
+        }
+        uint32_t capacity = builder->capacity ? builder->capacity * 2 : 1024;
+        TreeRecord *grown = realloc(builder->records, capacity * sizeof(TreeRecord));
+        if (!grown)
+        {
+            perror("Error growing directory tree");
+            return NULL;
+        }
+        builder->records = grown;
+        builder->capacity = capacity;
+    }
+    TreeRecord *record = &builder->records[builder->count];
+    memset(record, 0, sizeof(TreeRecord));
+    record->parent = parent;
+    if (!treeIntern(builder, name, &record->nameOffset) || !treeIntern(builder, shortName, &record->shortNameOffset))
+        return NULL;
+    builder->count++;
+    return record;
+}
+
+//helper for sorting a directory's children by name, ASCII case-insensitive like lookups
+int compareTreeRecords(const void *a, const void *b)
+{
+    const TreeRecord *ra = a, *rb = b;
+    int cmp = strcasecmp(ra->sortName, rb->sortName);
+    return cmp ? cmp : strcmp(ra->sortName, rb->sortName);
+}
+
+//helper for sorting a directory's children by short name
+int compareTreeSortKeys(const void *a, const void *b)
+{
+    const TreeSortKey *ka = a, *kb = b;
+    int cmp = strcasecmp(ka->name, kb->name);
+    return cmp ? cmp : strcmp(ka->name, kb->name);
+}
+
+//helper that appends the children of one directory node as consecutive nodes and sorts them
+bool treeReadDirectory(TreeBuilder *builder, const Volume *volume, uint32_t node)
+{
+    DirIterator *it = dirOpen(volume, builder->records[node].firstCluster);
+    if (!it)
+        return true; //left empty, like walkVolume does
+    uint32_t first = builder->count;
+    DirectoryItem item;
+    while (dirNext(it, &item))
+    {
+        if (strcmp(item.shortName, ".") == 0 || strcmp(item.shortName, "..") == 0)
+            continue;
+        TreeRecord *record = treeAddRecord(builder, item.name, item.shortName, node);
+        if (!record)
+        {
+            dirClose(it);
+            return false;
+        }
+        record->size = item.entry.DIR_FileSize;
+        record->firstCluster = entryFirstCluster(&item.entry);
+        record->wrtDate = item.entry.DIR_WrtDate;
+        record->wrtTime = item.entry.DIR_WrtTime;
+        record->attributes = item.entry.DIR_Attr;
+    }
+    dirClose(it);
+
+    //the pool no longer moves until the next directory is read
+    for (uint32_t i = first; i < builder->count; i++)
+        builder->records[i].sortName = builder->names + builder->records[i].nameOffset;
+    uint32_t count = builder->count - first;
+    if (count > 0)
+        qsort(builder->records + first, count, sizeof(TreeRecord), compareTreeRecords);
+
+    //a second order over the same span, so 8.3 aliases are found by binary search too
+    if (count > builder->keyCapacity)
+    {
+        TreeSortKey *grown = realloc(builder->keys, count * sizeof(TreeSortKey));
+        if (!grown)
+        {
+            perror("Error allocating memory for short name order");
+            return false;
+        }
+        builder->keys = grown;
+        builder->keyCapacity = count;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        builder->keys[i].name = builder->names + builder->records[first + i].shortNameOffset;
+        builder->keys[i].node = first + i;
+    }
+    if (count > 0)
+        qsort(builder->keys, count, sizeof(TreeSortKey), compareTreeSortKeys);
+    for (uint32_t i = 0; i < count; i++)
+        builder->records[first + i].shortOrder = builder->keys[i].node;
+
+    builder->records[node].firstChild = first;
+    builder->records[node].childCount = count;
+    return true;
+}
+
+//function that reads the whole namespace of a volume into a DirectoryTree. Directories are read one after
+//another in breadth first order, so the tree costs a handful of allocations however many entries there
+//are. The tree is a snapshot: later writes to the volume do not show up in it
+DirectoryTree *buildDirectoryTree(Volume *volume)
+{
+    TreeBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    DirectoryTree *tree = calloc(1, sizeof(DirectoryTree));
+    uint8_t *visited = calloc((volume->clusterCount + 2) / 8 + 1, 1);
+    TreeRecord *root = tree && visited ? treeAddRecord(&builder, "", "", 0) : NULL;
+    bool ok = root != NULL;
+    if (!tree || !visited)
+        perror("Error allocating memory for directory tree");
+    if (ok)
+        root->attributes = 0x10;
+    //the FAT32 root has a cluster of its own, a subdirectory pointing at it must not bring it in twice
+    if (ok && volume->isFAT32)
+        visited[volume->rootCluster / 8] |= 1 << (volume->rootCluster % 8);
+
+    //the records array doubles as the queue: every node added is a directory to read later
+    for (uint32_t node = 0; ok && node < builder.count; node++)
+    {
+        const TreeRecord *record = &builder.records[node];
+        if (!(record->attributes & 0x10))
+            continue;
+        uint32_t cluster = record->firstCluster;
+        if (node > 0)
+        {
+            if (cluster < 2 || cluster >= volume->clusterCount + 2)
+                continue;
+            //a cross-linked or looping tree must not be read twice
+            uint8_t bit = 1 << (cluster % 8);
+            if (visited[cluster / 8] & bit)
+                continue;
+            visited[cluster / 8] |= bit;
+        }
+        ok = treeReadDirectory(&builder, volume, node);
+    }
+
+    if (ok)
+    {
+        uint32_t n = builder.count;
+        Arena *arena = &tree->arena;
+        tree->count = n;
+        tree->nameOffset = arenaAlloc(arena, n * sizeof(uint32_t));
+        tree->shortNameOffset = arenaAlloc(arena, n * sizeof(uint32_t));
+        tree->parent = arenaAlloc(arena, n * sizeof(uint32_t));
+        tree->firstChild = arenaAlloc(arena, n * sizeof(uint32_t));
+        tree->childCount = arenaAlloc(arena, n * sizeof(uint32_t));
+        tree->shortOrder = arenaAlloc(arena, n * sizeof(uint32_t));
+        tree->size = arenaAlloc(arena, n * sizeof(uint32_t));
+        tree->firstCluster = arenaAlloc(arena, n * sizeof(uint32_t));
+        tree->wrtDate = arenaAlloc(arena, n * sizeof(uint16_t));
+        tree->wrtTime = arenaAlloc(arena, n * sizeof(uint16_t));
+        tree->attributes = arenaAlloc(arena, n);
+        tree->names = arenaAlloc(arena, builder.namesSize);
+        ok = tree->nameOffset && tree->shortNameOffset && tree->parent && tree->firstChild && tree->childCount &&
+             tree->shortOrder && tree->size && tree->firstCluster && tree->wrtDate && tree->wrtTime && tree->attributes && tree->names;
+        for (uint32_t i = 0; ok && i < n; i++)
+        {
+            const TreeRecord *record = &builder.records[i];
+            tree->nameOffset[i] = record->nameOffset;
+            tree->shortNameOffset[i] = record->shortNameOffset;
+            tree->parent[i] = record->parent;
+            tree->firstChild[i] = record->firstChild;
+            tree->childCount[i] = record->childCount;
+            tree->shortOrder[i] = record->shortOrder;
+            tree->size[i] = record->size;
+            tree->firstCluster[i] = record->firstCluster;
+            tree->wrtDate[i] = record->wrtDate;
+            tree->wrtTime[i] = record->wrtTime;
+            tree->attributes[i] = record->attributes;
+        }
+        if (ok)
+        {
+            memcpy(tree->names, builder.names, builder.namesSize);
+            tree->namesSize = builder.namesSize;
+            tree->nameCount = builder.internCount;
+        }
+    }
+
+    free(builder.records);
+    free(builder.names);
+    free(builder.keys);
+    free(builder.internSlots);
+    free(visited);
+    if (!ok)
+    {
+        freeDirectoryTree(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+//function that finds a name (long or 8.3, ASCII case-insensitive) among a directory node's children,
+//TREE_NONE if it is not there
+uint32_t treeFind(const DirectoryTree *tree, uint32_t dir, const char *name)
+{
+    uint32_t first = tree->firstChild[dir], end = first + tree->childCount[dir];
+    uint32_t lo = first, hi = end;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcasecmp(name, tree->names + tree->nameOffset[mid]);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    //not a long name, perhaps an 8.3 alias: the same span again in short name order
+    lo = first;
+    hi = end;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t child = tree->shortOrder[mid];
+        int cmp = strcasecmp(name, tree->names + tree->shortNameOffset[child]);
+        if (cmp == 0)
+            return child;
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return TREE_NONE;
+}
+
+//function that resolves a path like "/DIR1/SESSIONS.TXT" to a node, "/" being the root (node 0)
+uint32_t treeLookup(const DirectoryTree *tree, const char *path)
+{
+    uint32_t node = 0;
+    const char *p = path ? path : "/";
+    while (*p && node != TREE_NONE)
+    {
+        while (*p == '/')
+            p++;
+        if (!*p)
+            break;
+        const char *end = strchr(p, '/');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        if (length > LFN_MAX_PARTS * 13 * 3)
+            return TREE_NONE;
+
+        char component[length + 1];
+        memcpy(component, p, length);
+        component[length] = '\0';
+        node = treeFind(tree, node, component);
+        p += length;
+    }
+    return node;
+}
+
+//function that writes the full path of a node into buffer, false if it does not fit
+bool treePath(const DirectoryTree *tree, uint32_t node, char *buffer, size_t bufferSize)
+{
+    if (bufferSize < 2)
+        return false;
+    //built from the end backwards: parents always come before their children, so this terminates
+    size_t at = bufferSize - 1;
+    buffer[at] = '\0';
+    for (; node != 0; node = tree->parent[node])
+    {
+        const char *name = tree->names + tree->nameOffset[node];
+        size_t length = strlen(name);
+        if (length + 1 > at)
+            return false;
+        at -= length;
+        memcpy(buffer + at, name, length);
+        buffer[--at] = '/';
+    }
+    if (at == bufferSize - 1)
+        buffer[--at] = '/';
+    memmove(buffer, buffer + at, bufferSize - at);
+    return true;
+}
+
+//function that makes a directory entry for a node, enough for openFile
+DirectoryEntry treeEntry(const DirectoryTree *tree, uint32_t node)
+{
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.DIR_Attr = tree->attributes[node];
+    entry.DIR_FstClusHI = tree->firstCluster[node] >> 16;
+    entry.DIR_FstClusLO = tree->firstCluster[node] & 0xFFFF;
+    entry.DIR_FileSize = tree->size[node];
+    entry.DIR_WrtDate = tree->wrtDate[node];
+    entry.DIR_WrtTime = tree->wrtTime[node];
+    return entry;
+}
+
+//function that opens a file by path without reading any directory from the image
+File *treeOpenFile(Volume *volume, const DirectoryTree *tree, const char *path)
+{
+    uint32_t node = treeLookup(tree, path);
+    if (node == TREE_NONE || (tree->attributes[node] & 0x10))
+    {
+        fprintf(stderr, "No such file in tree: %s\n", path);
+        return NULL;
+    }
+    DirectoryEntry entry = treeEntry(tree, node);
+    return openFile(volume, &entry);
+}
+
+// extraction
+
+//function that converts a FAT date and time (local time, 2 second resolution) to a time_t
+time_t fatTimeToUnix(uint16_t date, uint16_t time)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = ((date >> 9) & 0x7F) + 80; //FAT years count from 1980
+    tm.tm_mon = ((date >> 5) & 0x0F) - 1;
+    tm.tm_mday = date & 0x1F;
+    tm.tm_hour = time >> 11;
+    tm.tm_min = (time >> 5) & 0x3F;
+    tm.tm_sec = (time & 0x1F) * 2;
+    tm.tm_isdst = -1;
+    if (tm.tm_mon < 0 || tm.tm_mday == 0)
+        return 0; //unset date
+    return mktime(&tm);
+}
+
+//function that copies length bytes from the image at inOffset to outFd at outOffset inside the kernel,
+//trying copy_file_range, then sendfile, then falling back to pread/pwrite; errno is EIO when the image ends early
+bool copyImageRange(int inFd, off_t inOffset, int outFd, off_t outOffset, size_t length)
+{
+    //copy_file_range can share blocks or copy on the server, nothing passes through user space
+    while (length > 0)
+    {
+        //raw system call like the io_uring code, the libc wrapper needs _GNU_SOURCE
+        ssize_t n = syscall(SYS_copy_file_range, inFd, &inOffset, outFd, &outOffset, length, 0);
+        if (n > 0)
+        {
+            length -= n;
+            continue;
+        }
+        if (n == 0)
+        {
+            errno = EIO; //image ended early
+            return false;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+            return false;
+        break;
+    }
+
+    //sendfile writes at the output file position
+    if (length > 0 && lseek(outFd, outOffset, SEEK_SET) == outOffset)
+    {
+        while (length > 0)
+        {
+            ssize_t n = sendfile(outFd, inFd, &inOffset, length);
+            if (n > 0)
+            {
+                outOffset += n;
+                length -= n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0)
+            {
+                errno = EIO;
+                return false;
+            }
+            break;
+        }
+    }
+
+    uint8_t buffer[65536];
+    while (length > 0)
+    {
+        size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+        ssize_t got = readFromDiskImage(inFd, inOffset, buffer, chunk);
+        if (got == 0)
+            errno = EIO;
+        if (got <= 0 || pwrite(outFd, buffer, got, outOffset) != got)
+            return false;
+        inOffset += got;
+        outOffset += got;
+        length -= got;
+    }
+    return true;
+}
+
+//helper that refuses paths from the image that could escape the output directory
+bool safeExtractPath(const char *path)
+{
+    const char *p = path;
+    while (*p)
+    {
+        while (*p == '/')
+            p++;
+        const char *end = strchr(p, '/');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        if ((length == 1 && p[0] == '.') || (length == 2 && p[0] == '.' && p[1] == '.'))
+            return false;
+        p += length;
+    }
+    return true;
+}
+
+//helper that sets the access and modification times of a host path from a manifest entry
+void restoreTimes(const char *hostPath, const ManifestEntry *entry)
+{
+    time_t written = fatTimeToUnix(entry->wrtDate, entry->wrtTime);
+    if (written == 0)
+        return;
+    struct timespec times[2] = {{.tv_sec = written}, {.tv_sec = written}};
+    if (utimensat(AT_FDCWD, hostPath, times, 0) < 0)
+        perror("Error restoring timestamps");
+}
+
+//helper that extracts one regular file, one in-kernel copy per run of contiguous clusters
+bool extractFile(Volume *volume, const ManifestEntry *entry, const char *hostPath)
+{
+    int outFd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd < 0)
+    {
+        perror("Error creating extracted file");
+        return false;
+    }
+
+    uint32_t extentCount;
+    Extent *extents = buildExtents(volume, entry->firstCluster, &extentCount);
+    bool ok = extents != NULL;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    uint64_t remaining = entry->size;
+    for (uint32_t i = 0; ok && i < extentCount && remaining > 0; i++)
+    {
+        uint64_t runBytes = (uint64_t)extents[i].length * clusterSize;
+        size_t length = runBytes < remaining ? runBytes : remaining;
+        off_t inOffset = clusterToSector(volume, extents[i].startCluster) * volume->bootSector.BPB_BytsPerSec;
+        off_t outOffset = (off_t)extents[i].logicalCluster * clusterSize;
+        ok = copyImageRange(volume->fd, inOffset, outFd, outOffset, length);
+        if (!ok)
+            perror("Error copying file data");
+        STAT_ADD(volume, syscalls, 1);
+        STAT_ADD(volume, bytesRead, length);
+        remaining -= length;
+    }
+    if (ok && remaining > 0)
+    {
+        fprintf(stderr, "Cluster chain is shorter than the file size: %s\n", entry->path);
+        ok = false;
+    }
+    free(extents);
+    if (close(outFd) < 0)
+        ok = false;
+    if (ok)
+        restoreTimes(hostPath, entry);
+    return ok;
+}
+
+//helper run by every extraction thread: claims files off the manifest until none are left
+void *extractWorker(void *arg)
+{
+    ExtractState *state = arg;
+    size_t outLength = strlen(state->outDir);
+    while (true)
+    {
+        size_t i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+        if (i >= state->manifest->count)
+            break;
+        const ManifestEntry *entry = &state->manifest->entries[i];
+        if (entry->attributes & 0x10 || !safeExtractPath(entry->path))
+            continue;
+
+        char hostPath[outLength + strlen(entry->path) + 1];
+        memcpy(hostPath, state->outDir, outLength);
+        strcpy(hostPath + outLength, entry->path);
+        if (!extractFile(state->volume, entry, hostPath))
+            __atomic_add_fetch(&state->failures, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+//function that recreates the volume's directory tree under outDir using nthreads threads, returns the
+//number of files that failed (0 on success) or -1 if the walk itself failed
+long extractVolume(Volume *volume, const char *outDir, int nthreads)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+    Manifest *manifest = buildManifest(volume, nthreads);
+    if (!manifest)
+        return -1;
+    if (mkdir(outDir, 0755) < 0 && errno != EEXIST)
+    {
+        perror("Error creating output directory");
+        freeManifest(manifest);
+        return -1;
+    }
+
+    //sorted paths put every directory before its contents
+    size_t outLength = strlen(outDir);
+    for (size_t i = 0; i < manifest->count; i++)
+    {
+        const ManifestEntry *entry = &manifest->entries[i];
+        if (!(entry->attributes & 0x10))
+            continue;
+        if (!safeExtractPath(entry->path))
+        {
+            fprintf(stderr, "Skipping unsafe path: %s\n", entry->path);
+            continue;
+        }
+        char hostPath[outLength + strlen(entry->path) + 1];
+        memcpy(hostPath, outDir, outLength);
+        strcpy(hostPath + outLength, entry->path);
+        if (mkdir(hostPath, 0755) < 0 && errno != EEXIST)
+            perror("Error creating extracted directory");
+    }
+
+    ExtractState state = {.volume = volume, .manifest = manifest, .outDir = outDir};
+    pthread_t threads[nthreads];
+    int started = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, extractWorker, &state) != 0)
+        {
+            perror("Error starting extraction thread");
+            break;
+        }
+        started++;
+    }
+    if (started == 0)
+        extractWorker(&state);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    //directory times last, in reverse so writing children does not disturb them again
+    for (size_t i = manifest->count; i-- > 0;)
+    {
+        const ManifestEntry *entry = &manifest->entries[i];
+        if (!(entry->attributes & 0x10) || !safeExtractPath(entry->path))
+            continue;
+        char hostPath[outLength + strlen(entry->path) + 1];
+        memcpy(hostPath, outDir, outLength);
+        strcpy(hostPath + outLength, entry->path);
+        restoreTimes(hostPath, entry);
+    }
+
+    freeManifest(manifest);
+    return state.failures;
+}
+
+// tar streaming
+
+//helper that writes all of a buffer to a descriptor, continuing after short writes to pipes
+bool writeAll(int fd, const void *buffer, size_t length)
+{
+    const uint8_t *p = buffer;
+    while (length > 0)
+    {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+//helper that stores a value as a zero padded octal field with its terminating NUL
+void tarOctal(char *field, size_t width, uint64_t value)
+{
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i-- > 0; value >>= 3)
+        field[i] = '0' + (value & 7);
+}
+
+//helper that fills the ustar header for one entry, returns false when the name does not fit
+bool tarHeader(uint8_t block[512], const char *name, char type, uint64_t size, time_t mtime)
+{
+    memset(block, 0, 512);
+    size_t length = strlen(name);
+    if (length <= 100)
+    {
+        memcpy(block, name, length);
+    }
+    else
+    {
+        //split into the 155 byte prefix and 100 byte name at a slash
+        const char *split = name + length - 101;
+        if (split < name)
+            split = name;
+        split = strchr(split, '/');
+        if (!split || split - name > 155 || split[1] == '\0')
+            return false;
+        memcpy(block, split + 1, length - (split - name) - 1);
+        memcpy(block + 345, name, split - name);
+    }
+    tarOctal((char *)block + 100, 8, type == '5' ? 0755 : 0644);
+    tarOctal((char *)block + 108, 8, 0);
+    tarOctal((char *)block + 116, 8, 0);
+    tarOctal((char *)block + 124, 12, size);
+    tarOctal((char *)block + 136, 12, mtime < 0 ? 0 : mtime);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+
+    //checksum is computed with its own field filled with spaces
+    memset(block + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += block[i];
+    snprintf((char *)block + 148, 8, "%06o", sum);
+    return true;
+}
+
+//helper that writes the header for an entry, preceded by a pax extended header when the path is too long for ustar
+bool writeTarHeader(int fd, const ManifestEntry *entry, char type)
+{
+    const char *path = entry->path[0] == '/' ? entry->path + 1 : entry->path;
+    size_t length = strlen(path);
+    char name[length + 2];
+    memcpy(name, path, length + 1);
+    if (type == '5')
+        strcpy(name + length, "/");
+
+    uint8_t block[512];
+    time_t mtime = fatTimeToUnix(entry->wrtDate, entry->wrtTime);
+    if (tarHeader(block, name, type, type == '5' ? 0 : entry->size, mtime))
+        return writeAll(fd, block, 512);
+
+    //pax record "<len> path=<name>\n", where len counts its own digits
+    size_t body = strlen(" path=\n") + strlen(name);
+    size_t recordLength = body + 1;
+    while (snprintf(NULL, 0, "%zu", recordLength) + body != recordLength)
+        recordLength++;
+    size_t padded = (recordLength + 511) & ~(size_t)511;
+    char *record = calloc(1, padded);
+    if (!record)
+        return false;
+    snprintf(record, recordLength + 1, "%zu path=%s\n", recordLength, name);
+
+    bool ok = tarHeader(block, "././@PaxHeader", 'x', recordLength, mtime) && writeAll(fd, block, 512) &&
+              writeAll(fd, record, padded);
+    free(record);
+    //the ustar name is only a fallback for readers without pax support
+    char shortName[100];
+    snprintf(shortName, sizeof(shortName), "%s", name);
+    return ok && tarHeader(block, shortName, type, type == '5' ? 0 : entry->size, mtime) && writeAll(fd, block, 512);
+}
+
+//helper used by the tar reader to hand a filled slot to the writer, returns false once the writer gave up
+bool tarPipePush(TarPipe *pipe, size_t length)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->lengths[pipe->tail] = length;
+    pipe->tail = (pipe->tail + 1) % TAR_PIPE_SLOTS;
+    pipe->count++;
+    pthread_cond_signal(&pipe->notEmpty);
+    while (pipe->count == TAR_PIPE_SLOTS && !pipe->abort)
+        pthread_cond_wait(&pipe->notFull, &pipe->lock);
+    bool running = !pipe->abort;
+    pthread_mutex_unlock(&pipe->lock);
+    return running;
+}
+
+//function run by the tar reader thread: reads every file's extents forward into the pipeline slots,
+//files in physical order and each slot holding at most one file's bytes. A file that cannot be read is
+//zero-padded from that point so the archive stays well formed
+void *tarReader(void *arg)
+{
+    TarPipe *pipe = arg;
+    Volume *volume = pipe->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+
+    for (size_t f = 0; f < pipe->fileCount; f++)
+    {
+        const ManifestEntry *entry = pipe->files[f];
+        if (entry->size == 0)
+            continue;
+        uint32_t extentCount = 0;
+        Extent *extents = buildExtents(volume, entry->firstCluster, &extentCount);
+        uint64_t position = 0;
+        uint32_t e = 0;
+        bool damaged = false;
+        while (position < entry->size)
+        {
+            //the reader owns the slot at tail until it is pushed
+            uint8_t *slot = pipe->slots[pipe->tail];
+            size_t want = entry->size - position < TAR_CHUNK_SIZE ? entry->size - position : TAR_CHUNK_SIZE;
+            size_t filled = 0;
+            while (filled < want && !damaged)
+            {
+                while (e < extentCount && (uint64_t)(extents[e].logicalCluster + extents[e].length) * clusterSize <= position + filled)
+                    e++;
+                if (e == extentCount)
+                {
+                    fprintf(stderr, "Cluster chain is shorter than the file size: %s\n", entry->path);
+                    damaged = true;
+                    break;
+                }
+                uint64_t within = position + filled - (uint64_t)extents[e].logicalCluster * clusterSize;
+                uint64_t runLeft = (uint64_t)extents[e].length * clusterSize - within;
+                size_t n = want - filled < runLeft ? want - filled : runLeft;
+                off_t offset = (off_t)clusterToSector(volume, extents[e].startCluster) * volume->bootSector.BPB_BytsPerSec + within;
+                if (readVolume(volume, offset, slot + filled, n) != (ssize_t)n)
+                {
+                    fprintf(stderr, "Error reading %s from the image\n", entry->path);
+                    damaged = true;
+                    break;
+                }
+                filled += n;
+            }
+            if (damaged)
+            {
+                memset(slot + filled, 0, want - filled);
+                filled = want;
+            }
+            position += filled;
+            if (!tarPipePush(pipe, filled))
+            {
+                free(extents);
+                return NULL;
+            }
+        }
+        free(extents);
+        pipe->failures += damaged;
+    }
+    return NULL;
+}
+
+//helper that orders manifest entries by first cluster, so files are read in one forward sweep
+int compareFirstCluster(const void *a, const void *b)
+{
+    const ManifestEntry *x = *(const ManifestEntry *const *)a;
+    const ManifestEntry *y = *(const ManifestEntry *const *)b;
+    if (x->firstCluster != y->firstCluster)
+        return x->firstCluster < y->firstCluster ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+//function that writes the whole volume to outFd as a POSIX tar stream: directories first in path order, then
+//files ordered by their first cluster, read by a second thread through a bounded queue of slots. Returns the
+//number of files zero-padded because they could not be read (0 on success) or -1 if the stream failed
+long streamTar(Volume *volume, int outFd)
+{
+    Manifest *manifest = buildManifest(volume, 1);
+    if (!manifest)
+        return -1;
+
+    TarPipe pipe = {.volume = volume};
+    pipe.files = malloc((manifest->count + 1) * sizeof(ManifestEntry *));
+    uint8_t *slotMemory = malloc((size_t)TAR_PIPE_SLOTS * TAR_CHUNK_SIZE);
+    if (!pipe.files || !slotMemory)
+    {
+        perror("Error allocating tar buffers");
+        free(pipe.files);
+        free(slotMemory);
+        freeManifest(manifest);
+        return -1;
+    }
+    for (int i = 0; i < TAR_PIPE_SLOTS; i++)
+    {
+        pipe.slots[i] = slotMemory + (size_t)i * TAR_CHUNK_SIZE;
+    }
+
+    bool ok = true, writeFailed = false;
+    for (size_t i = 0; i < manifest->count && ok; i++)
+    {
+        ManifestEntry *entry = &manifest->entries[i];
+        if (entry->attributes & 0x10)
+            writeFailed = !(ok = writeTarHeader(outFd, entry, '5'));
+        else
+            pipe.files[pipe.fileCount++] = entry;
+    }
+    qsort(pipe.files, pipe.fileCount, sizeof(ManifestEntry *), compareFirstCluster);
+
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.notEmpty, NULL);
+    pthread_cond_init(&pipe.notFull, NULL);
+    pthread_t reader;
+    bool started = ok && pthread_create(&reader, NULL, tarReader, &pipe) == 0;
+    if (ok && !started)
+    {
+        perror("Error starting tar reader");
+        ok = false;
+    }
+
+    static const uint8_t zeros[1024];
+    for (size_t f = 0; f < pipe.fileCount && ok; f++)
+    {
+        const ManifestEntry *entry = pipe.files[f];
+        ok = writeTarHeader(outFd, entry, '0');
+        writeFailed = !ok;
+        uint64_t written = 0;
+        while (ok && written < entry->size)
+        {
+            pthread_mutex_lock(&pipe.lock);
+            while (pipe.count == 0)
+                pthread_cond_wait(&pipe.notEmpty, &pipe.lock);
+            pthread_mutex_unlock(&pipe.lock);
+
+            //the writer owns the slot at head until it is released
+            size_t length = pipe.lengths[pipe.head];
+            writeFailed = !(ok = writeAll(outFd, pipe.slots[pipe.head], length));
+            written += length;
+
+            pthread_mutex_lock(&pipe.lock);
+            pipe.head = (pipe.head + 1) % TAR_PIPE_SLOTS;
+            pipe.count--;
+            pthread_cond_signal(&pipe.notFull);
+            pthread_mutex_unlock(&pipe.lock);
+        }
+        if (ok && entry->size % 512)
+            writeFailed = !(ok = writeAll(outFd, zeros, 512 - entry->size % 512));
+    }
+    //two zero blocks end the archive
+    if (ok)
+        writeFailed = !(ok = writeAll(outFd, zeros, sizeof(zeros)));
+
+    if (started)
+    {
+        pthread_mutex_lock(&pipe.lock);
+        pipe.abort = true;
+        pthread_cond_signal(&pipe.notFull);
+        pthread_mutex_unlock(&pipe.lock);
+        pthread_join(reader, NULL);
+    }
+    if (writeFailed)
+        perror("Error writing tar stream");
+    pthread_cond_destroy(&pipe.notFull);
+    pthread_cond_destroy(&pipe.notEmpty);
+    pthread_mutex_destroy(&pipe.lock);
+    free(slotMemory);
+    free(pipe.files);
+    freeManifest(manifest);
+    return ok ? (long)pipe.failures : -1;
+}
+
+// FAT analysis
+
+//scalar FAT scan kernel: sets bit c of freeBits when fat[c] is 0 and of nextBits when fat[c] == c + 1, for whole
+//64-cluster words from word firstWord up to count clusters
+void scanFATScalar(const uint16_t *fat, uint32_t firstWord, uint32_t count, uint64_t *freeBits, uint64_t *nextBits)
+{
+    for (uint32_t w = firstWord; w * 64 < count; w++)
+    {
+        uint64_t freeWord = 0, nextWord = 0;
+        for (uint32_t b = 0; b < 64 && w * 64 + b < count; b++)
+        {
+            uint32_t c = w * 64 + b;
+            freeWord |= (uint64_t)(fat[c] == 0) << b;
+            nextWord |= (uint64_t)(fat[c] == (uint16_t)(c + 1)) << b;
+        }
+        freeBits[w] = freeWord;
+        nextBits[w] = nextWord;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//SSE2 kernel: eight entries per compare, two compares packed into one 16-bit mask
+__attribute__((target("sse2"))) void scanFATSSE2(const uint16_t *fat, uint32_t count, uint64_t *freeBits, uint64_t *nextBits)
+{
+    uint32_t w = 0;
+    __m128i index = _mm_setr_epi16(1, 2, 3, 4, 5, 6, 7, 8); //c + 1 for the lanes of the first vector
+    for (; (w + 1) * 64 <= count; w++)
+    {
+        uint64_t freeWord = 0, nextWord = 0;
+        for (int q = 0; q < 4; q++)
+        {
+            const uint16_t *base = fat + w * 64 + q * 16;
+            __m128i a = _mm_loadu_si128((const __m128i *)base);
+            __m128i b = _mm_loadu_si128((const __m128i *)(base + 8));
+            __m128i indexB = _mm_add_epi16(index, _mm_set1_epi16(8));
+            uint32_t zero = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(a, _mm_setzero_si128()),
+                                                              _mm_cmpeq_epi16(b, _mm_setzero_si128())));
+            uint32_t next = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(a, index), _mm_cmpeq_epi16(b, indexB)));
+            freeWord |= (uint64_t)zero << (q * 16);
+            nextWord |= (uint64_t)next << (q * 16);
+            index = _mm_add_epi16(index, _mm_set1_epi16(16));
+        }
+        freeBits[w] = freeWord;
+        nextBits[w] = nextWord;
+    }
+    scanFATScalar(fat, w, count, freeBits, nextBits);
+}
+
+//AVX2 kernel: sixteen entries per compare, 32 packed into one movemask
+__attribute__((target("avx2"))) void scanFATAVX2(const uint16_t *fat, uint32_t count, uint64_t *freeBits, uint64_t *nextBits)
+{
+    uint32_t w = 0;
+    __m256i index = _mm256_setr_epi16(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; (w + 1) * 64 <= count; w++)
+    {
+        uint64_t freeWord = 0, nextWord = 0;
+        for (int h = 0; h < 2; h++)
+        {
+            const uint16_t *base = fat + w * 64 + h * 32;
+            __m256i a = _mm256_loadu_si256((const __m256i *)base);
+            __m256i b = _mm256_loadu_si256((const __m256i *)(base + 16));
+            __m256i indexB = _mm256_add_epi16(index, _mm256_set1_epi16(16));
+            //packs works within 128-bit halves, the permute puts the clusters back in order
+            __m256i zeros = _mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpeq_epi16(a, zero), _mm256_cmpeq_epi16(b, zero)), 0xD8);
+            __m256i nexts = _mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpeq_epi16(a, index), _mm256_cmpeq_epi16(b, indexB)), 0xD8);
+            freeWord |= (uint64_t)(uint32_t)_mm256_movemask_epi8(zeros) << (h * 32);
+            nextWord |= (uint64_t)(uint32_t)_mm256_movemask_epi8(nexts) << (h * 32);
+            index = _mm256_add_epi16(index, _mm256_set1_epi16(32));
+        }
+        freeBits[w] = freeWord;
+        nextBits[w] = nextWord;
+    }
+    scanFATScalar(fat, w, count, freeBits, nextBits);
+}
+#endif
+
+//function that builds the free and next-cluster bitmaps for the first count FAT entries with the widest kernel
+//the CPU has (the same choice classifierName reports)
+void scanFAT(const uint16_t *fat, uint32_t count, uint64_t *freeBits, uint64_t *nextBits)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    int kernel = simdLevel();
+    if (kernel == 2)
+    {
+        scanFATAVX2(fat, count, freeBits, nextBits);
+        return;
+    }
+    if (kernel == 1)
+    {
+        scanFATSSE2(fat, count, freeBits, nextBits);
+        return;
+    }
+#endif
+    scanFATScalar(fat, 0, count, freeBits, nextBits);
+}
+
+//helper that returns the first cluster at or after from whose bit equals value, or end when there is none
+uint32_t nextBitRun(const uint64_t *bits, uint32_t from, uint32_t end, bool value)
+{
+    while (from < end)
+    {
+        uint64_t word = bits[from / 64];
+        if (!value)
+            word = ~word;
+        word &= ~(uint64_t)0 << (from % 64);
+        if (word)
+        {
+            uint32_t found = (from & ~63u) + __builtin_ctzll(word);
+            return found < end ? found : end;
+        }
+        from = (from & ~63u) + 64;
+    }
+    return end;
+}
+
+//function that frees everything analyzeFAT returned
+void freeFatAnalysis(FatAnalysis *analysis)
+{
+    if (!analysis)
+        return;
+    free(analysis->freeBitmap);
+    free(analysis->chains);
+    free(analysis);
+}
+
+//function that analyzes the in-memory FAT in linear time: free space, free runs, and the length and number of
+//extents of every chain, found from its head without reading any directory
+FatAnalysis *analyzeFAT(const Volume *volume)
+{
+    if (volume->isFAT32)
+    {
+        fprintf(stderr, "FAT analysis is only supported on FAT16 volumes\n");
+        return NULL;
+    }
+    uint32_t end = volume->clusterCount + 2;
+    size_t words = (end + 63) / 64;
+    FatAnalysis *analysis = calloc(1, sizeof(FatAnalysis));
+    uint64_t *nextBits = malloc(words * sizeof(uint64_t));
+    uint64_t *linked = calloc(words, sizeof(uint64_t)); //clusters some other cluster points to
+    uint64_t *visited = calloc(words, sizeof(uint64_t));
+    if (analysis)
+    {
+        analysis->freeBitmap = malloc(words * sizeof(uint64_t));
+        analysis->chains = malloc(end * sizeof(ChainStats));
+    }
+    if (!analysis || !nextBits || !linked || !visited || !analysis->freeBitmap || !analysis->chains)
+    {
+        perror("Error allocating FAT analysis");
+        free(nextBits);
+        free(linked);
+        free(visited);
+        freeFatAnalysis(analysis);
+        return NULL;
+    }
+
+    const uint16_t *fat = volume->fat;
+    scanFAT(fat, end, analysis->freeBitmap, nextBits);
+    analysis->freeBitmap[0] &= ~(uint64_t)3; //entries 0 and 1 are reserved, not clusters
+
+    //free runs straight off the bitmap
+    for (uint32_t c = nextBitRun(analysis->freeBitmap, 2, end, true); c < end;)
+    {
+        uint32_t runEnd = nextBitRun(analysis->freeBitmap, c, end, false);
+        analysis->freeRuns++;
+        analysis->freeClusters += runEnd - c;
+        if (runEnd - c > analysis->largestFreeRun)
+        {
+            analysis->largestFreeRun = runEnd - c;
+            analysis->largestFreeStart = c;
+        }
+        c = nextBitRun(analysis->freeBitmap, runEnd, end, true);
+    }
+
+    //a chain head is an allocated cluster no other cluster links to
+    for (uint32_t c = 2; c < end; c++)
+    {
+        uint16_t next = fat[c];
+        if (next == 0xFFF7)
+            analysis->badClusters++;
+        else if (next >= 2 && next < end)
+            linked[next / 64] |= (uint64_t)1 << (next % 64);
+    }
+    analysis->usedClusters = volume->clusterCount - analysis->freeClusters - analysis->badClusters;
+
+    uint32_t reached = 0;
+    for (uint32_t c = 2; c < end; c++)
+    {
+        if (fat[c] == 0 || fat[c] == 0xFFF7 || linked[c / 64] >> (c % 64) & 1)
+            continue;
+        //a cluster already visited means a loop or a cross-link into an earlier chain, either ends the walk
+        uint32_t length = 0, extents = 0;
+        uint32_t current = c;
+        bool continues = false; //whether current directly follows the previous cluster
+        while (true)
+        {
+            length++;
+            visited[current / 64] |= (uint64_t)1 << (current % 64);
+            if (!continues)
+                extents++;
+            continues = nextBits[current / 64] >> (current % 64) & 1;
+            uint16_t next = fat[current];
+            if (next < 2 || next >= end || next == 0xFFF7 || visited[next / 64] >> (next % 64) & 1)
+                break;
+            current = next;
+        }
+        reached += length;
+        analysis->chains[analysis->chainCount++] = (ChainStats){.head = c, .length = length, .extents = extents};
+        analysis->totalExtents += extents;
+        if (extents > 1)
+            analysis->fragmentedChains++;
+        analysis->chainHistogram[31 - __builtin_clz(length)]++;
+    }
+    analysis->unreachedClusters = analysis->usedClusters > reached ? analysis->usedClusters - reached : 0;
+
+    free(nextBits);
+    free(linked);
+    free(visited);
+    return analysis;
+}
+
+//function that returns the stats of the chain starting at head, or NULL when head does not start a chain
+const ChainStats *findChainStats(const FatAnalysis *analysis, uint16_t head)
+{
+    uint32_t low = 0, high = analysis->chainCount;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (analysis->chains[mid].head < head)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low < analysis->chainCount && analysis->chains[low].head == head)
+        return &analysis->chains[low];
+    return NULL;
+}
+
+//function that prints the volume-wide figures of an analysis
+void printFatAnalysis(const FatAnalysis *analysis, FILE *out)
+{
+    fprintf(out, "Free clusters: %u in %u runs, largest run %u at cluster %u\n", analysis->freeClusters,
+            analysis->freeRuns, analysis->largestFreeRun, analysis->largestFreeStart);
+    fprintf(out, "Used clusters: %u, bad clusters: %u, unreached: %u\n", analysis->usedClusters,
+            analysis->badClusters, analysis->unreachedClusters);
+    fprintf(out, "Chains: %u, fragmented: %u, extents: %llu (%.2f per chain)\n", analysis->chainCount,
+            analysis->fragmentedChains, (unsigned long long)analysis->totalExtents,
+            analysis->chainCount ? (double)analysis->totalExtents / analysis->chainCount : 0.0);
+    fprintf(out, "Chain length histogram:\n");
+    for (int b = 0; b < CHAIN_HISTOGRAM_BUCKETS; b++)
+    {
+        if (analysis->chainHistogram[b])
+            fprintf(out, "  %6u-%-6u %u\n", 1u << b, (2u << b) - 1, analysis->chainHistogram[b]);
+    }
+}
+
+// consistency check
+
+//helper that prints a string as a JSON string literal
+void printJsonString(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            fprintf(out, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(out, "\\u%04x", *p);
+        else
+            fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+//helper that records one problem, from any thread
+void fsckAddIssue(FsckReport *report, int type, const char *path, const char *otherPath, uint32_t cluster,
+                  uint64_t expected, uint64_t actual)
+{
+    //cross-links are reported with the paths in order, whichever thread found them
+    if (path && otherPath && strcmp(path, otherPath) > 0)
+    {
+        const char *swap = path;
+        path = otherPath;
+        otherPath = swap;
+    }
+    FsckIssue issue = {
+        .type = type,
+        .path = path ? strdup(path) : NULL,
+        .otherPath = otherPath ? strdup(otherPath) : NULL,
+        .cluster = cluster,
+        .expected = expected,
+        .actual = actual,
+    };
+
+    pthread_mutex_lock(&report->lock);
+    report->counts[type]++;
+    if (report->count == report->capacity)
+    {
+        size_t capacity = report->capacity ? report->capacity * 2 : 64;
+        FsckIssue *grown = realloc(report->issues, capacity * sizeof(FsckIssue));
+        if (!grown)
+        {
+            pthread_mutex_unlock(&report->lock);
+            perror("Error growing fsck report");
+            free(issue.path);
+            free(issue.otherPath);
+            return;
+        }
+        report->issues = grown;
+        report->capacity = capacity;
+    }
+    report->issues[report->count++] = issue;
+    pthread_mutex_unlock(&report->lock);
+}
+
+//helper run by walkVolume: collects entries like manifestVisitor and notes broken long names, including LFN
+//entries whose order number is 0 or past LFN_MAX_PARTS (longNameAdd drops those rather than decoding them)
+void fsckVisitor(const char *path, const DirectoryItem *item, void *userData)
+{
+    FsckState *state = userData;
+    manifestVisitor(path, item, state->manifest);
+    if (item->badLongName)
+        fsckAddIssue(state->report, FSCK_BAD_LONG_NAME, path, NULL, entryFirstCluster(&item->entry), 0, 0);
+}
+
+//helper that walks every entry's chain in path order, taking ownership of each cluster so every cluster is visited
+//once in total; the first path to reach a shared cluster keeps it, which keeps reports reproducible
+void fsckCheckChains(FsckState *state)
+{
+    const Volume *volume = state->volume;
+    const ManifestEntry *entries = state->manifest->entries;
+    uint32_t end = volume->clusterCount + 2;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    for (size_t i = 0; i < state->manifest->count; i++)
+    {
+        const ManifestEntry *entry = &entries[i];
+        bool isDirectory = entry->attributes & 0x10;
+        uint64_t needed = isDirectory ? 0 : ((uint64_t)entry->size + clusterSize - 1) / clusterSize;
+        if (entry->firstCluster == 0)
+        {
+            //only empty files may have no chain
+            if (isDirectory)
+                fsckAddIssue(state->report, FSCK_BAD_CHAIN, entry->path, NULL, 0, 0, 0);
+            else if (needed > 0)
+                fsckAddIssue(state->report, FSCK_SIZE_MISMATCH, entry->path, NULL, 0, needed, 0);
+            continue;
+        }
+
+        uint32_t id = i + 1;
+        uint32_t cluster = entry->firstCluster;
+        uint64_t length = 0;
+        bool broken = false;
+        while (true)
+        {
+            if (cluster < 2 || cluster >= end || volume->fat[cluster] == 0 || volume->fat[cluster] == 0xFFF7)
+            {
+                fsckAddIssue(state->report, FSCK_BAD_CHAIN, entry->path, NULL, cluster, 0, length);
+                broken = true;
+                break;
+            }
+            uint32_t previous = state->owner[cluster];
+            if (previous != 0)
+            {
+                if (previous == id)
+                    fsckAddIssue(state->report, FSCK_LOOP, entry->path, NULL, cluster, 0, length);
+                else
+                    fsckAddIssue(state->report, FSCK_CROSS_LINK, entry->path, entries[previous - 1].path, cluster, 0, 0);
+                broken = true;
+                break;
+            }
+            state->owner[cluster] = id;
+            length++;
+            uint16_t next = volume->fat[cluster];
+            if (next >= 0xFFF8)
+                break;
+            cluster = next;
+        }
+        if (!isDirectory && !broken && length != needed)
+            fsckAddIssue(state->report, FSCK_SIZE_MISMATCH, entry->path, NULL, entry->firstCluster, needed, length);
+    }
+}
+
+//helper that compares every FAT copy with FAT 0 entry by entry
+void fsckCompareFATs(const Volume *volume, FsckReport *report)
+{
+    const BootSector *bs = &volume->bootSector;
+    size_t fatSize = bs->BPB_FATSz16 * bs->BPB_BytsPerSec;
+    uint16_t *copy = malloc(fatSize);
+    if (!copy)
+    {
+        perror("Error allocating memory for FAT copy");
+        return;
+    }
+    for (int i = 1; i < bs->BPB_NumFATs; i++)
+    {
+        off_t copyOffset = (off_t)(bs->BPB_RsvdSecCnt + i * bs->BPB_FATSz16) * bs->BPB_BytsPerSec;
+        if (readVolume(volume, copyOffset, copy, fatSize) != (ssize_t)fatSize)
+        {
+            perror("Error reading FAT copy");
+            continue;
+        }
+        uint32_t first = 0, differing = 0;
+        for (uint32_t e = 0; e < volume->fatEntries; e++)
+        {
+            if (copy[e] != volume->fat[e] && differing++ == 0)
+                first = e;
+        }
+        if (differing)
+            fsckAddIssue(report, FSCK_FAT_MISMATCH, NULL, NULL, first, i, differing);
+    }
+    free(copy);
+}
+
+//helper that gives report issues a stable order
+int compareFsckIssues(const void *a, const void *b)
+{
+    const FsckIssue *x = a, *y = b;
+    if (x->type != y->type)
+        return x->type - y->type;
+    if (x->cluster != y->cluster)
+        return x->cluster < y->cluster ? -1 : 1;
+    if (!x->path || !y->path)
+        return (x->path != NULL) - (y->path != NULL);
+    return strcmp(x->path, y->path);
+}
+
+//function that frees everything fsckVolume returned
+void freeFsckReport(FsckReport *report)
+{
+    if (!report)
+        return;
+    for (size_t i = 0; i < report->count; i++)
+    {
+        free(report->issues[i].path);
+        free(report->issues[i].otherPath);
+    }
+    free(report->issues);
+    pthread_mutex_destroy(&report->lock);
+    free(report);
+}
+
+//function that checks the whole volume in linear time: one parallel directory walk, one pass claiming every
+//chain's clusters, and one pass over the FAT for lost clusters and the FAT copies
+FsckReport *fsckVolume(Volume *volume, int nthreads)
+{
+    if (volume->isFAT32)
+    {
+        fprintf(stderr, "Checking is only supported on FAT16 volumes\n");
+        return NULL;
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    uint32_t end = volume->clusterCount + 2;
+    FsckReport *report = calloc(1, sizeof(FsckReport));
+    Manifest *manifest = calloc(1, sizeof(Manifest));
+    uint32_t *owner = calloc(end, sizeof(uint32_t));
+    uint64_t *linked = calloc((end + 63) / 64, sizeof(uint64_t));
+    if (!report || !manifest || !owner || !linked)
+    {
+        perror("Error allocating fsck state");
+        free(report);
+        free(manifest);
+        free(owner);
+        free(linked);
+        return NULL;
+    }
+    pthread_mutex_init(&report->lock, NULL);
+    pthread_mutex_init(&manifest->lock, NULL);
+    FsckState state = {.volume = volume, .manifest = manifest, .report = report, .owner = owner};
+
+    fsckCompareFATs(volume, report);
+    if (!walkVolume(volume, fsckVisitor, &state, nthreads))
+    {
+        freeManifest(manifest);
+        freeFsckReport(report);
+        free(owner);
+        free(linked);
+        return NULL;
+    }
+    report->checkedEntries = manifest->count;
+    qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), compareManifestPaths);
+    fsckCheckChains(&state);
+
+    //allocated clusters nobody claimed are lost; a lost chain starts where no allocated cluster links in
+    const uint16_t *fat = volume->fat;
+    for (uint32_t c = 2; c < end; c++)
+    {
+        if (fat[c] != 0 && fat[c] != 0xFFF7 && fat[c] >= 2 && fat[c] < end)
+            linked[fat[c] / 64] |= (uint64_t)1 << (fat[c] % 64);
+    }
+    for (int pass = 0; pass < 2; pass++)
+    {
+        //the second pass picks up what is left: lost clusters that only form cycles
+        for (uint32_t c = 2; c < end; c++)
+        {
+            if (fat[c] == 0 || fat[c] == 0xFFF7 || owner[c] != 0)
+                continue;
+            if (pass == 0 && linked[c / 64] >> (c % 64) & 1)
+                continue;
+            uint32_t length = 0;
+            for (uint32_t current = c; current >= 2 && current < end && owner[current] == 0 && fat[current] != 0 &&
+                                       fat[current] != 0xFFF7;
+                 current = fat[current])
+            {
+                owner[current] = UINT32_MAX;
+                length++;
+            }
+            fsckAddIssue(report, pass == 0 ? FSCK_LOST_CHAIN : FSCK_LOOP, NULL, NULL, c, 0, length);
+        }
+    }
+    report->checkedClusters = volume->clusterCount;
+
+    if (report->count > 0)
+        qsort(report->issues, report->count, sizeof(FsckIssue), compareFsckIssues);
+    freeManifest(manifest);
+    free(owner);
+    free(linked);
+    return report;
+}
+
+//function that prints a report as one JSON object
+void printFsckReport(const FsckReport *report, FILE *out)
+{
+    static const char *names[FSCK_ISSUE_TYPES] = {"fat_mismatch", "cross_link", "lost_chain", "loop",
+                                                  "bad_chain", "size_mismatch", "bad_long_name"};
+    fprintf(out, "{\"entries\": %zu, \"clusters\": %u, \"clean\": %s, \"counts\": {", report->checkedEntries,
+            report->checkedClusters, report->count == 0 ? "true" : "false");
+    for (int t = 0; t < FSCK_ISSUE_TYPES; t++)
+    {
+        fprintf(out, "%s\"%s\": %zu", t ? ", " : "", names[t], report->counts[t]);
+    }
+    fprintf(out, "},\n \"issues\": [");
+    for (size_t i = 0; i < report->count; i++)
+    {
+        const FsckIssue *issue = &report->issues[i];
+        fprintf(out, "%s\n  {\"type\": \"%s\", \"cluster\": %u", i ? "," : "", names[issue->type], issue->cluster);
+        if (issue->path)
+        {
+            fprintf(out, ", \"path\": ");
+            printJsonString(out, issue->path);
+        }
+        if (issue->otherPath)
+        {
+            fprintf(out, ", \"other_path\": ");
+            printJsonString(out, issue->otherPath);
+        }
+        if (issue->type == FSCK_FAT_MISMATCH)
+            fprintf(out, ", \"copy\": %llu, \"entries\": %llu", (unsigned long long)issue->expected, (unsigned long long)issue->actual);
+        else if (issue->type == FSCK_SIZE_MISMATCH)
+            fprintf(out, ", \"expected_clusters\": %llu, \"clusters\": %llu", (unsigned long long)issue->expected, (unsigned long long)issue->actual);
+        else if (issue->type != FSCK_CROSS_LINK && issue->type != FSCK_BAD_LONG_NAME)
+            fprintf(out, ", \"clusters\": %llu", (unsigned long long)issue->actual);
+        fprintf(out, "}");
+    }
+    fprintf(out, "%s]}\n", report->count ? "\n " : "");
+}
+
+// write support
+
+//helper that returns the index of the first free run starting at or after cluster
+uint32_t freeRunSearch(const Volume *volume, uint32_t cluster)
+{
+    uint32_t low = 0, high = volume->freeRunCount;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (volume->freeRuns[mid].start < cluster)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+//helper that gives clusters back to the free-run table, merging with the runs around them
+bool releaseRun(Volume *volume, uint16_t start, uint32_t length)
+{
+    uint32_t i = freeRunSearch(volume, start);
+    FreeRun *runs = volume->freeRuns;
+    bool joinsPrevious = i > 0 && runs[i - 1].start + runs[i - 1].length == start &&
+                         runs[i - 1].length + length <= UINT16_MAX;
+    bool joinsNext = i < volume->freeRunCount && start + length == runs[i].start &&
+                     runs[i].length + length + (joinsPrevious ? runs[i - 1].length : 0) <= UINT16_MAX;
+    if (joinsPrevious && joinsNext)
+    {
+        runs[i - 1].length += length + runs[i].length;
+        memmove(&runs[i], &runs[i + 1], (volume->freeRunCount - i - 1) * sizeof(FreeRun));
+        volume->freeRunCount--;
+        return true;
+    }
+    if (joinsPrevious)
+    {
+        runs[i - 1].length += length;
+        return true;
+    }
+    if (joinsNext)
+    {
+        runs[i].start = start;
+        runs[i].length += length;
+        return true;
+    }
+
+    if (volume->freeRunCount == volume->freeRunCapacity)
+    {
+        uint32_t capacity = volume->freeRunCapacity ? volume->freeRunCapacity * 2 : 64;
+        FreeRun *grown = realloc(volume->freeRuns, capacity * sizeof(FreeRun));
+        if (!grown)
+        {
+            perror("Error growing free run table");
+            return false;
+        }
+        volume->freeRuns = runs = grown;
+        volume->freeRunCapacity = capacity;
+    }
+    memmove(&runs[i + 1], &runs[i], (volume->freeRunCount - i) * sizeof(FreeRun));
+    runs[i] = (FreeRun){.start = start, .length = length};
+    volume->freeRunCount++;
+    return true;
+}
+
+//function that makes a mounted volume writable: the image must be open read-write (openDiskImageForWriting);
+//the allocator's free-run table is built from the FAT in one bitmap scan
+bool enableWrites(Volume *volume)
+{
+    if (volume->writable)
+        return true;
+    if (volume->isFAT32)
+    {
+        fprintf(stderr, "Writing is only supported on FAT16 volumes\n");
+        return false;
+    }
+    int mode = fcntl(volume->fd, F_GETFL);
+    if (mode < 0 || (mode & O_ACCMODE) != O_RDWR)
+    {
+        fprintf(stderr, "Disk image is not open for writing\n");
+        return false;
+    }
+
+    uint32_t end = volume->clusterCount + 2;
+    size_t words = (end + 63) / 64;
+    uint64_t *freeBits = malloc(words * sizeof(uint64_t));
+    uint64_t *nextBits = malloc(words * sizeof(uint64_t));
+    volume->dirtyFAT = calloc((volume->bootSector.BPB_FATSz16 + 7) / 8, 1);
+    if (!freeBits || !nextBits || !volume->dirtyFAT)
+    {
+        perror("Error allocating write state");
+        free(freeBits);
+        free(nextBits);
+        free(volume->dirtyFAT);
+        volume->dirtyFAT = NULL;
+        return false;
+    }
+    scanFAT(volume->fat, end, freeBits, nextBits);
+    freeBits[0] &= ~(uint64_t)3;
+
+    volume->freeRunCount = 0;
+    bool ok = true;
+    for (uint32_t c = nextBitRun(freeBits, 2, end, true); c < end && ok;)
+    {
+        uint32_t runEnd = nextBitRun(freeBits, c, end, false);
+        ok = releaseRun(volume, c, runEnd - c);
+        c = nextBitRun(freeBits, runEnd, end, true);
+    }
+    free(freeBits);
+    free(nextBits);
+    if (!ok)
+    {
+        free(volume->dirtyFAT);
+        free(volume->freeRuns);
+        volume->dirtyFAT = NULL;
+        volume->freeRuns = NULL;
+        volume->freeRunCount = volume->freeRunCapacity = 0;
+        return false;
+    }
+    volume->writable = true;
+    return true;
+}
+
+//function that takes up to want free clusters as one run and chains them in the FAT: the run starting at hint
+//when there is one, else the smallest run holding all of them, else the largest. Returns the run length, 0 when full
+uint32_t allocateRun(Volume *volume, uint16_t hint, uint32_t want, uint16_t *start)
+{
+    FreeRun *runs = volume->freeRuns;
+    uint32_t pick = volume->freeRunCount;
+    uint32_t i = hint ? freeRunSearch(volume, hint) : volume->freeRunCount;
+    if (i < volume->freeRunCount && runs[i].start == hint)
+    {
+        pick = i; //growing in place keeps the file in one extent
+    }
+    else
+    {
+        uint32_t largest = volume->freeRunCount;
+        for (i = 0; i < volume->freeRunCount; i++)
+        {
+            if (runs[i].length >= want && (pick == volume->freeRunCount || runs[i].length < runs[pick].length))
+                pick = i;
+            if (largest == volume->freeRunCount || runs[i].length > runs[largest].length)
+                largest = i;
+        }
+        if (pick == volume->freeRunCount)
+            pick = largest;
+    }
+    if (pick == volume->freeRunCount)
+        return 0;
+
+    uint32_t length = runs[pick].length < want ? runs[pick].length : want;
+    *start = runs[pick].start;
+    runs[pick].start += length;
+    runs[pick].length -= length;
+    if (runs[pick].length == 0)
+    {
+        memmove(&runs[pick], &runs[pick + 1], (volume->freeRunCount - pick - 1) * sizeof(FreeRun));
+        volume->freeRunCount--;
+    }
+    for (uint32_t c = *start; c < *start + length - 1; c++)
+    {
+        setFATEntry(volume, c, c + 1);
+    }
+    setFATEntry(volume, *start + length - 1, 0xFFFF);
+    return length;
+}
+
+//helper that frees a chain: zeroes its FAT entries and hands its runs back to the allocator
+void freeChain(Volume *volume, uint16_t first)
+{
+    uint16_t cluster = first;
+    uint32_t runStart = 0, runLength = 0;
+    for (uint32_t steps = 0; cluster >= 2 && cluster < volume->clusterCount + 2 && steps < volume->clusterCount; steps++)
+    {
+        uint16_t next = volume->fat[cluster];
+        if (next == 0 || next == 0xFFF7)
+            break; //already free or bad, the chain is broken here
+        setFATEntry(volume, cluster, 0);
+        if (runLength && runStart + runLength == cluster)
+        {
+            runLength++;
+        }
+        else
+        {
+            if (runLength)
+                releaseRun(volume, runStart, runLength);
+            runStart = cluster;
+            runLength = 1;
+        }
+        if (next >= 0xFFF8)
+            break;
+        cluster = next;
+    }
+    if (runLength)
+        releaseRun(volume, runStart, runLength);
+}
+
+//function that converts a time_t to a FAT date and time (local time, 2 second resolution)
+void unixToFatTime(time_t t, uint16_t *date, uint16_t *time)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    if (tm.tm_year < 80)
+    {
+        *date = (1 << 5) | 1; //FAT cannot go before 1980-01-01
+        *time = 0;
+        return;
+    }
+    *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+//helper that returns how many clusters a file's extent table covers
+uint32_t fileClusterCount(const File *file)
+{
+    if (file->extentCount == 0)
+        return 0;
+    const Extent *last = &file->extents[file->extentCount - 1];
+    return last->logicalCluster + last->length;
+}
+
+//helper that makes sure a file has clusters for its first endBytes bytes, allocating contiguous runs after its
+//last cluster where possible; on a full volume nothing is allocated
+bool fileReserve(File *file, uint64_t endBytes)
+{
+    Volume *volume = file->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    uint32_t have = fileClusterCount(file);
+    uint32_t need = (endBytes + clusterSize - 1) / clusterSize;
+    if (need <= have)
+        return true;
+
+    const Extent *lastExtent = file->extentCount ? &file->extents[file->extentCount - 1] : NULL;
+    uint16_t tail = lastExtent ? lastExtent->startCluster + lastExtent->length - 1 : 0;
+    uint32_t want = need - have;
+    Extent *grown = realloc(file->extents, (file->extentCount + want) * sizeof(Extent));
+    if (!grown)
+    {
+        perror("Error growing extent table");
+        return false;
+    }
+    file->extents = grown;
+
+    //taking all the runs first so a full volume leaves the file untouched
+    uint32_t count = file->extentCount, logical = have;
+    uint16_t hint = tail ? tail + 1 : 0;
+    while (logical < need)
+    {
+        uint16_t start;
+        uint32_t length = allocateRun(volume, hint, need - logical, &start);
+        if (length == 0)
+        {
+            fprintf(stderr, "Volume is full\n");
+            for (uint32_t i = file->extentCount; i < count; i++)
+            {
+                for (uint32_t c = 0; c < file->extents[i].length; c++)
+                    setFATEntry(volume, file->extents[i].startCluster + c, 0);
+                releaseRun(volume, file->extents[i].startCluster, file->extents[i].length);
+            }
+            return false;
+        }
+        file->extents[count++] = (Extent){.logicalCluster = logical, .startCluster = start, .length = length};
+        logical += length;
+        hint = start + length;
+    }
+
+    //linking the new runs behind the old tail, merging runs that turned out adjacent
+    uint32_t merged = file->extentCount;
+    for (uint32_t i = file->extentCount; i < count; i++)
+    {
+        Extent run = file->extents[i];
+        if (tail)
+            setFATEntry(volume, tail, run.startCluster);
+        else
+        {
+            file->dirEntry.DIR_FstClusLO = run.startCluster;
+            file->dirEntry.DIR_FstClusHI = 0;
+        }
+        tail = run.startCluster + run.length - 1;
+        Extent *previous = merged ? &file->extents[merged - 1] : NULL;
+        if (previous && previous->startCluster + previous->length == run.startCluster)
+            previous->length += run.length;
+        else
+            file->extents[merged++] = run;
+    }
+    file->extentCount = merged;
+    file->entryDirty = true;
+    return true;
+}
+
+//helper that writes numBytes at position into clusters the file already has, one write per contiguous run;
+//a NULL buffer writes zeros
+bool fileWriteRange(File *file, uint64_t position, const uint8_t *buffer, size_t numBytes)
+{
+    static const uint8_t zeros[65536];
+    Volume *volume = file->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    while (numBytes > 0)
+    {
+        const Extent *ext = findExtent(file, position / clusterSize);
+        if (!ext)
+            return false;
+        uint64_t runEnd = (uint64_t)(ext->logicalCluster + ext->length) * clusterSize;
+        size_t length = runEnd - position < numBytes ? runEnd - position : numBytes;
+        if (!buffer && length > sizeof(zeros))
+            length = sizeof(zeros);
+        off_t offset = clusterToSector(volume, ext->startCluster) * volume->bootSector.BPB_BytsPerSec +
+                       (position - (uint64_t)ext->logicalCluster * clusterSize);
+        if (!writeVolume(volume, offset, buffer ? buffer : zeros, length))
+            return false;
+        position += length;
+        numBytes -= length;
+        if (buffer)
+            buffer += length;
+    }
+    return true;
+}
+
+//helper that records a change to the file's contents in its directory entry
+void fileTouch(File *file)
+{
+    uint16_t date, clock;
+    unixToFatTime(time(NULL), &date, &clock);
+    file->dirEntry.DIR_WrtDate = date;
+    file->dirEntry.DIR_WrtTime = clock;
+    file->dirEntry.DIR_LstAccDate = date;
+    file->dirEntry.DIR_FileSize = file->fileSize;
+    file->entryDirty = true;
+}
+
+//function that writes to a file opened with createFile at its position, growing it as needed; a position past
+//the end fills the gap with zeros. The FAT and the directory entry reach the disk at syncFile or closeFile
+ssize_t writeFile(File *file, const void *buffer, size_t numBytes)
+{
+    if (!file->writable)
+    {
+        fprintf(stderr, "File is not open for writing\n");
+        return -1;
+    }
+    uint64_t end = (uint64_t)file->filePosition + numBytes;
+    if (end > UINT32_MAX)
+    {
+        fprintf(stderr, "File would exceed the FAT size limit\n");
+        return -1;
+    }
+    if (!fileReserve(file, end))
+        return -1;
+    if (file->filePosition > file->fileSize && !fileWriteRange(file, file->fileSize, NULL, file->filePosition - file->fileSize))
+        return -1;
+    if (!fileWriteRange(file, file->filePosition, buffer, numBytes))
+        return -1;
+
+    file->filePosition = end;
+    if (end > file->fileSize)
+        file->fileSize = end;
+    fileTouch(file);
+    uint32_t clusterSize = file->volume->bootSector.BPB_BytsPerSec * file->volume->bootSector.BPB_SecPerClus;
+    file->currentCluster = fileClusterAt(file, file->filePosition / clusterSize);
+    return numBytes;
+}
+
+//function that sets the size of a file opened with createFile: shrinking frees the clusters past the new end,
+//growing allocates and zero-fills them
+bool truncateFile(File *file, uint32_t size)
+{
+    if (!file->writable)
+    {
+        fprintf(stderr, "File is not open for writing\n");
+        return false;
+    }
+    Volume *volume = file->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    if (size > file->fileSize)
+    {
+        if (!fileReserve(file, size) || !fileWriteRange(file, file->fileSize, NULL, size - file->fileSize))
+            return false;
+    }
+    else
+    {
+        uint32_t keep = (size + clusterSize - 1) / clusterSize;
+        if (keep < fileClusterCount(file))
+        {
+            if (keep == 0)
+            {
+                freeChain(volume, entryFirstCluster(&file->dirEntry));
+                file->dirEntry.DIR_FstClusLO = 0;
+                file->dirEntry.DIR_FstClusHI = 0;
+                file->extentCount = 0;
+            }
+            else
+            {
+                uint16_t last = fileClusterAt(file, keep - 1);
+                uint16_t rest = volume->fat[last];
+                setFATEntry(volume, last, 0xFFFF);
+                if (rest < 0xFFF8)
+                    freeChain(volume, rest);
+                const Extent *ext = findExtent(file, keep - 1);
+                uint32_t index = ext - file->extents;
+                file->extents[index].length = keep - ext->logicalCluster;
+                file->extentCount = index + 1;
+            }
+        }
+    }
+    file->fileSize = size;
+    fileTouch(file);
+    file->currentCluster = fileClusterAt(file, file->filePosition / clusterSize);
+    return true;
+}
+
+//helper that converts a UTF-8 name to UTF-16 units, returns the unit count or -1 if it is invalid or too long
+int utf8ToUtf16(const char *in, uint16_t *out, int maxUnits)
+{
+    int count = 0;
+    const unsigned char *p = (const unsigned char *)in;
+    while (*p)
+    {
+        uint32_t cp;
+        int extra;
+        if (*p < 0x80)
+            cp = *p, extra = 0;
+        else if ((*p & 0xE0) == 0xC0)
+            cp = *p & 0x1F, extra = 1;
+        else if ((*p & 0xF0) == 0xE0)
+            cp = *p & 0x0F, extra = 2;
+        else if ((*p & 0xF8) == 0xF0)
+            cp = *p & 0x07, extra = 3;
+        else
+            return -1;
+        p++;
+        for (int i = 0; i < extra; i++, p++)
+        {
+            if ((*p & 0xC0) != 0x80)
+                return -1;
+            cp = (cp << 6) | (*p & 0x3F);
+        }
+        if (cp >= 0x10000)
+        {
+            if (count + 2 > maxUnits)
+                return -1;
+            cp -= 0x10000;
+            out[count++] = 0xD800 | (cp >> 10);
+            out[count++] = 0xDC00 | (cp & 0x3FF);
+        }
+        else
+        {
+            if (count + 1 > maxUnits)
+                return -1;
+            out[count++] = cp;
+        }
+    }
+    return count;
+}
+
+//helper that fills an 11 byte 8.3 name if name already is a valid upper case short name
+bool toShortName(const char *name, uint8_t *shortName)
+{
+    static const char *allowed = "$%'-_@~`!(){}^#&";
+    memset(shortName, ' ', 11);
+    int length = 0, extLength = -1;
+    for (const char *p = name; *p; p++)
+    {
+        if (*p == '.')
+        {
+            if (extLength >= 0 || length == 0)
+                return false;
+            extLength = 0;
+            continue;
+        }
+        if (!((*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || strchr(allowed, *p)))
+            return false;
+        if (extLength >= 0)
+        {
+            if (extLength == 3)
+                return false;
+            shortName[8 + extLength++] = *p;
+        }
+        else
+        {
+            if (length == 8)
+                return false;
+            shortName[length++] = *p;
+        }
+    }
+    return length > 0 && extLength != 0;
+}
+
+//helper that makes a unique NAME~N.EXT short name for a long name in a directory
+bool makeShortName(Volume *volume, uint16_t dirCluster, const char *name, uint8_t *shortName)
+{
+    const char *dot = strrchr(name, '.');
+    if (dot == name)
+        dot = NULL; //a leading dot starts the name, not an extension
+    char base[9] = "", ext[4] = "";
+    int baseLength = 0, extLength = 0;
+    for (const unsigned char *p = (const unsigned char *)name; *p && (const char *)p != dot; p++)
+    {
+        if (*p == ' ' || *p == '.' || (*p & 0xC0) == 0x80)
+            continue; //dropped, and one '_' per multi-byte character
+        if (baseLength < 8)
+            base[baseLength++] = *p >= 0x80 ? '_' : (char)(*p >= 'a' && *p <= 'z' ? *p - 32 : *p);
+    }
+    for (const unsigned char *p = dot ? (const unsigned char *)dot + 1 : (const unsigned char *)""; *p && extLength < 3; p++)
+    {
+        if (*p == ' ' || (*p & 0xC0) == 0x80)
+            continue;
+        ext[extLength++] = *p >= 0x80 ? '_' : (char)(*p >= 'a' && *p <= 'z' ? *p - 32 : *p);
+    }
+    static const char *allowed = "$%'-_@~`!(){}^#&";
+    for (int i = 0; i < baseLength; i++)
+        if (!((base[i] >= 'A' && base[i] <= 'Z') || (base[i] >= '0' && base[i] <= '9') || strchr(allowed, base[i])))
+            base[i] = '_';
+    for (int i = 0; i < extLength; i++)
+        if (!((ext[i] >= 'A' && ext[i] <= 'Z') || (ext[i] >= '0' && ext[i] <= '9') || strchr(allowed, ext[i])))
+            ext[i] = '_';
+    if (baseLength == 0)
+        base[baseLength++] = '_';
+
+    for (uint32_t n = 1; n < 1000000; n++)
+    {
+        char tail[8];
+        int tailLength = snprintf(tail, sizeof(tail), "~%u", n);
+        int keep = baseLength < 8 - tailLength ? baseLength : 8 - tailLength;
+        char candidate[13];
+        snprintf(candidate, sizeof(candidate), "%.*s%s%s%s", keep, base, tail, extLength ? "." : "", ext);
+        DirectoryEntry existing;
+        if (!findDirectoryEntry(volume, dirCluster, candidate, &existing))
+        {
+            toShortName(candidate, shortName);
+            return true;
+        }
+    }
+    fprintf(stderr, "No free short name for %s\n", name);
+    return false;
+}
+
+//helper that finds a live entry by name in one directory, with where it lives, by scanning the directory
+bool locateEntry(Volume *volume, uint16_t dirCluster, const char *name, DirectoryItem *item)
+{
+    DirIterator *it = dirOpen(volume, dirCluster);
+    if (!it)
+        return false;
+    bool found = false;
+    while (!found && dirNext(it, item))
+    {
+        found = strcasecmp(item->name, name) == 0 || strcasecmp(item->shortName, name) == 0;
+    }
+    dirClose(it);
+    return found;
+}
+
+//helper that splits a path into its parent directory's first cluster and the last component
+bool splitParent(Volume *volume, const char *path, uint16_t *dirCluster, const char **leaf)
+{
+    const char *slash = strrchr(path, '/');
+    *leaf = slash ? slash + 1 : path;
+    size_t parentLength = slash ? (size_t)(slash - path) : 0;
+    char parentPath[parentLength + 2];
+    memcpy(parentPath, path, parentLength);
+    parentPath[parentLength] = '\0';
+    if (parentLength == 0)
+        strcpy(parentPath, "/");
+
+    DirectoryEntry *parent = followPath(volume, parentPath);
+    if (!parent)
+    {
+        fprintf(stderr, "No such directory: %s\n", parentPath);
+        return false;
+    }
+    bool isDirectory = parent->DIR_Attr & 0x10;
+    *dirCluster = entryFirstCluster(parent);
+    free(parent);
+    if (!isDirectory)
+    {
+        fprintf(stderr, "Not a directory: %s\n", parentPath);
+        return false;
+    }
+    return true;
+}
+
+//helper that finds needed consecutive free slots in a directory, adding zeroed clusters to a subdirectory when it
+//is full; returns the first slot or -1
+int64_t findFreeSlots(Volume *volume, uint16_t dirCluster, uint32_t needed)
+{
+    DirIterator *it = dirOpen(volume, dirCluster);
+    if (!it)
+        return -1;
+    uint32_t runStart = 0, runLength = 0;
+    bool atEnd = false; //the end marker was seen, every slot from runStart on is free
+    while (!atEnd && runLength < needed && dirFill(it))
+    {
+        for (uint32_t i = 0; i < it->bufferEntries && runLength < needed; i++)
+        {
+            uint8_t cls = it->classes[i];
+            if (cls != ENTRY_END && cls != ENTRY_DELETED)
+            {
+                runLength = 0;
+                continue;
+            }
+            if (runLength++ == 0)
+                runStart = it->bufferFirstSlot + i;
+            if (cls == ENTRY_END)
+            {
+                atEnd = true;
+                break;
+            }
+        }
+    }
+    dirClose(it);
+    if (runLength >= needed)
+        return runStart;
+
+    //a run still open here reaches the last slot of the directory
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    uint32_t perCluster = clusterSize / sizeof(DirectoryEntry);
+    uint32_t totalSlots = volume->bootSector.BPB_RootEntCnt;
+    uint16_t lastCluster = dirCluster;
+    if (dirCluster != 0)
+    {
+        uint32_t clusters = 1;
+        for (uint32_t next = nextCluster(volume, lastCluster); clusterInData(volume, next) && clusters < volume->clusterCount;
+             next = nextCluster(volume, lastCluster))
+        {
+            lastCluster = next;
+            clusters++;
+        }
+        totalSlots = clusters * perCluster;
+    }
+    if (atEnd)
+        runLength = totalSlots - runStart;
+    if (runLength >= needed)
+        return runStart;
+    if (runLength == 0)
+        runStart = totalSlots;
+
+    if (dirCluster == 0)
+    {
+        fprintf(stderr, "Root directory is full\n");
+        return -1;
+    }
+    //growing the directory by zeroed clusters after its last one
+    uint32_t missing = (needed - runLength + perCluster - 1) / perCluster;
+    uint8_t *zeros = calloc(1, clusterSize);
+    if (!zeros)
+    {
+        perror("Error allocating directory cluster");
+        return -1;
+    }
+    while (missing > 0)
+    {
+        uint16_t start;
+        uint32_t length = allocateRun(volume, lastCluster + 1, missing, &start);
+        if (length == 0)
+        {
+            fprintf(stderr, "Volume is full\n");
+            free(zeros);
+            return -1;
+        }
+        for (uint32_t c = start; c < start + length; c++)
+        {
+            if (!writeVolume(volume, clusterToSector(volume, c) * volume->bootSector.BPB_BytsPerSec, zeros, clusterSize))
+            {
+                free(zeros);
+                return -1;
+            }
+        }
+        setFATEntry(volume, lastCluster, start);
+        lastCluster = start + length - 1;
+        missing -= length;
+    }
+    free(zeros);
+    return runStart;
+}
+
+//helper that opens an existing entry for writing
+File *openFileForWriting(Volume *volume, const DirectoryEntry *entry, uint16_t dirCluster, uint32_t slot)
+{
+    File *file = openFile(volume, (DirectoryEntry *)entry);
+    if (!file)
+        return NULL;
+    file->writable = true;
+    file->parentCluster = dirCluster;
+    file->entrySlot = slot;
+    return file;
+}
+
+//helper that splits a long name into its LFN entries in on-disk order (last part first), each carrying the
+//short name checksum; returns how many there are
+int buildLongEntries(const uint16_t *units, int unitCount, const uint8_t *shortName, LongDirectoryEntry *longEntries)
+{
+    int parts = (unitCount + 12) / 13;
+    uint8_t checksum = shortNameChecksum(shortName);
+    for (int part = 0; part < parts; part++)
+    {
+        uint16_t chars[13];
+        for (int i = 0; i < 13; i++)
+        {
+            int u = part * 13 + i;
+            chars[i] = u < unitCount ? units[u] : u == unitCount ? 0x0000 : 0xFFFF;
+        }
+        LongDirectoryEntry *longEntry = &longEntries[parts - 1 - part];
+        memset(longEntry, 0, sizeof(*longEntry));
+        longEntry->LDIR_Ord = (part + 1) | (part == parts - 1 ? 0x40 : 0);
+        longEntry->LDIR_Attr = 0x0F;
+        longEntry->LDIR_Chksum = checksum;
+        memcpy(longEntry->LDIR_Name1, chars, 10);
+        memcpy(longEntry->LDIR_Name2, chars + 5, 12);
+        memcpy(longEntry->LDIR_Name3, chars + 11, 4);
+    }
+    return parts;
+}
+
+//function that opens the file at a path for writing on a writable volume, creating an empty one (with a long
+//name when the name is not a plain upper case 8.3 name) if it does not exist
+File *createFile(Volume *volume, const char *path)
+{
+    if (!volume->writable)
+    {
+        fprintf(stderr, "Volume is not writable\n");
+        return NULL;
+    }
+    uint16_t dirCluster;
+    const char *leaf;
+    if (!splitParent(volume, path, &dirCluster, &leaf))
+        return NULL;
+
+    DirectoryItem item;
+    if (locateEntry(volume, dirCluster, leaf, &item))
+    {
+        if (item.entry.DIR_Attr & 0x10)
+        {
+            fprintf(stderr, "Is a directory: %s\n", path);
+            return NULL;
+        }
+        return openFileForWriting(volume, &item.entry, dirCluster, item.slot);
+    }
+
+    //checking the name: no reserved characters, at most 255 UTF-16 units
+    uint16_t units[LFN_MAX_PARTS * 13];
+    int unitCount = utf8ToUtf16(leaf, units, 255);
+    if (unitCount <= 0 || strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0 || strpbrk(leaf, "\\/:*?\"<>|"))
+    {
+        fprintf(stderr, "Invalid file name: %s\n", leaf);
+        return NULL;
+    }
+    for (int i = 0; i < unitCount; i++)
+    {
+        if (units[i] < 0x20)
+        {
+            fprintf(stderr, "Invalid file name: %s\n", leaf);
+            return NULL;
+        }
+    }
+
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    bool needsLongName = !toShortName(leaf, entry.DIR_Name);
+    if (needsLongName && !makeShortName(volume, dirCluster, leaf, entry.DIR_Name))
+        return NULL;
+    entry.DIR_Attr = 0x20; //archive
+    uint16_t date, clock;
+    unixToFatTime(time(NULL), &date, &clock);
+    entry.DIR_CrtDate = entry.DIR_WrtDate = entry.DIR_LstAccDate = date;
+    entry.DIR_CrtTime = entry.DIR_WrtTime = clock;
+
+    LongDirectoryEntry longEntries[LFN_MAX_PARTS];
+    int parts = needsLongName ? buildLongEntries(units, unitCount, entry.DIR_Name, longEntries) : 0;
+
+    int64_t firstSlot = findFreeSlots(volume, dirCluster, parts + 1);
+    if (firstSlot < 0)
+        return NULL;
+    uint32_t slot = firstSlot;
+    for (int part = 0; part < parts; part++, slot++)
+    {
+        off_t offset = directorySlotOffset(volume, dirCluster, slot);
+        if (offset < 0 || !writeVolume(volume, offset, &longEntries[part], sizeof(LongDirectoryEntry)))
+            return NULL;
+    }
+    off_t offset = directorySlotOffset(volume, dirCluster, slot);
+    if (offset < 0 || !writeVolume(volume, offset, &entry, sizeof(entry)))
+        return NULL;
+    dentryForget(volume->dentries, dirCluster);
+    return openFileForWriting(volume, &entry, dirCluster, slot);
+}
+
+//function that deletes the file at a path: marks its entries deleted, then frees its clusters
+bool unlinkFile(Volume *volume, const char *path)
+{
+    if (!volume->writable)
+    {
+        fprintf(stderr, "Volume is not writable\n");
+        return false;
+    }
+    uint16_t dirCluster;
+    const char *leaf;
+    if (!splitParent(volume, path, &dirCluster, &leaf))
+        return false;
+    DirectoryItem item;
+    if (!locateEntry(volume, dirCluster, leaf, &item))
+    {
+        fprintf(stderr, "No such file: %s\n", path);
+        return false;
+    }
+    if (item.entry.DIR_Attr & 0x10)
+    {
+        fprintf(stderr, "Is a directory: %s\n", path);
+        return false;
+    }
+
+    //the entry goes first: a crash then leaves lost clusters, never an entry pointing at free ones
+    static const uint8_t deleted = 0xE5;
+    for (uint32_t slot = item.slot - item.longNameSlots; slot <= item.slot; slot++)
+    {
+        off_t offset = directorySlotOffset(volume, dirCluster, slot);
+        if (offset < 0 || !writeVolume(volume, offset, &deleted, 1))
+            return false;
+    }
+    dentryForget(volume->dentries, dirCluster);
+    freeChain(volume, entryFirstCluster(&item.entry));
+    return true;
+}
+
+// defragmentation
+
+//helper that removes exactly [start, start + length) from the free runs and chains it, false if any of it is in use
+bool allocateAt(Volume *volume, uint16_t start, uint32_t length)
+{
+    uint32_t i = freeRunSearch(volume, start + 1);
+    if (i == 0)
+        return false;
+    FreeRun run = volume->freeRuns[--i];
+    if (run.start > start || run.start + run.length < start + length)
+        return false;
+
+    //cutting the range out of the run, leaving up to two pieces
+    uint32_t before = start - run.start;
+    uint32_t after = run.start + run.length - (start + length);
+    memmove(&volume->freeRuns[i], &volume->freeRuns[i + 1], (volume->freeRunCount - i - 1) * sizeof(FreeRun));
+    volume->freeRunCount--;
+    if (before)
+        releaseRun(volume, run.start, before);
+    if (after)
+        releaseRun(volume, start + length, after);
+    for (uint32_t c = start; c < start + length - 1; c++)
+    {
+        setFATEntry(volume, c, c + 1);
+    }
+    setFATEntry(volume, start + length - 1, 0xFFFF);
+    return true;
+}
+
+//helper that allocates a chain of count clusters to move a chain out of the way. Free clusters in
+//[avoidStart, avoidEnd) are never used, nor, unless anyFree, those inside targets still waiting (reserved).
+//One run that holds the whole chain is taken when there is one, the highest such; otherwise the chain is
+//split over the highest usable pieces, it is going to move again anyway. Returns 0 when there is no room
+uint16_t allocateRefuge(Volume *volume, uint32_t count, const bool *reserved, bool anyFree, uint32_t avoidStart, uint32_t avoidEnd)
+{
+    //the usable pieces of the free runs, highest first
+    uint32_t available = 0, bestStart = 0;
+    for (uint32_t i = volume->freeRunCount; i-- > 0;)
+    {
+        const FreeRun *run = &volume->freeRuns[i];
+        uint32_t pieceEnd = 0;
+        for (uint32_t c = run->start + run->length; c-- > run->start;)
+        {
+            bool usable = (c < avoidStart || c >= avoidEnd) && (anyFree || !reserved[c]);
+            if (usable && !pieceEnd)
+                pieceEnd = c + 1;
+            if (pieceEnd && (!usable || c == run->start))
+            {
+                uint32_t pieceStart = usable ? c : c + 1;
+                available += pieceEnd - pieceStart;
+                if (!bestStart && pieceEnd - pieceStart >= count)
+                    bestStart = pieceEnd - count;
+                pieceEnd = 0;
+            }
+        }
+    }
+    if (bestStart)
+        return allocateAt(volume, bestStart, count) ? bestStart : 0;
+    if (available < count)
+        return 0;
+
+    uint16_t first = 0, tail = 0;
+    while (count > 0)
+    {
+        //the highest usable piece left; allocateAt reshapes the runs, so it is looked up again each time
+        uint32_t pieceStart = 0, pieceEnd = 0;
+        for (uint32_t i = volume->freeRunCount; i-- > 0 && !pieceEnd;)
+        {
+            const FreeRun *run = &volume->freeRuns[i];
+            for (uint32_t c = run->start + run->length; c-- > run->start;)
+            {
+                bool usable = (c < avoidStart || c >= avoidEnd) && (anyFree || !reserved[c]);
+                if (usable && !pieceEnd)
+                    pieceEnd = c + 1;
+                if (pieceEnd && !usable)
+                    break;
+                if (usable)
+                    pieceStart = c;
+            }
+        }
+        uint32_t length = pieceEnd - pieceStart < count ? pieceEnd - pieceStart : count;
+        uint16_t start = pieceEnd - length;
+        if (!allocateAt(volume, start, length))
+            return 0;
+        if (tail)
+            setFATEntry(volume, tail, start);
+        else
+            first = start;
+        tail = start + length - 1;
+        count -= length;
+    }
+    return first;
+}
+
+//helper that copies a chain's clusters into another chain of the same length, one in-kernel copy per piece where
+//both runs are contiguous; directories are copied through memory so their "." entry can point at the new place
+bool copyChain(DefragState *state, const DefragItem *item, uint16_t from, uint16_t to)
+{
+    Volume *volume = state->volume;
+    uint32_t clusterSize = volume->bootSector.BPB_BytsPerSec * volume->bootSector.BPB_SecPerClus;
+    uint32_t srcCount, dstCount;
+    Extent *src = buildExtents(volume, from, &srcCount);
+    Extent *dst = buildExtents(volume, to, &dstCount);
+    uint8_t *buffer = item->isDirectory ? malloc(clusterSize) : NULL;
+    bool ok = src && dst && (!item->isDirectory || buffer);
+
+    uint32_t s = 0, d = 0, sUsed = 0, dUsed = 0, copied = 0;
+    while (ok && s < srcCount && d < dstCount && copied < item->clusters)
+    {
+        uint32_t n = src[s].length - sUsed < dst[d].length - dUsed ? src[s].length - sUsed : dst[d].length - dUsed;
+        uint16_t fromCluster = src[s].startCluster + sUsed, toCluster = dst[d].startCluster + dUsed;
+        if (item->isDirectory)
+        {
+            for (uint32_t c = 0; c < n && ok; c++)
+            {
+                ok = readCluster(volume, fromCluster + c, buffer) == clusterSize;
+                if (ok && copied + c == 0)
+                    ((DirectoryEntry *)buffer)[0].DIR_FstClusLO = to;
+                ok = ok && writeVolume(volume, clusterToSector(volume, toCluster + c) * volume->bootSector.BPB_BytsPerSec, buffer, clusterSize);
+            }
+        }
+        else
+        {
+            off_t inOffset = clusterToSector(volume, fromCluster) * volume->bootSector.BPB_BytsPerSec;
+            off_t outOffset = clusterToSector(volume, toCluster) * volume->bootSector.BPB_BytsPerSec;
+            ok = copyImageRange(volume->fd, inOffset, volume->fd, outOffset, (size_t)n * clusterSize);
+            STAT_ADD(volume, syscalls, 1);
+            STAT_ADD(volume, bytesRead, (size_t)n * clusterSize);
+            STAT_ADD(volume, bytesWritten, (size_t)n * clusterSize);
+            for (uint32_t c = 0; volume->cache && c < n; c++)
+                cacheInvalidate(volume, toCluster + c);
+        }
+        copied += n;
+        sUsed += n;
+        dUsed += n;
+        if (sUsed == src[s].length)
+            s++, sUsed = 0;
+        if (dUsed == dst[d].length)
+            d++, dUsed = 0;
+    }
+    if (!ok)
+        perror("Error copying clusters");
+    state->stats->clustersCopied += copied;
+    free(src);
+    free(dst);
+    free(buffer);
+    return ok;
+}
+
+//helper that points a directory entry (and for directories their children's ".." entries) at a new first cluster
+bool setEntryCluster(DefragState *state, uint32_t index, uint16_t cluster)
+{
+    Volume *volume = state->volume;
+    const DefragItem *item = &state->items[index];
+    uint16_t dirCluster = item->parent < 0 ? 0 : state->items[item->parent].firstCluster;
+    off_t offset = directorySlotOffset(volume, dirCluster, item->slot);
+    DirectoryEntry entry;
+    if (offset < 0 || readVolume(volume, offset, &entry, sizeof(entry)) != sizeof(entry))
+        return false;
+    entry.DIR_FstClusLO = cluster;
+    if (!writeVolume(volume, offset, &entry, sizeof(entry)))
+        return false;
+
+    if (!item->isDirectory)
+        return true;
+    for (uint32_t i = 0; i < state->count; i++)
+    {
+        if (state->items[i].parent != (int32_t)index || !state->items[i].isDirectory)
+            continue;
+        //".." is the second slot of every subdirectory
+        off_t dotdot = directorySlotOffset(volume, state->items[i].firstCluster, 1);
+        if (dotdot < 0 || readVolume(volume, dotdot, &entry, sizeof(entry)) != sizeof(entry))
+            return false;
+        entry.DIR_FstClusLO = cluster;
+        if (!writeVolume(volume, dotdot, &entry, sizeof(entry)))
+            return false;
+    }
+    return true;
+}
+
+//helper that commits every copied chain: the new chains reach the FAT while the old ones are still allocated, then
+//the entries switch over, then the old chains are freed. A crash at any point leaves lost clusters at worst
+bool defragCommit(DefragState *state)
+{
+    if (state->moveCount == 0)
+        return true;
+    Volume *volume = state->volume;
+    if (fdatasync(volume->fd) < 0 || !flushVolume(volume))
+        return false;
+    for (uint32_t m = 0; m < state->moveCount; m++)
+    {
+        if (!setEntryCluster(state, state->moves[m].item, state->moves[m].newFirst))
+        {
+            fprintf(stderr, "Error updating the entry of %s\n", state->items[state->moves[m].item].path);
+            return false;
+        }
+    }
+    if (fdatasync(volume->fd) < 0)
+        return false;
+
+    for (uint32_t m = 0; m < state->moveCount; m++)
+    {
+        DefragMove *move = &state->moves[m];
+        uint16_t cluster = move->oldFirst;
+        for (uint32_t i = 0; i < state->items[move->item].clusters; i++, cluster = volume->fat[cluster])
+            state->owner[cluster] = 0;
+        freeChain(volume, move->oldFirst);
+        cluster = move->newFirst;
+        for (uint32_t i = 0; i < state->items[move->item].clusters; i++, cluster = volume->fat[cluster])
+            state->owner[cluster] = move->item + 1;
+        state->items[move->item].firstCluster = move->newFirst;
+    }
+    state->moveCount = 0;
+    state->stats->commits++;
+    return flushVolume(volume);
+}
+
+//helper that copies an item to a chain that is already allocated and queues the commit; directories commit on
+//their own because entries inside them are located through their current cluster. Only moves to the item's
+//target (final) count as files or directories moved
+bool defragMove(DefragState *state, uint32_t index, uint16_t newFirst, bool final)
+{
+    DefragItem *item = &state->items[index];
+    if (item->isDirectory && !defragCommit(state))
+        return false;
+    if (!copyChain(state, item, item->firstCluster, newFirst))
+        return false;
+    state->moves[state->moveCount++] = (DefragMove){.item = index, .oldFirst = item->firstCluster, .newFirst = newFirst};
+    if (final && item->isDirectory)
+        state->stats->directoriesMoved++;
+    else if (final)
+        state->stats->filesMoved++;
+    return !item->isDirectory || defragCommit(state);
+}
+
+//helper run by walkVolume that records each entry for the plan
+void defragVisitor(const char *path, const DirectoryItem *item, void *userData)
+{
+    DefragState *state = userData; //the plan is walked on one thread, no lock needed
+    if (state->failed)
+        return;
+    if (state->count == state->capacity)
+    {
+        uint32_t capacity = state->capacity ? state->capacity * 2 : 64;
+        DefragItem *grown = realloc(state->items, capacity * sizeof(DefragItem));
+        if (!grown)
+        {
+            perror("Error growing defragmentation plan");
+            state->failed = true;
+            return;
+        }
+        state->items = grown;
+        state->capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (!copy)
+    {
+        perror("Error allocating memory for defragmentation plan");
+        state->failed = true;
+        return;
+    }
+    state->items[state->count++] = (DefragItem){
+        .path = copy,
+        .firstCluster = entryFirstCluster(&item->entry),
+        .slot = item->slot,
+        .isDirectory = item->entry.DIR_Attr & 0x10,
+    };
+}
+
+//helper that tells whether a cluster is in use by something the plan cannot move
+bool defragFixed(const DefragState *state, uint32_t cluster, bool includeDirectories)
+{
+    uint32_t owner = state->owner[cluster];
+    return state->volume->fat[cluster] != 0 &&
+           (owner == 0 || (state->items[owner - 1].isDirectory && !includeDirectories));
+}
+
+//helper that takes count clusters from the start of the first gap left in the plan that holds them; returns where
+//they start, 0 when no gap does
+uint32_t takeGap(FreeRun *gaps, uint32_t gapCount, uint32_t count)
+{
+    for (uint32_t g = 0; g < gapCount; g++)
+    {
+        if (gaps[g].length < count)
+            continue;
+        gaps[g].start += count;
+        gaps[g].length -= count;
+        return gaps[g].start - count;
+    }
+    return 0;
+}
+
+//helper for sorting plan items by path
+int compareDefragItems(const void *a, const void *b)
+{
+    return strcmp(((const DefragItem *)a)->path, ((const DefragItem *)b)->path);
+}
+
+//function that rewrites a writable, fsck-clean volume so every file (and directory, when asked) is one contiguous
+//run, packed from the start of the data region in path order. Chains are copied with large in-kernel copies into
+//clusters that are free on disk and committed in batches (see defragCommit): each round moves every chain whose
+//target is free and commits once; when none is, the chains in the way move out to free clusters outside the
+//targets still waiting, split over several runs when no single one fits
+bool defragVolume(Volume *volume, bool includeDirectories, DefragStats *stats)
+{
+    memset(stats, 0, sizeof(DefragStats));
+    if (!volume->writable)
+    {
+        fprintf(stderr, "Volume is not writable\n");
+        return false;
+    }
+    FsckReport *report = fsckVolume(volume, 1);
+    if (!report || report->count > 0)
+    {
+        fprintf(stderr, "Volume is not consistent, run fsck first\n");
+        freeFsckReport(report);
+        return false;
+    }
+    freeFsckReport(report);
+    if (!flushVolume(volume))
+        return false;
+
+    uint32_t end = volume->clusterCount + 2;
+    DefragState state = {.volume = volume, .stats = stats};
+    state.owner = calloc(end, sizeof(uint32_t));
+    bool ok = state.owner && walkVolume(volume, defragVisitor, &state, 1);
+    if (ok && state.failed)
+    {
+        fprintf(stderr, "Could not record every entry, volume left unchanged\n");
+        ok = false;
+    }
+    if (ok)
+    {
+        qsort(state.items, state.count, sizeof(DefragItem), compareDefragItems);
+        state.moves = malloc((state.count + 1) * sizeof(DefragMove));
+        ok = state.moves != NULL;
+    }
+    for (uint32_t i = 0; ok && i < state.count; i++)
+    {
+        //parents sort before their children, so a binary search over the earlier items finds them
+        DefragItem *item = &state.items[i];
+        const char *slash = strrchr(item->path, '/');
+        item->parent = -1;
+        if (slash != item->path)
+        {
+            DefragItem key = {.path = strndup(item->path, slash - item->path)};
+            if (!key.path)
+            {
+                perror("Error allocating memory for defragmentation plan");
+                ok = false;
+                break;
+            }
+            DefragItem *parent = bsearch(&key, state.items, i, sizeof(DefragItem), compareDefragItems);
+            free(key.path);
+            item->parent = parent ? parent - state.items : -1;
+        }
+        for (uint16_t c = item->firstCluster; c >= 2 && c < end; c = volume->fat[c])
+        {
+            state.owner[c] = i + 1;
+            item->clusters++;
+        }
+    }
+
+    //the plan: every movable chain gets a target, packed in path order around clusters that cannot move. A chain
+    //that does not fit before the next of those goes into an earlier gap the packing left when one holds it
+    uint32_t cursor = 2, gapCount = 0;
+    FreeRun *gaps = NULL;
+    for (uint32_t i = 0; ok && i < state.count; i++)
+    {
+        DefragItem *item = &state.items[i];
+        if (item->clusters == 0 || (item->isDirectory && !includeDirectories))
+            continue;
+        while (ok && cursor + item->clusters <= end)
+        {
+            uint32_t c = cursor;
+            while (c < cursor + item->clusters && !defragFixed(&state, c, includeDirectories))
+                c++;
+            if (c == cursor + item->clusters)
+            {
+                item->target = cursor;
+                cursor += item->clusters;
+                break;
+            }
+            if ((item->target = takeGap(gaps, gapCount, item->clusters)) != 0)
+                break;
+            if (c > cursor)
+            {
+                FreeRun *grown = realloc(gaps, (gapCount + 1) * sizeof(FreeRun));
+                ok = grown != NULL;
+                if (grown)
+                    (gaps = grown)[gapCount++] = (FreeRun){.start = cursor, .length = c - cursor};
+            }
+            cursor = c + 1; //restarting the target after it
+        }
+        if (!item->target)
+            item->target = takeGap(gaps, gapCount, item->clusters);
+    }
+    free(gaps);
+    bool *evacuating = calloc(state.count + 1, sizeof(bool));
+    bool *reserved = calloc(end, sizeof(bool)); //clusters inside targets still waiting
+    ok = ok && evacuating && reserved;
+
+    stats->complete = ok;
+    while (ok)
+    {
+        //a round moves every chain whose target is free, then commits them together
+        uint32_t placed = 0, waiting = 0;
+        for (uint32_t i = 0; ok && i < state.count; i++)
+        {
+            DefragItem *item = &state.items[i];
+            if (item->target == 0)
+                continue;
+            uint32_t run = 0;
+            for (uint16_t c = item->firstCluster; c == item->target + run && run < item->clusters; c = volume->fat[c])
+                run++;
+            if (run == item->clusters)
+            {
+                item->target = 0; //already in place
+                continue;
+            }
+            if (allocateAt(volume, item->target, item->clusters))
+            {
+                ok = defragMove(&state, i, item->target, true);
+                item->target = 0;
+                placed++;
+            }
+            else
+            {
+                waiting++;
+            }
+        }
+        ok = ok && defragCommit(&state);
+        if (!ok || waiting == 0)
+            break;
+        if (placed > 0)
+            continue;
+
+        //nothing could move: the chains sitting in waiting targets move out of the way, as many as fit, to free
+        //clusters outside every waiting target. Those in the lowest one may also go into the others, so clearing
+        //it never needs more free space than it takes; once placed it stays, so the rounds always get somewhere
+        uint32_t evacuated = 0, lowest = 0;
+        bool full = false;
+        memset(evacuating, 0, state.count * sizeof(bool));
+        memset(reserved, 0, end * sizeof(bool));
+        for (uint32_t i = 0; i < state.count; i++)
+        {
+            if (state.items[i].target == 0)
+                continue;
+            memset(reserved + state.items[i].target, true, state.items[i].clusters);
+            if (state.items[lowest].target == 0 || state.items[i].target < state.items[lowest].target)
+                lowest = i;
+        }
+        for (uint32_t k = 0; ok && !full && k <= state.count; k++)
+        {
+            //the lowest target goes first, so it always gets the room to clear
+            uint32_t i = k == 0 ? lowest : k - 1;
+            DefragItem *item = &state.items[i];
+            if (item->target == 0 || (k > 0 && i == lowest))
+                continue;
+            for (uint32_t c = item->target; ok && c < item->target + item->clusters; c++)
+            {
+                uint32_t owner = state.owner[c];
+                if (owner == 0 || evacuating[owner - 1])
+                    continue; //free, or already copied away in this round
+                uint32_t clusters = state.items[owner - 1].clusters;
+                uint16_t refuge = allocateRefuge(volume, clusters, reserved, false, item->target, item->target + item->clusters);
+                if (!refuge && i == lowest)
+                    refuge = allocateRefuge(volume, clusters, reserved, true, item->target, item->target + item->clusters);
+                if (!refuge)
+                {
+                    full = true;
+                    break;
+                }
+                ok = defragMove(&state, owner - 1, refuge, false);
+                evacuating[owner - 1] = true;
+                evacuated++;
+                stats->evacuations++;
+            }
+        }
+        ok = ok && defragCommit(&state);
+        if (evacuated == 0)
+        {
+            fprintf(stderr, "Not enough free space to continue defragmenting\n");
+            stats->complete = false;
+            break;
+        }
+    }
+    bool committed = defragCommit(&state);
+    ok = ok && committed;
+
+    //checking the result: every chain the plan covers should now be one run
+    for (uint32_t i = 0; ok && i < state.count; i++)
+    {
+        const DefragItem *item = &state.items[i];
+        if (item->clusters == 0 || (item->isDirectory && !includeDirectories))
+            continue;
+        uint32_t run = 1;
+        for (uint16_t c = item->firstCluster; run < item->clusters && volume->fat[c] == c + 1; c++)
+            run++;
+        if (run < item->clusters)
+            stats->fragmented++;
+    }
+    if (stats->fragmented > 0)
+        stats->complete = false;
+
+    //names cached before the move point at old clusters
+    freeDentryCache(volume->dentries);
+    volume->dentries = createDentryCache(volume->clusterCount);
+    free(reserved);
+    free(evacuating);
+    for (uint32_t i = 0; i < state.count; i++)
+        free(state.items[i].path);
+    free(state.items);
+    free(state.moves);
+    free(state.owner);
+    return ok && committed;
+}
+
+// image generator
+
+//helper that advances a splitmix64 state and returns the next pseudo-random number
+uint64_t splitMix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+//helper that returns a pseudo-random number below limit
+uint32_t randomBelow(uint64_t *state, uint32_t limit)
+{
+    return limit ? (uint32_t)(((splitMix64(state) >> 32) * limit) >> 32) : 0;
+}
+
+//helper that returns true with the given probability
+bool randomChance(uint64_t *state, double probability)
+{
+    return (splitMix64(state) >> 11) * (1.0 / 9007199254740992.0) < probability;
+}
+
+//helper that fills a buffer with a file's contents, continuing from where the last call on the same state stopped
+void generatorFill(uint64_t *state, uint8_t *buffer, size_t length)
+{
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word = splitMix64(state);
+        memcpy(buffer + i, &word, 8);
+    }
+    if (i < length)
+    {
+        uint64_t word = splitMix64(state);
+        memcpy(buffer + i, &word, length - i);
+    }
+}
+
+//helper that names a new entry: a plain 8.3 name, or a long name (some of it non-ASCII, now and then close to the
+//255 character limit) with a NAME~1 style short name; a per-directory counter in both keeps them unique
+bool generatorName(uint64_t *rng, GeneratorItem *item, uint32_t counter, bool longName)
+{
+    static const char *words[] = {"report", "draft", "photo", "backup", "notes", "invoice", "Résumé", "naïve café",
+                                  "Ünïcödé", "€uro", "日本語", "data", "final", "copy", "archive", "Project"};
+    static const char *extensions[] = {"TXT", "DAT", "BIN", "LOG", "CSV", "JPG"};
+    const char *ext = extensions[randomBelow(rng, sizeof(extensions) / sizeof(extensions[0]))];
+    char name[LFN_MAX_PARTS * 13 * 3 + 1];
+    if (!longName)
+    {
+        if (item->isDirectory)
+            snprintf(name, sizeof(name), "D%07X", counter);
+        else
+            snprintf(name, sizeof(name), "F%07X.%s", counter, ext);
+        toShortName(name, item->shortName);
+    }
+    else
+    {
+        uint32_t wordCount = randomBelow(rng, 16) == 0 ? 12 + randomBelow(rng, 24) : 1 + randomBelow(rng, 4);
+        size_t length = 0;
+        name[0] = '\0';
+        for (uint32_t w = 0; w < wordCount && length < 200; w++)
+        {
+            const char *word = words[randomBelow(rng, sizeof(words) / sizeof(words[0]))];
+            length += snprintf(name + length, sizeof(name) - length, "%s%s", w ? " " : "", word);
+        }
+        length += snprintf(name + length, sizeof(name) - length, " %u", counter);
+        if (!item->isDirectory)
+            snprintf(name + length, sizeof(name) - length, ".%c%c%c", ext[0] + 32, ext[1] + 32, ext[2] + 32);
+
+        //the short name keeps the first two ASCII letters or digits of the long one
+        char base[9], prefix[3] = "XX";
+        int taken = 0;
+        for (const char *p = name; *p && taken < 2; p++)
+        {
+            if ((*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'))
+                prefix[taken++] = *p;
+            else if (*p >= 'a' && *p <= 'z')
+                prefix[taken++] = *p - 32;
+        }
+        snprintf(base, sizeof(base), "%s%04X~1", prefix, counter & 0xFFFF);
+        memset(item->shortName, ' ', 11);
+        memcpy(item->shortName, base, 8);
+        if (!item->isDirectory)
+            memcpy(item->shortName + 8, ext, 3);
+    }
+    item->name = strdup(name);
+    uint16_t units[LFN_MAX_PARTS * 13];
+    int unitCount = utf8ToUtf16(name, units, 255);
+    item->entrySlots = 1 + (longName ? (unitCount + 12) / 13 : 0);
+    return item->name != NULL && unitCount > 0;
+}
+
+//helper that returns the first free cluster at or after a given one, wrapping around; one must be free
+uint32_t generatorNextFree(const uint64_t *used, uint32_t cluster, uint32_t end)
+{
+    if (cluster < 2 || cluster >= end)
+        cluster = 2;
+    for (uint32_t scanned = 0; scanned <= end; )
+    {
+        uint64_t word = ~used[cluster / 64] >> (cluster % 64);
+        if (word)
+        {
+            uint32_t found = cluster + __builtin_ctzll(word);
+            if (found < end)
+                return found;
+        }
+        scanned += 64 - cluster % 64;
+        cluster = (cluster / 64 + 1) * 64;
+        if (cluster >= end)
+            cluster = 2;
+    }
+    return 0;
+}
+
+//helper that allocates a chain for an item: each cluster follows the previous one unless the fragmentation
+//setting sends it to a random free cluster instead
+void generatorAllocate(uint64_t *rng, const GeneratorConfig *config, uint32_t *fat, uint64_t *used,
+                       GeneratorItem *item, uint32_t *cursor)
+{
+    uint32_t end = config->clusters + 2;
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < item->clusters; i++)
+    {
+        uint32_t wanted = previous ? previous + 1 : *cursor;
+        if (randomChance(rng, config->fragmentation))
+            wanted = 2 + randomBelow(rng, config->clusters);
+        uint32_t cluster = generatorNextFree(used, wanted, end);
+        used[cluster / 64] |= 1ull << (cluster % 64);
+        if (previous)
+            fat[previous] = cluster;
+        else
+            item->firstCluster = cluster;
+        previous = cluster;
+    }
+    if (previous)
+    {
+        fat[previous] = CLUSTER_EOC;
+        *cursor = previous + 1;
+    }
+}
+
+//helper that writes a buffer across a chain, one write per run of contiguous clusters
+bool generatorWriteChain(int fd, const BootSector *bs, uint32_t firstDataSector, const uint32_t *fat,
+                         uint32_t cluster, const uint8_t *buffer, size_t length)
 {
-    size_t rootDirSize = bs->BPB_RootEntCnt * sizeof(DirectoryEntry);//calculating size of root directory 
-    off_t rootDirOffset = (bs->BPB_RsvdSecCnt + (bs->BPB_NumFATs * bs->BPB_FATSz16)) * bs->BPB_BytsPerSec;//calculating starting offset
-
-    DirectoryEntry *rootDir = malloc(rootDirSize);//allocate memory for reading the root directory entries from the size
-    if (!rootDir)
+    size_t clusterSize = bs->BPB_BytsPerSec * bs->BPB_SecPerClus;
+    size_t done = 0;
+    while (done < length)
     {
-        perror("Error Allocating Memory for root directory");
-        return;
+        uint32_t run = 1;
+        while (fat[cluster + run - 1] == cluster + run && done + run * clusterSize < length)
+            run++;
+        size_t chunk = run * clusterSize < length - done ? run * clusterSize : length - done;
+        off_t offset = ((off_t)firstDataSector + (off_t)(cluster - 2) * bs->BPB_SecPerClus) * bs->BPB_BytsPerSec;
+        if (!writeToDiskImage(fd, offset, buffer + done, chunk))
+            return false;
+        done += chunk;
+        cluster = fat[cluster + run - 1];
     }
+    return true;
+}
 
-    if (lseek(fd, rootDirOffset, SEEK_SET) < 0)//seeking to the start of the root directory
+//helper that writes a file's generated contents across its chain and hashes them (64-bit FNV-1a); the contents
+//come from the seed and the item's index, so they do not depend on the order files are written in
+bool generatorWriteFile(int fd, const BootSector *bs, uint32_t firstDataSector, const uint32_t *fat,
+                        GeneratorItem *item, uint64_t seed, uint32_t index, uint8_t *buffer)
+{
+    size_t clusterSize = bs->BPB_BytsPerSec * bs->BPB_SecPerClus;
+    uint64_t state = seed ^ ((uint64_t)index * 0xD1B54A32D192ED03ull);
+    uint64_t hash = 14695981039346656037ull;
+    uint64_t remaining = item->size;
+    uint32_t cluster = item->firstCluster;
+    while (remaining > 0)
     {
-        perror("Error seeking to root directory");
-        free(rootDir);
-        return;
+        //one write per run of contiguous clusters, at most GEN_WRITE_CHUNK bytes
+        uint32_t run = 1;
+        while (fat[cluster + run - 1] == cluster + run && run * clusterSize < remaining &&
+               (run + 1) * clusterSize <= GEN_WRITE_CHUNK)
+            run++;
+        size_t chunk = run * clusterSize < remaining ? run * clusterSize : remaining;
+        generatorFill(&state, buffer, chunk);
+        for (size_t i = 0; i < chunk; i++)
+            hash = (hash ^ buffer[i]) * 1099511628211ull;
+        off_t offset = ((off_t)firstDataSector + (off_t)(cluster - 2) * bs->BPB_SecPerClus) * bs->BPB_BytsPerSec;
+        if (!writeToDiskImage(fd, offset, buffer, chunk))
+            return false;
+        remaining -= chunk;
+        cluster = fat[cluster + run - 1];
     }
+    item->hash = hash;
+    return true;
+}
+
+//helper for sorting generated items by path
+int compareGeneratedPaths(const void *a, const void *b)
+{
+    return strcmp((*(GeneratorItem *const *)a)->path, (*(GeneratorItem *const *)b)->path);
+}
+
+//function that fills a GeneratorConfig with a small, moderately fragmented default image
+GeneratorConfig defaultGeneratorConfig(void)
+{
+    return (GeneratorConfig){
+        .seed = 1,
+        .clusters = 16384,
+        .clusterSize = 2048,
+        .files = 1000,
+        .directories = 50,
+        .maxDepth = 4,
+        .longNameRatio = 0.3,
+        .sizeDistribution = GEN_SIZES_LOG,
+        .maxFileSize = 256 * 1024,
+        .fragmentation = 0.05,
+    };
+}
 
-    if (read(fd, rootDir, rootDirSize) != rootDirSize)
+//function that writes a synthetic FAT16 image (FAT32 above 65524 clusters) made only from config (same seed, same
+//image) and, when manifest is not NULL, the expected contents: printManifest's columns plus a 64-bit FNV-1a hash of
+//every file's data. Files that no longer fit are cut short, and names stop when every directory is full
+bool generateImage(const char *path, const GeneratorConfig *config, FILE *manifest)
+{
+    uint32_t spc = config->clusterSize / 512;
+    if (config->clusters < 4085 || config->clusters >= 0x0FFFFFF5 || spc == 0 || spc > 128 || (spc & (spc - 1)) ||
+        config->clusterSize % 512 || (uint64_t)config->clusters * spc > 0xFF000000u)
     {
-        perror("Error reading root directory");
-        free(rootDir);
-        return;
+        fprintf(stderr, "An image needs 4085 to 65524 (FAT16) or more (FAT32) clusters of 512 bytes to 64 KiB "
+                        "(a power of two), under 2 TiB in all\n");
+        return false;
     }
+    bool isFAT32 = config->clusters >= FAT32_MIN_CLUSTERS;
 
-    wchar_t longNameBuffer[256];//buffer for storing longfilenames while processing entries
-    memset(longNameBuffer, 0, sizeof(longNameBuffer));
+    BootSector bs;
+    BootSector32 bs32;
+    memset(&bs, 0, sizeof(bs));
+    memset(&bs32, 0, sizeof(bs32));
+    memcpy(bs.BS_jmpBoot, isFAT32 ? "\xEB\x58\x90" : "\xEB\x3C\x90", 3);
+    memcpy(bs.BS_OEMName, "READFAT ", 8);
+    bs.BPB_BytsPerSec = 512;
+    bs.BPB_SecPerClus = spc;
+    bs.BPB_RsvdSecCnt = isFAT32 ? 32 : 1;
+    bs.BPB_NumFATs = 2;
+    bs.BPB_RootEntCnt = isFAT32 ? 0 : 512;
+    bs.BPB_Media = 0xF8;
+    uint32_t fatSectors = ((config->clusters + 2) * (isFAT32 ? 4 : 2) + 511) / 512;
+    bs.BPB_FATSz16 = isFAT32 ? 0 : fatSectors;
+    bs.BPB_SecPerTrk = 63;
+    bs.BPB_NumHeads = 255;
+    bs.BS_DrvNum = 0x80;
+    bs.BS_BootSig = 0x29;
+    memcpy(bs.BS_VolLab, "GENERATED  ", 11);
+    memcpy(bs.BS_FilSysType, "FAT16   ", 8);
+    uint32_t rootSectors = bs.BPB_RootEntCnt * 32 / 512;
+    uint32_t firstDataSector = bs.BPB_RsvdSecCnt + bs.BPB_NumFATs * fatSectors + rootSectors;
+    uint32_t totalSectors = firstDataSector + config->clusters * spc;
+    if (totalSectors < 0x10000 && !isFAT32)
+        bs.BPB_TotSec16 = totalSectors;
+    else
+        bs.BPB_TotSec32 = totalSectors;
+    uint64_t rng = config->seed;
+    bs.BS_VolID = (uint32_t)splitMix64(&rng);
+    if (isFAT32)
+    {
+        //FAT32 moves the drive number, volume ID and label behind its own BPB fields
+        bs32.BPB_FATSz32 = fatSectors;
+        bs32.BPB_FSInfo = 1;
+        bs32.BPB_BkBootSec = 6;
+        bs32.BS_DrvNum = bs.BS_DrvNum;
+        bs32.BS_BootSig = bs.BS_BootSig;
+        bs32.BS_VolID = bs.BS_VolID;
+        memcpy(bs32.BS_VolLab, bs.BS_VolLab, 11);
+        memcpy(bs32.BS_FilSysType, "FAT32   ", 8);
+    }
 
-    //iterating through each entry in the root directory
-    for (int i = bs->BPB_RootEntCnt - 1; i >= 0; i--)
+    //planning the tree: directories first, each under a random directory that is not yet at the depth limit
+    uint32_t directories = config->maxDepth ? config->directories : 0;
+    GeneratorItem *items = calloc(1 + directories + config->files, sizeof(GeneratorItem));
+    uint32_t *dirs = malloc((1 + directories) * sizeof(uint32_t));
+    if (!items || !dirs)
+    {
+        perror("Error allocating memory for the image plan");
+        free(items);
+        free(dirs);
+        return false;
+    }
+    items[0] = (GeneratorItem){.name = strdup(""), .parent = -1, .isDirectory = true, .usedSlots = 1}; //volume label
+    uint32_t count = 1, dirCount = 1;
+    dirs[0] = 0;
+    bool ok = items[0].name != NULL;
+    for (uint32_t i = 0; ok && i < directories + config->files; i++)
     {
-        if (isLongNameEntry(&rootDir[i]))
+        bool isDirectory = i < directories;
+        GeneratorItem *item = &items[count];
+        item->isDirectory = isDirectory;
+        uint32_t parent = dirs[randomBelow(&rng, dirCount)];
+        while (isDirectory && items[parent].depth >= config->maxDepth)
+            parent = items[parent].parent;
+        bool longName = randomChance(&rng, config->longNameRatio);
+        uint64_t nameState = rng;
+        if (!generatorName(&rng, item, items[parent].names, longName))
         {
-            LongDirectoryEntry *longEntry = (LongDirectoryEntry *)&rootDir[i];
-            int order = longEntry->LDIR_Ord & ~0x40; // Masking out the last entry flag
-            int position = (order - 1) * 13;         // Calculate buffer position for this part of the name
-            parseLongNameEntry(longEntry, longNameBuffer, position);
+            fprintf(stderr, "Error generating a name\n");
+            free(item->name);
+            item->name = NULL;
+            ok = false;
+            break;
         }
-        else
+
+        //a full directory passes the entry on to the next one that has room. The name is made again with that
+        //directory's counter, from the same random state so the rest of the image does not change
+        uint32_t tried = 0, at = 0, namedFor = parent;
+        while (true)
         {
-            //if assembly was complete, print it, this is where it might be wrong?
-            if (longNameBuffer[0] != L'\0')
+            uint32_t capacity = parent == 0 && !isFAT32 ? bs.BPB_RootEntCnt : 65536;
+            bool fits = items[parent].usedSlots + item->entrySlots <= capacity && (!isDirectory || items[parent].depth < config->maxDepth);
+            if (fits && parent != namedFor)
             {
-                wprintf(L"Long Filename: %ls\n", longNameBuffer);
-                printLongDirectoryEntry((LongDirectoryEntry *)&rootDir[i]); // Corrected to pass the right argument
-                memset(longNameBuffer, 0, sizeof(longNameBuffer));          // Clear buffer after using
+                uint64_t state = nameState;
+                free(item->name);
+                if (!generatorName(&state, item, items[parent].names, longName))
+                {
+                    fprintf(stderr, "Error generating a name\n");
+                    free(item->name);
+                    item->name = NULL;
+                    ok = false;
+                    break;
+                }
+                namedFor = parent;
+                fits = items[parent].usedSlots + item->entrySlots <= capacity;
             }
-            printDirectoryEntry(&rootDir[i]);//call printing function
+            if (fits)
+                break;
+            if (++tried > dirCount)
+                break;
+            at = (at + 1) % dirCount;
+            parent = dirs[at];
+        }
+        if (!ok)
+            break;
+        if (tried > dirCount)
+        {
+            free(item->name);
+            memset(item, 0, sizeof(*item));
+            if (!isDirectory)
+                break; //every directory is full
+            continue;
+        }
+        item->parent = parent;
+        item->depth = items[parent].depth + 1;
+        item->slot = items[parent].usedSlots;
+        items[parent].usedSlots += item->entrySlots;
+        items[parent].names++;
+        if (isDirectory)
+        {
+            item->usedSlots = 2; //"." and ".."
+            dirs[dirCount++] = count;
+        }
+        else if (config->sizeDistribution == GEN_SIZES_UNIFORM)
+        {
+            item->size = randomBelow(&rng, config->maxFileSize + 1);
         }
+        else if (randomBelow(&rng, 32) && config->maxFileSize)
+        {
+            //a random bit length, then a random size with that many bits
+            uint32_t bits = 32 - __builtin_clz(config->maxFileSize);
+            uint32_t length = 1 + randomBelow(&rng, bits);
+            uint32_t size = (1u << (length - 1)) | randomBelow(&rng, 1u << (length - 1));
+            item->size = size < config->maxFileSize ? size : config->maxFileSize;
+        }
+        uint32_t year = 15 + randomBelow(&rng, 31), month = 1 + randomBelow(&rng, 12), day = 1 + randomBelow(&rng, 28);
+        item->wrtDate = (year << 9) | (month << 5) | day;
+        item->wrtTime = (randomBelow(&rng, 24) << 11) | (randomBelow(&rng, 60) << 5) | randomBelow(&rng, 30);
+        count++;
     }
 
-    free(rootDir);
-}
+    //chains: directories first (the root too on FAT32), then files in the order they were made. The FAT is
+    //built with 32-bit entries either way and narrowed when a FAT16 image is written
+    uint32_t clusterSize = config->clusterSize, end = config->clusters + 2, cursor = 2;
+    uint32_t freeClusters = config->clusters;
+    uint32_t fatEntries = fatSectors * 512 / (isFAT32 ? 4 : 2);
+    uint32_t *fat = calloc(fatEntries, sizeof(uint32_t));
+    uint64_t *used = calloc(end / 64 + 1, sizeof(uint64_t));
+    ok = ok && fat && used;
+    for (uint32_t i = isFAT32 ? 0 : 1; ok && i < count; i++)
+    {
+        GeneratorItem *item = &items[i];
+        uint64_t bytes = item->isDirectory ? (uint64_t)item->usedSlots * 32 : item->size;
+        uint32_t needed = (bytes + clusterSize - 1) / clusterSize;
+        if (needed > freeClusters && item->isDirectory)
+        {
+            fprintf(stderr, "Not enough clusters for the directories\n");
+            ok = false;
+            break;
+        }
+        if (needed > freeClusters)
+        {
+            needed = freeClusters;
+            item->size = needed * clusterSize;
+        }
+        item->clusters = needed;
+        freeClusters -= needed;
+        generatorAllocate(&rng, config, fat, used, item, &cursor);
+    }
+    if (ok)
+    {
+        fat[0] = 0x0FFFFF00 | bs.BPB_Media;
+        fat[1] = CLUSTER_EOC;
+        bs32.BPB_RootClus = items[0].firstCluster;
+    }
 
-// below are the functions for task 5
+    //directory contents, each held as a table of slots until it is written
+    DirectoryEntry **tables = calloc(count, sizeof(DirectoryEntry *));
+    ok = ok && tables;
+    for (uint32_t i = 0; ok && i < count; i++)
+    {
+        GeneratorItem *item = &items[i];
+        if (item->isDirectory)
+        {
+            tables[i] = calloc(item->usedSlots, sizeof(DirectoryEntry));
+            ok = tables[i] != NULL;
+        }
+        if (ok && i > 0)
+        {
+            const char *parentPath = items[item->parent].path;
+            item->path = malloc(strlen(parentPath) + strlen(item->name) + 2);
+            ok = item->path != NULL;
+            if (ok)
+                sprintf(item->path, "%s/%s", parentPath, item->name);
+        }
+        else if (ok)
+        {
+            item->path = strdup("");
+            ok = item->path != NULL;
+        }
+    }
+    if (ok)
+    {
+        memcpy(tables[0][0].DIR_Name, bs.BS_VolLab, 11);
+        tables[0][0].DIR_Attr = 0x08;
+    }
+    for (uint32_t i = 1; ok && i < count; i++)
+    {
+        GeneratorItem *item = &items[i];
+        DirectoryEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.DIR_Name, item->shortName, 11);
+        entry.DIR_Attr = item->isDirectory ? 0x10 : 0x20;
+        entry.DIR_CrtDate = entry.DIR_WrtDate = entry.DIR_LstAccDate = item->wrtDate;
+        entry.DIR_CrtTime = entry.DIR_WrtTime = item->wrtTime;
+        entry.DIR_FstClusLO = item->firstCluster & 0xFFFF;
+        entry.DIR_FstClusHI = item->firstCluster >> 16;
+        entry.DIR_FileSize = item->isDirectory ? 0 : item->size;
+        DirectoryEntry *table = tables[item->parent];
+        if (item->entrySlots > 1)
+        {
+            uint16_t units[LFN_MAX_PARTS * 13];
+            int unitCount = utf8ToUtf16(item->name, units, 255);
+            buildLongEntries(units, unitCount, item->shortName, (LongDirectoryEntry *)&table[item->slot]);
+        }
+        table[item->slot + item->entrySlots - 1] = entry;
+        if (item->isDirectory)
+        {
+            //"." points at the directory itself, ".." at its parent (0 for the root directory)
+            entry.DIR_FileSize = 0;
+            memcpy(entry.DIR_Name, ".          ", 11);
+            tables[i][0] = entry;
+            memcpy(entry.DIR_Name, "..         ", 11);
+            uint32_t parentCluster = item->parent == 0 ? 0 : items[item->parent].firstCluster;
+            entry.DIR_FstClusLO = parentCluster & 0xFFFF;
+            entry.DIR_FstClusHI = parentCluster >> 16;
+            tables[i][1] = entry;
+        }
+    }
 
-//functions that convert a cluster number to a corresponding sector number
-off_t clusterToSector(const Volume *volume, uint16_t cluster)
-{
-    //calculating the first data sector offset
-    uint32_t firstDataSector = volume->bootSector.BPB_RsvdSecCnt + 
-                               (volume->bootSector.BPB_NumFATs * volume->bootSector.BPB_FATSz16) + 
-                               ((volume->bootSector.BPB_RootEntCnt * 32) + (volume->bootSector.BPB_BytsPerSec - 1)) / 
-                                volume->bootSector.BPB_BytsPerSec;
-    //calculating the sector number for a given cluster
-    return firstDataSector + (cluster - 2) * volume->bootSector.BPB_SecPerClus;
-}
+    //writing the image: boot sector (and on FAT32 the FSInfo sector and backup boot sector), every FAT copy,
+    //the root directory, directories, then file data
+    bool planned = ok;
+    int fd = ok ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+    if (ok && (fd < 0 || ftruncate(fd, (off_t)totalSectors * 512) < 0))
+    {
+        perror("Error creating image");
+        ok = false;
+    }
+    uint8_t sector[512] = {0};
+    memcpy(sector, &bs, isFAT32 ? offsetof(BootSector, BS_DrvNum) : sizeof(bs));
+    if (isFAT32)
+        memcpy(sector + offsetof(BootSector, BS_DrvNum), &bs32, sizeof(bs32));
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+    ok = ok && writeToDiskImage(fd, 0, sector, sizeof(sector));
+    if (isFAT32)
+    {
+        ok = ok && writeToDiskImage(fd, (off_t)bs32.BPB_BkBootSec * 512, sector, sizeof(sector));
+        uint8_t fsInfo[512] = {0};
+        uint32_t fields[] = {0x41615252, 0x61417272, freeClusters, cursor, 0xAA550000};
+        memcpy(fsInfo, &fields[0], 4);
+        memcpy(fsInfo + 484, &fields[1], 12);
+        memcpy(fsInfo + 508, &fields[4], 4);
+        ok = ok && writeToDiskImage(fd, (off_t)bs32.BPB_FSInfo * 512, fsInfo, sizeof(fsInfo));
+    }
+    const void *fatImage = fat;
+    uint16_t *narrow = ok && !isFAT32 ? malloc(fatEntries * sizeof(uint16_t)) : NULL;
+    if (narrow)
+    {
+        for (uint32_t i = 0; i < fatEntries; i++)
+            narrow[i] = fat[i];
+        fatImage = narrow;
+    }
+    ok = ok && (isFAT32 || narrow);
+    for (uint32_t copy = 0; ok && copy < bs.BPB_NumFATs; copy++)
+    {
+        off_t offset = (off_t)(bs.BPB_RsvdSecCnt + copy * fatSectors) * 512;
+        ok = writeToDiskImage(fd, offset, fatImage, (size_t)fatSectors * 512);
+    }
+    free(narrow);
+    off_t rootOffset = (off_t)(bs.BPB_RsvdSecCnt + bs.BPB_NumFATs * fatSectors) * 512;
+    if (!isFAT32)
+        ok = ok && writeToDiskImage(fd, rootOffset, tables[0], items[0].usedSlots * sizeof(DirectoryEntry));
+    uint8_t *buffer = malloc(GEN_WRITE_CHUNK);
+    ok = ok && buffer;
+    for (uint32_t i = isFAT32 ? 0 : 1; ok && i < count; i++)
+    {
+        GeneratorItem *item = &items[i];
+        if (item->isDirectory)
+            ok = generatorWriteChain(fd, &bs, firstDataSector, fat, item->firstCluster, (const uint8_t *)tables[i],
+                                     item->usedSlots * sizeof(DirectoryEntry));
+        else
+            ok = generatorWriteFile(fd, &bs, firstDataSector, fat, item, config->seed, i, buffer);
+    }
+    if (fd >= 0 && close(fd) < 0)
+        ok = false;
+    if (planned && fd >= 0 && !ok)
+        perror("Error writing image");
 
-//function that retrieves the next cluster in the chain from the FAT file
-uint16_t nextCluster(const Volume *volume, uint16_t currentCluster)
-{
-    uint16_t nextCluster;
-    //calculating the offset in the FAT for current cluster
-    off_t fatOffset = volume->bootSector.BPB_RsvdSecCnt * volume->bootSector.BPB_BytsPerSec + currentCluster * sizeof(uint16_t);
-    //seek position in the FAT
-    if (lseek(volume->fd, fatOffset, SEEK_SET) < 0)
+    //the manifest, sorted by path like buildManifest
+    GeneratorItem **sorted = ok && manifest ? malloc(count * sizeof(GeneratorItem *)) : NULL;
+    for (uint32_t i = 1; sorted && i < count; i++)
+        sorted[i - 1] = &items[i];
+    if (sorted)
+    {
+        qsort(sorted, count - 1, sizeof(GeneratorItem *), compareGeneratedPaths);
+        for (uint32_t i = 0; i + 1 < count; i++)
+        {
+            const GeneratorItem *e = sorted[i];
+            fprintf(manifest, "%s\t%u\t0x%02x\t%u\t%d-%02d-%02d %02d:%02d:%02d\t", e->path, e->size,
+                    e->isDirectory ? 0x10 : 0x20, e->firstCluster, ((e->wrtDate >> 9) & 0x7F) + 1980,
+                    (e->wrtDate >> 5) & 0x0F, e->wrtDate & 0x1F, e->wrtTime >> 11, (e->wrtTime >> 5) & 0x3F,
+                    (e->wrtTime & 0x1F) * 2);
+            if (e->isDirectory)
+                fprintf(manifest, "-\n");
+            else
+                fprintf(manifest, "%016llx\n", (unsigned long long)e->hash);
+        }
+    }
+    else if (ok && manifest)
     {
-        perror("Error seeking in FAT");
-        return 0xFFFF; 
+        perror("Error allocating memory for the manifest");
+        ok = false;
     }
-    //read the next cluster from the FAT
-    if (read(volume->fd, &nextCluster, sizeof(uint16_t)) != sizeof(uint16_t))
+
+    free(sorted);
+    free(buffer);
+    for (uint32_t i = 0; i < count; i++)
     {
-        perror("Error reading from FAT");
-        return 0xFFFF; 
+        free(items[i].name);
+        free(items[i].path);
+        if (tables)
+            free(tables[i]);
     }
-    return nextCluster;
+    free(tables);
+    free(items);
+    free(dirs);
+    free(fat);
+    free(used);
+    return ok;
 }
 
-ssize_t readSector(const Volume *volume, off_t sector, void *buffer)
-{
-    //Calculating the offset byte for the sector
-    off_t offset = sector * volume->bootSector.BPB_BytsPerSec;
-    //reading the sector data into buffer
-    return readFromDiskImage(volume->fd, offset, buffer, volume->bootSector.BPB_BytsPerSec);
-}
+// benchmarks
 
-// function opens file given directory entry and volume
-extern File *openFile(Volume *vol, DirectoryEntry *entry)
+//helper that records one timed sample and the bytes or entries it covered
+void benchRecord(BenchResult *result, uint64_t start, uint64_t work)
 {
-    File *file = malloc(sizeof(File));
-    if (!file)
+    uint64_t elapsed = nowNanoseconds() - start;
+    result->recorded++;
+    result->totalNs += elapsed;
+    result->work += work;
+    if (result->count == result->capacity)
     {
-        perror("Error allocating memory for this file");
-        return NULL;
+        size_t capacity = result->capacity ? result->capacity * 2 : 1024;
+        uint64_t *grown = realloc(result->samples, capacity * sizeof(uint64_t));
+        if (!grown)
+            return; //the sample is dropped from the percentiles, the totals above still count it
+        result->samples = grown;
+        result->capacity = capacity;
     }
-    //fill struct
-    file->currentCluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
-    file->fileSize = entry->DIR_FileSize;
-    file->filePosition = 0;
-    file->volume = vol;
-    return file;
+    result->samples[result->count++] = elapsed;
 }
 
-//function that sets the file position int he open file
-extern off_t seekFile(File *file, off_t offset, int whence)
+//helper for sorting samples
+int compareSamples(const void *a, const void *b)
 {
-    switch (whence)
-    {
-    case SEEK_SET: //setting position relative to the start of the file
-        file->filePosition = offset;
-        break;
-    case SEEK_CUR: //setting position relative to the current position
-        file->filePosition += offset;
-        break;
-    case SEEK_END: //setting position relative to the end of the file
-        file->filePosition = file->fileSize + offset;
-        break;
-    default:
-        perror("Seek is invalid");
-        return -1;
-    }
-    return file->filePosition;
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
 }
 
-// Read data from the file into a buffer
-extern size_t readFile(File *file, void *buffer, size_t length)
+//helper that prints one result as a JSON object: sample count, latency percentiles and throughput
+void printBenchResult(BenchResult *result, FILE *out)
 {
-    if (file->filePosition >= file->fileSize)
+    qsort(result->samples, result->count, sizeof(uint64_t), compareSamples);
+    uint64_t p50 = 0, p90 = 0, p99 = 0, max = 0;
+    if (result->count > 0)
     {
-        return 0; // end of file reached
+        p50 = result->samples[(result->count - 1) * 50 / 100];
+        p90 = result->samples[(result->count - 1) * 90 / 100];
+        p99 = result->samples[(result->count - 1) * 99 / 100];
+        max = result->samples[result->count - 1];
     }
+    double seconds = result->totalNs / 1e9;
+    double rate = seconds > 0 ? result->work / seconds : 0;
+    fprintf(out, "{\"name\": \"%s\", \"samples\": %zu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+                 "\"max_ns\": %llu, \"mean_ns\": %.0f, \"%s\": %.1f}",
+            result->name, result->count, (unsigned long long)p50, (unsigned long long)p90, (unsigned long long)p99,
+            (unsigned long long)max, result->recorded ? (double)result->totalNs / result->recorded : 0.0,
+            result->bytes ? "mb_per_s" : "entries_per_s", result->bytes ? rate / 1e6 : rate);
+}
 
-    size_t bytesRead = 0;
-    uint8_t *buf = (uint8_t *)buffer;
+//helper that builds the directory entry a manifest line describes, enough for openFile
+DirectoryEntry benchEntry(const ManifestEntry *e)
+{
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.DIR_Attr = e->attributes;
+    entry.DIR_FileSize = e->size;
+    entry.DIR_FstClusLO = e->firstCluster;
+    return entry;
+}
 
-    while (length > 0 && file->filePosition < file->fileSize)
+//function that times every hot path on one image and prints the results as a JSON array. The image is read
+//through a fresh mount with no block cache, so the figures are the code's own cost over the page cache
+bool benchImage(const char *path, uint64_t seed, int passes, FILE *out)
+{
+    int fd = openDiskImage(path);
+    Volume *volume = fd >= 0 ? mountVolume(fd, true) : NULL;
+    Manifest *manifest = volume ? buildManifest(volume, 1) : NULL;
+    size_t bufferSize = 1024 * 1024;
+    uint8_t *buffer = malloc(bufferSize);
+    if (!manifest || !buffer)
     {
-        off_t sector = clusterToSector(file->volume, file->currentCluster);
-        off_t sectorOffset = file->filePosition % file->volume->bootSector.BPB_BytsPerSec;
-        off_t clusterOffset = file->filePosition % (file->volume->bootSector.BPB_BytsPerSec * file->volume->bootSector.BPB_SecPerClus);
-        size_t bytesToRead = file->volume->bootSector.BPB_BytsPerSec - sectorOffset;
+        freeManifest(manifest);
+        free(buffer);
+        if (volume)
+            unmountVolume(volume);
+        if (fd >= 0)
+            closeDiskImage(fd);
+        return false;
+    }
+    const BootSector *bs = &volume->bootSector;
+    uint32_t clusterSize = bs->BPB_BytsPerSec * bs->BPB_SecPerClus;
+    uint64_t rng = seed;
+    BenchResult results[BENCH_KINDS] = {
+        {.name = "readFromDiskImage", .bytes = true},
+        {.name = "loadFAT", .bytes = true},
+        {.name = "getClusterChain"},
+        {.name = "nextCluster"},
+        {.name = "directoryScan"},
+        {.name = "readFileSequential", .bytes = true},
+        {.name = "readFileRandom", .bytes = true},
+        {.name = "pathLookup"},
+        {.name = "headersReadFile", .bytes = true},
+        {.name = "headersReadBatch", .bytes = true},
+        {.name = "treeBuild"},
+        {.name = "treeLookup"},
+    };
+    size_t fileCount = 0;
+    for (size_t i = 0; i < manifest->count; i++)
+        fileCount += !(manifest->entries[i].attributes & 0x10);
+    uint8_t *headers = malloc(fileCount * 4096 + 1);
+    BatchRequest *batch = calloc(fileCount + 1, sizeof(BatchRequest));
+    File **headerFiles = calloc(fileCount + 1, sizeof(File *));
+    if (!headers || !batch || !headerFiles)
+        passes = 0;
 
-        if (bytesToRead > length)
+    for (int pass = 0; pass < passes; pass++)
+    {
+        //random 4 KiB reads anywhere in the data region
+        uint64_t dataBytes = (uint64_t)volume->clusterCount * clusterSize;
+        for (int i = 0; i < 1000; i++)
+        {
+            off_t offset = ((off_t)volume->firstDataSector * bs->BPB_BytsPerSec) +
+                           ((uint64_t)randomBelow(&rng, dataBytes / 4096) * 4096);
+            uint64_t start = nowNanoseconds();
+            ssize_t n = readFromDiskImage(fd, offset, buffer, 4096);
+            benchRecord(&results[BENCH_READ_IMAGE], start, n > 0 ? n : 0);
+        }
+        for (int i = 0; i < 20; i++)
         {
-            bytesToRead = length;
+            uint64_t start = nowNanoseconds();
+            uint16_t *fat = loadFAT(fd, bs);
+            benchRecord(&results[BENCH_LOAD_FAT], start, (uint64_t)bs->BPB_FATSz16 * bs->BPB_BytsPerSec);
+            free(fat);
         }
 
-        // Ensure not to read beyond the file size
-        if (bytesRead + bytesToRead > file->fileSize)
+        //every chain, built as an array and walked entry by entry; one sample per chain
+        for (size_t i = 0; i < manifest->count; i++)
         {
-            bytesToRead = file->fileSize - bytesRead;
+            uint32_t first = manifest->entries[i].firstCluster;
+            if (first < 2)
+                continue;
+            uint64_t start = nowNanoseconds();
+            uint32_t *chain = getClusterChain(volume, first);
+            uint32_t length = 0;
+            while (chain && chain[length] != CLUSTER_EOC)
+                length++;
+            benchRecord(&results[BENCH_CLUSTER_CHAIN], start, length);
+            free(chain);
+
+            start = nowNanoseconds();
+            length = 0;
+            for (uint32_t c = first; clusterInData(volume, c) && length < volume->clusterCount; c = nextCluster(volume, c))
+                length++;
+            benchRecord(&results[BENCH_NEXT_CLUSTER], start, length);
         }
 
-        // Temporary buffer for reading a sector
-        uint8_t tempBuf[file->volume->bootSector.BPB_BytsPerSec];
-        if (readSector(file->volume, sector + (clusterOffset / file->volume->bootSector.BPB_BytsPerSec), tempBuf) < 0)
+        //every directory, root included, read with the iterator the way readDirectory does
+        for (size_t i = 0; i <= manifest->count; i++)
         {
-            perror("Error reading sector");
-            break;
+            if (i < manifest->count && !(manifest->entries[i].attributes & 0x10))
+                continue;
+            uint64_t start = nowNanoseconds();
+            DirIterator *it = dirOpen(volume, i < manifest->count ? manifest->entries[i].firstCluster : 0);
+            DirectoryItem item;
+            uint64_t entries = 0;
+            while (it && dirNext(it, &item))
+                entries++;
+            dirClose(it);
+            benchRecord(&results[BENCH_DIRECTORY_SCAN], start, entries);
         }
 
-        // Copying the required part of the sector into the buffer
-        memcpy(buf + bytesRead, tempBuf + sectorOffset, bytesToRead);
+        //every file read start to end, then random 4 KiB reads at random offsets
+        for (size_t i = 0; i < manifest->count; i++)
+        {
+            const ManifestEntry *e = &manifest->entries[i];
+            if (e->attributes & 0x10)
+                continue;
+            DirectoryEntry entry = benchEntry(e);
+            uint64_t start = nowNanoseconds(), total = 0;
+            File *file = openFile(volume, &entry);
+            size_t n;
+            while (file && (n = readFile(file, buffer, bufferSize)) > 0)
+                total += n;
+            if (file)
+                closeFile(file);
+            benchRecord(&results[BENCH_READ_SEQUENTIAL], start, total);
+        }
+        for (int i = 0; i < 1000 && manifest->count > 0; i++)
+        {
+            const ManifestEntry *e = &manifest->entries[randomBelow(&rng, manifest->count)];
+            if ((e->attributes & 0x10) || e->size == 0)
+                continue;
+            DirectoryEntry entry = benchEntry(e);
+            File *file = openFile(volume, &entry);
+            if (!file)
+                continue;
+            seekFile(file, randomBelow(&rng, e->size), SEEK_SET);
+            uint64_t start = nowNanoseconds();
+            size_t n = readFile(file, buffer, 4096);
+            benchRecord(&results[BENCH_READ_RANDOM], start, n);
+            closeFile(file);
+        }
 
-        bytesRead += bytesToRead;
-        file->filePosition += bytesToRead;
-        length -= bytesToRead;
+        //path lookups in random order; the first lookup in each directory fills the dentry cache. The same
+        //paths are then looked up in a tree built from scratch
+        uint64_t lookupSeed = rng;
+        for (size_t i = 0; i < manifest->count && i < 5000; i++)
+        {
+            const ManifestEntry *e = &manifest->entries[randomBelow(&rng, manifest->count)];
+            uint64_t start = nowNanoseconds();
+            DirectoryEntry *entry = followPath(volume, e->path);
+            benchRecord(&results[BENCH_PATH_LOOKUP], start, entry != NULL);
+            free(entry);
+        }
+        uint64_t start = nowNanoseconds();
+        DirectoryTree *tree = buildDirectoryTree(volume);
+        benchRecord(&results[BENCH_TREE_BUILD], start, tree ? tree->count : 0);
+        for (size_t i = 0; tree && i < manifest->count && i < 5000; i++)
+        {
+            const ManifestEntry *e = &manifest->entries[randomBelow(&lookupSeed, manifest->count)];
+            start = nowNanoseconds();
+            uint32_t node = treeLookup(tree, e->path);
+            benchRecord(&results[BENCH_TREE_LOOKUP], start, node != TREE_NONE);
+        }
+        freeDirectoryTree(tree);
 
-        // Moving to the next cluster
-        if (clusterOffset + bytesToRead >= file->volume->bootSector.BPB_BytsPerSec * file->volume->bootSector.BPB_SecPerClus)
+        //file type sniffing: every file's first 4 KiB, read one file at a time and then as one batch
+        size_t opened = 0;
+        for (size_t i = 0; i < manifest->count; i++)
+        {
+            const ManifestEntry *e = &manifest->entries[i];
+            if (e->attributes & 0x10)
+                continue;
+            DirectoryEntry entry = benchEntry(e);
+            File *file = openFile(volume, &entry);
+            if (!file)
+                continue;
+            headerFiles[opened] = file;
+            batch[opened] = (BatchRequest){.file = file, .length = 4096, .buffer = headers + opened * 4096};
+            opened++;
+        }
+        start = nowNanoseconds();
+        uint64_t total = 0;
+        for (size_t i = 0; i < opened; i++)
+            total += readFile(headerFiles[i], headers + i * 4096, 4096);
+        benchRecord(&results[BENCH_HEADERS_READFILE], start, total);
+        start = nowNanoseconds();
+        total = 0;
+        readBatch(volume, batch, opened);
+        for (size_t i = 0; i < opened; i++)
         {
-            file->currentCluster = nextCluster(file->volume, file->currentCluster);
+            total += batch[i].result > 0 ? batch[i].result : 0;
+            closeFile(headerFiles[i]);
         }
+        benchRecord(&results[BENCH_HEADERS_BATCH], start, total);
     }
 
-    return bytesRead;
+    fprintf(out, "[");
+    for (int k = 0; k < BENCH_KINDS; k++)
+    {
+        fprintf(out, k ? ",\n      " : "\n      ");
+        printBenchResult(&results[k], out);
+        free(results[k].samples);
+    }
+    fprintf(out, "\n    ],\n    \"stats\": ");
+    VolumeStats stats;
+    if (volumeGetStats(volume, &stats))
+        printVolumeStats(&stats, out);
+    else
+        fprintf(out, "null");
+    free(buffer);
+    free(headers);
+    free(batch);
+    free(headerFiles);
+    freeManifest(manifest);
+    unmountVolume(volume);
+    closeDiskImage(fd);
+    return true;
 }
 
-// closing file
-extern void closeFile(File *file)
+//function that generates images at several sizes and fragmentation levels in a scratch directory, benchmarks
+//each one with benchImage and prints everything as one JSON document; quick runs only the smallest images
+bool runBenchmarks(const char *directory, uint64_t seed, bool quick, FILE *out)
 {
-    free(file);
-}
-
-//task 7 trial
-
-#if 0
-//helper function for reading directory content into buffer
-DirectoryEntry* readDirectoryContent(int fd, const BootSector* bs, uint16_t firstCluster, size_t* dirSize){
-    off_t offset = clusterToSector(Volume, firstCluster) * bs->BPB_BytsPerSec; //calculatiung starting cluster of directory
-    *dirSize = bs -> BPB_RootEntCnt * sizeof(DirectoryEntry); //calculating dir size
-
-    DirectoryEntry* dir = malloc(*dirSize); //allocating memory of buffer
-
-    if(!dir){
-        perror("Error allocating memory for dir content");
-        return NULL;
-    }
-
-    if (lseek(fd, offset, SEEK_SET)<0){
-        perror("ERror seeking to dir");
-        free(dir);
-        return NULL;
+    static const struct
+    {
+        const char *name;
+        uint32_t clusters, clusterSize, files, directories, maxFileSize;
+    } sizes[] = {
+        {"small", 4096, 2048, 500, 20, 64 * 1024},
+        {"medium", 16384, 4096, 5000, 200, 256 * 1024},
+        {"full", 65524, 512, 40000, 2000, 8 * 1024},
+    };
+    static const double fragmentation[] = {0.0, 0.3};
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST)
+    {
+        perror("Error creating benchmark directory");
+        return false;
     }
 
-    if(read(fd, dir, *dirSize) != *dirSize){
-        perror("Error reading dir");
-        free(dir);
-        return NULL;
+    bool ok = true;
+    fprintf(out, "{\"seed\": %llu, \"classifier\": \"%s\", \"images\": [", (unsigned long long)seed, classifierName());
+    size_t sizeCount = quick ? 1 : sizeof(sizes) / sizeof(sizes[0]);
+    for (size_t s = 0; ok && s < sizeCount; s++)
+    {
+        for (size_t f = 0; ok && f < sizeof(fragmentation) / sizeof(fragmentation[0]); f++)
+        {
+            GeneratorConfig config = defaultGeneratorConfig();
+            config.seed = seed;
+            config.clusters = sizes[s].clusters;
+            config.clusterSize = sizes[s].clusterSize;
+            config.files = sizes[s].files;
+            config.directories = sizes[s].directories;
+            config.maxFileSize = sizes[s].maxFileSize;
+            config.fragmentation = fragmentation[f];
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s-frag%02d.img", directory, sizes[s].name, (int)(fragmentation[f] * 100));
+            ok = generateImage(path, &config, NULL);
+            if (!ok)
+                break;
+            fprintf(out, "%s\n  {\"image\": \"%s\", \"clusters\": %u, \"cluster_size\": %u, \"files\": %u, "
+                         "\"fragmentation\": %.2f,\n    \"benchmarks\": ",
+                    s + f ? "," : "", sizes[s].name, config.clusters, config.clusterSize, config.files,
+                    config.fragmentation);
+            ok = benchImage(path, seed, quick ? 1 : 3, out);
+            fprintf(out, "}");
+            unlink(path);
+        }
     }
-
-    return dir;
+    fprintf(out, "\n]}\n");
+    return ok;
 }
 
-void fatNameToString(const uint8_t *fatName, char *str){
-    int i,j;
-    for (i=0, j=0; i<8 && fatName[i] != ' ';i++, j++){
-        str[j] =fatName[i];
-    }
-    if (fatName[8] != ' '){
-        str[j++] = '.';
-        for (i=8;i<11 && fatName[i] != ' '; i++, j++){
-            str[j] = fatName[i];
+//function that runs readfat16 <image> generate [--option value]...: writes a synthetic image and its manifest
+int generateCommand(int argc, char *argv[])
+{
+    GeneratorConfig config = defaultGeneratorConfig();
+    char *manifestPath = NULL;
+    for (int i = 3; i < argc; i += 2)
+    {
+        const char *option = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool known = true;
+        if (!value)
+            known = false;
+        else if (strcmp(option, "--seed") == 0)
+            config.seed = strtoull(value, NULL, 0);
+        else if (strcmp(option, "--clusters") == 0)
+            config.clusters = strtoul(value, NULL, 0);
+        else if (strcmp(option, "--cluster-size") == 0)
+            config.clusterSize = strtoul(value, NULL, 0);
+        else if (strcmp(option, "--files") == 0)
+            config.files = strtoul(value, NULL, 0);
+        else if (strcmp(option, "--dirs") == 0)
+            config.directories = strtoul(value, NULL, 0);
+        else if (strcmp(option, "--depth") == 0)
+            config.maxDepth = strtoul(value, NULL, 0);
+        else if (strcmp(option, "--lfn") == 0)
+            config.longNameRatio = strtod(value, NULL);
+        else if (strcmp(option, "--max-size") == 0)
+            config.maxFileSize = strtoul(value, NULL, 0);
+        else if (strcmp(option, "--sizes") == 0 && strcmp(value, "uniform") == 0)
+            config.sizeDistribution = GEN_SIZES_UNIFORM;
+        else if (strcmp(option, "--sizes") == 0 && strcmp(value, "log") == 0)
+            config.sizeDistribution = GEN_SIZES_LOG;
+        else if (strcmp(option, "--frag") == 0)
+            config.fragmentation = strtod(value, NULL);
+        else if (strcmp(option, "--manifest") == 0)
+            manifestPath = strdup(value);
+        else
+            known = false;
+        if (!known)
+        {
+            fprintf(stderr, "usage: %s <image> generate [--seed N] [--clusters N] [--cluster-size BYTES] [--files N] "
+                            "[--dirs N] [--depth N] [--lfn RATIO] [--max-size BYTES] [--sizes log|uniform] "
+                            "[--frag RATIO] [--manifest FILE]\n", argv[0]);
+            free(manifestPath);
+            return EXIT_FAILURE;
         }
     }
-    str[j] = '\0';
-}
 
-///function to compare fat16 filename with c string
-bool compareFatName(const uint8_t *fatName, const char *str){
-    char temp [13];
-    fatNameToString(fatName, temp);
-    return strcmp(temp, str) == 0;
+    //the manifest goes next to the image unless asked otherwise
+    if (!manifestPath && (manifestPath = malloc(strlen(argv[1]) + sizeof(".manifest"))))
+        sprintf(manifestPath, "%s.manifest", argv[1]);
+    FILE *manifest = manifestPath ? fopen(manifestPath, "w") : NULL;
+    if (!manifest)
+    {
+        perror("Error creating manifest");
+        free(manifestPath);
+        return EXIT_FAILURE;
+    }
+    bool ok = generateImage(argv[1], &config, manifest);
+    ok = fclose(manifest) == 0 && ok;
+    if (ok)
+        printf("Wrote %s and %s\n", argv[1], manifestPath);
+    free(manifestPath);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-//function to find directory entry by name
-DirectoryEntry * findDirectoryEntry (const Volume * volume, const DirectoryEntry *directory, size_t dirSize, const char *name){
-    for (size_t i=0<dirSize/sizeof(DirectoryEntry);; i++){
-        if(directory[i].DIR_Name[0] == 0x00){//no more entries
-            break;
-        }
-        if(directory[i].DIR_Name[0] == 0xE5){//unusured entry
-            continue;
-        }
-        if (!isLongNameEntry(&directory[i] && compareFatName(directory[i].DIR_Name, name))){
-        return (DirectoryEntry *)&directory[i];
+//function that runs the command line modes: readfat16 <image> extract <dir> [threads] | tar | analyze | fsck [threads] |
+//put <host file> <path> | rm <path> | defrag [--dirs] | generate [options], or readfat16 <dir> bench [--quick]
+int runCommand(int argc, char *argv[])
+{
+    if (strcmp(argv[2], "generate") == 0)
+        return generateCommand(argc, argv);
+    if (strcmp(argv[2], "bench") == 0)
+    {
+        //here argv[1] is a scratch directory for the generated images
+        bool quick = false;
+        uint64_t seed = 1;
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--quick") == 0)
+                quick = true;
+            else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+                seed = strtoull(argv[++i], NULL, 0);
         }
+        return runBenchmarks(argv[1], seed, quick, stdout) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
-    return NULL;//entry not found
-}
-
-
-DirectoryEntry *followPath(Volume *volume, const char *path){
-    if (path == NULL || strcmp(path,"/") == 0 ){
-        //assume its the root directory, read
-        size_t rootDirSize;
-        return readDirectoryContent(volume->fd, &volume->bootSector, 0, &rootDirSize); //cluster is set to 0 for rootDir
+    bool writing = strcmp(argv[2], "put") == 0 || strcmp(argv[2], "rm") == 0 || strcmp(argv[2], "defrag") == 0;
+    int fileDesc = writing ? openDiskImageForWriting(argv[1]) : openDiskImage(argv[1]);
+    if (fileDesc < 0)
+        return EXIT_FAILURE;
+    //fsck reports mismatched FAT copies itself instead of refusing to mount
+    Volume *volume = mountVolume(fileDesc, strcmp(argv[2], "fsck") != 0);
+    if (!volume)
+    {
+        closeDiskImage(fileDesc);
+        return EXIT_FAILURE;
     }
 
-    char pathCopy[strlen(path)+1];
-    strcpy(pathCopy, path);
-
-    char *token = strtok(pathCopy, "/");
-    size_t currentDirSize;
-    DirectoryEntry* currentDir = readDirectoryContent(volume->fd, &volume->bootSector, 0, &currentDirSize); //reading the rootDirectory first
-
-    while (token != NULL){
-        DirectoryEntry *entry = findDirectoryEntry(volume, currentDir,currentDirSize, token);
-        if(entry == NULL){
-            free(currentDir);
-            return NULL;
+    int status = EXIT_FAILURE;
+    if (writing && !enableWrites(volume))
+    {
+        unmountVolume(volume);
+        closeDiskImage(fileDesc);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(argv[2], "extract") == 0 && argc >= 4)
+    {
+        int threads = argc >= 5 ? atoi(argv[4]) : sysconf(_SC_NPROCESSORS_ONLN);
+        long failures = extractVolume(volume, argv[3], threads);
+        if (failures == 0)
+            status = EXIT_SUCCESS;
+        else if (failures > 0)
+            fprintf(stderr, "%ld files could not be extracted\n", failures);
+    }
+    else if (strcmp(argv[2], "tar") == 0)
+    {
+        long failures = streamTar(volume, STDOUT_FILENO);
+        if (failures == 0)
+            status = EXIT_SUCCESS;
+        else if (failures > 0)
+            fprintf(stderr, "%ld files could not be read and were zero-padded\n", failures);
+    }
+    else if (strcmp(argv[2], "analyze") == 0)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        FatAnalysis *analysis = analyzeFAT(volume);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (analysis)
+        {
+            printFatAnalysis(analysis, stdout);
+            printf("Analyzed %u clusters in %.1f us\n", volume->clusterCount,
+                   (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+            freeFatAnalysis(analysis);
+            status = EXIT_SUCCESS;
         }
-
-        if (entry->DIR_Attr & 0x10){ //rmb 0x10 is attribute=directory
-            //read the new dir data
-            free(currentDir);//freeing the buffer
-            currentDir=readDirectoryContent(volume->fd,&volume->bootSector, entry->DIR_FstClusLO, &currentDirSize);
-            if (currentDir == NULL){
-                perror("error reading new dir");
-                return NULL;
+    }
+    else if (strcmp(argv[2], "tree") == 0)
+    {
+        //every path breadth first, as the tree holds them
+        DirectoryTree *tree = buildDirectoryTree(volume);
+        if (tree)
+        {
+            char path[4096];
+            for (uint32_t node = 1; node < tree->count; node++)
+            {
+                if (treePath(tree, node, path, sizeof(path)))
+                    printf("%s%s\t%u\n", path, (tree->attributes[node] & 0x10) ? "/" : "", tree->size[node]);
             }
-        } else if (strtok(NULL, "/") == NULL){// file AND the last token in the path
-            DirectoryEntry* foundEntry = malloc(sizeof(DirectoryEntry));
-            memcpy(foundEntry, entry, sizeof(DirectoryEntry));
-            free(currentDir);
-            return foundEntry;
+            printf("%u entries, %u distinct names, %zu bytes\n", tree->count - 1, tree->nameCount, tree->arena.bytes);
+            freeDirectoryTree(tree);
+            status = EXIT_SUCCESS;
         }
-        token = strtok(NULL, "/");
     }
-    free(currentDir);
-    return NULL;
-}
+    else if (strcmp(argv[2], "fsck") == 0)
+    {
+        int threads = argc >= 4 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+        FsckReport *report = fsckVolume(volume, threads);
+        if (report)
+        {
+            printFsckReport(report, stdout);
+            if (report->count == 0)
+                status = EXIT_SUCCESS;
+            freeFsckReport(report);
+        }
+    }
+    else if (strcmp(argv[2], "put") == 0 && argc >= 5)
+    {
+        //copying a host file in, replacing any file already at the path
+        int hostFd = open(argv[3], O_RDONLY);
+        File *file = hostFd >= 0 ? createFile(volume, argv[4]) : NULL;
+        if (hostFd < 0)
+            perror("Error opening host file");
+        if (file && truncateFile(file, 0))
+        {
+            uint8_t buffer[65536];
+            ssize_t n;
+            bool ok = true;
+            while (ok && (n = read(hostFd, buffer, sizeof(buffer))) > 0)
+                ok = writeFile(file, buffer, n) == n;
+            if (ok && n == 0 && syncFile(file))
+                status = EXIT_SUCCESS;
+        }
+        closeFile(file);
+        if (hostFd >= 0)
+            close(hostFd);
+    }
+    else if (strcmp(argv[2], "rm") == 0 && argc >= 4)
+    {
+        if (unlinkFile(volume, argv[3]))
+            status = EXIT_SUCCESS;
+    }
+    else if (strcmp(argv[2], "defrag") == 0)
+    {
+        DefragStats stats;
+        bool includeDirectories = argc >= 4 && strcmp(argv[3], "--dirs") == 0;
+        if (defragVolume(volume, includeDirectories, &stats) && stats.complete)
+            status = EXIT_SUCCESS;
+        printf("Moved %u files and %u directories (%u out of the way), %llu clusters copied, %u commits%s\n",
+               stats.filesMoved, stats.directoriesMoved, stats.evacuations, (unsigned long long)stats.clustersCopied,
+               stats.commits, stats.complete ? "" : ", incomplete");
+        if (stats.fragmented > 0)
+            printf("%u chains are still fragmented\n", stats.fragmented);
+    }
+    else
+    {
+        fprintf(stderr, "usage: %s <image> extract <dir> [threads]\n       %s <image> tar > archive.tar\n"
+                        "       %s <image> analyze\n       %s <image> tree\n       %s <image> fsck [threads]\n"
+                        "       %s <image> put <host file> <path>\n       %s <image> rm <path>\n"
+                        "       %s <image> defrag [--dirs]\n       %s <image> generate [--seed N] [options]\n"
+                        "       %s <scratch dir> bench [--quick] [--seed N]\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    }
 
-#endif
+    unmountVolume(volume);
+    closeDiskImage(fileDesc);
+    return status;
+}
 
-int main()
+int main(int argc, char *argv[])
 {
     setlocale(LC_ALL, "");
+    if (argc >= 3)
+    {
+        return runCommand(argc, argv);
+    }
     printf("\n");
-    // defining the path to the FAT file
-    const char *filepath = "/home/laur1/h-drive/scc211/FAT16/fat16.img";
+    // defining the path to the FAT file, the first argument when there is one
+    const char *filepath = argc >= 2 ? argv[1] : "/home/laur1/h-drive/scc211/FAT16/fat16.img";
 
     // open FAT disk image
     int fileDesc = openDiskImage(filepath);
@@ -737,20 +8683,29 @@ int main()
     // linebreak for readability
     printf("\n");
 
+    // mounting the volume, this loads the FAT once and checks the copies agree
+    Volume *volume = mountVolume(fileDesc, true);
+    if (!volume)
+    {
+        closeDiskImage(fileDesc);
+        return EXIT_FAILURE;
+    }
+
     // task 3 reading and printing cluster chain
-    uint16_t startingCluster = 1304;
+    uint32_t startingCluster = 1304;
 
     // getting the cluster chain starting from startingCluster
-    uint16_t *clusterChain = getClusterChain(fileDesc, &bootSector, startingCluster);
+    uint32_t *clusterChain = getClusterChain(volume, startingCluster);
     if (!clusterChain)
     {
+        unmountVolume(volume);
         closeDiskImage(fileDesc);
         return EXIT_FAILURE;
     }
 
     // printing the cluster numbers
     printf("Cluster Chain: \n");
-    for (int i = 0; clusterChain[i] != 0xFFFF; i++)
+    for (int i = 0; clusterChain[i] != CLUSTER_EOC; i++)
     {
         printf("%u ", clusterChain[i]);
     }
@@ -763,12 +8718,23 @@ int main()
     free(clusterChain);
 
     // task 4: reading and printing root directory
-    readDirectory(fileDesc, &bootSector);
+    readDirectory(volume, 0);
+
+    // measuring how fast the root directory can be scanned
+    size_t rootDirSize = bootSector.BPB_RootEntCnt * sizeof(DirectoryEntry);
+    off_t rootDirOffset = (bootSector.BPB_RsvdSecCnt + (bootSector.BPB_NumFATs * volume->fatSectors)) * bootSector.BPB_BytsPerSec;
+    DirectoryEntry *rootDir = malloc(rootDirSize);
+    //a FAT32 root directory is a cluster chain with no fixed region to time
+    if (rootDir && rootDirSize > 0 && readVolume(volume, rootDirOffset, rootDir, rootDirSize) == (ssize_t)rootDirSize)
+    {
+        printf("Directory scan (%s): %.0f entries/s\n\n", classifierName(),
+               measureScanRate(rootDir, bootSector.BPB_RootEntCnt, 1000));
+    }
+    free(rootDir);
 
     // task 5: opening and printing file content
 
     // Prepare to read a file
-    Volume volume = {.fd = fileDesc, .bootSector = bootSector};
     DirectoryEntry myFileDirEntry;
     // Filename
     memcpy(myFileDirEntry.DIR_Name, "SESSIONSTXT", 11);
@@ -789,17 +8755,19 @@ int main()
     if (!fileBuffer)
     {
         perror("Error allocating read buffer");
-        closeDiskImage(volume.fd);
+        unmountVolume(volume);
+        closeDiskImage(fileDesc);
         return EXIT_FAILURE;
     }
 
     // Open and read the file
-    File *myFile = openFile(&volume, &myFileDirEntry);
+    File *myFile = openFile(volume, &myFileDirEntry);
     if (!myFile)
     {
         perror("Error opening file");
         free(fileBuffer);
-        closeDiskImage(volume.fd);
+        unmountVolume(volume);
+        closeDiskImage(fileDesc);
         return EXIT_FAILURE;
     }
 
@@ -818,14 +8786,19 @@ int main()
 
 
     //task 7  given a path with mix of file and directory names output the corresponding file
-    //not sure what the brief means in terms of how the filepath is arragned.. /(rootdirectory)/(dir2?)
-    //logic:
-    //split the fileEntry path into components e.g. SESSIONSTXT and dir1 etc etc would be stored separately
-    //use separated components to traverse the directorty struct and find the target file
-    //use a function to search for a directory given the name component, use strcomp? but then we need to decode the fileName within the FAT file first
-
+    const char *path = "/DIR1/SESSIONS.TXT";
+    File *pathFile = openPath(volume, path);
+    if (pathFile)
+    {
+        size_t pathBytesRead = readFile(pathFile, fileBuffer, fileBufferLength);
+        fileBuffer[pathBytesRead] = '\0';
+        printf("Contents of %s:\n%s\n", path, fileBuffer);
+        closeFile(pathFile);
+    }
 
-    const char *path = "/SESSIONSTXT/dir1";
+    closeFile(myFile);
+    free(fileBuffer);
+    unmountVolume(volume);
 
     // closing the disk iamge
     closeDiskImage(fileDesc);